@@ -0,0 +1,49 @@
+#ifndef RAYTRACING_ANIMATION_H
+#define RAYTRACING_ANIMATION_H
+
+#include <algorithm>
+#include <vector>
+
+/// An animated value: keys at given frames, linearly interpolated in between, and held
+/// before the first and after the last key. T needs T + T and T * double.
+template <class T>
+class Track
+{
+public:
+    void AddKey(double frame, const T& value)
+    {
+        Key key{frame, value};
+        auto it = std::upper_bound(m_Keys.begin(), m_Keys.end(), key, [](const Key& a, const Key& b) { return a.frame < b.frame; });
+        m_Keys.insert(it, key);
+    }
+
+    bool IsAnimated() const { return !m_Keys.empty(); }
+
+    /// the value at the given frame (which may be fractional); the track must have at least one key
+    T Evaluate(double frame) const
+    {
+        if (frame <= m_Keys.front().frame)
+            return m_Keys.front().value;
+        if (frame >= m_Keys.back().frame)
+            return m_Keys.back().value;
+
+        size_t i = 1;
+        while (m_Keys[i].frame < frame)
+            ++i;
+
+        const Key& a = m_Keys[i - 1];
+        const Key& b = m_Keys[i];
+        const double t = (frame - a.frame) / (b.frame - a.frame);
+        return a.value * (1 - t) + b.value * t;
+    }
+
+private:
+    struct Key
+    {
+        double frame;
+        T value;
+    };
+    std::vector<Key> m_Keys; //!< sorted by frame
+};
+
+#endif //RAYTRACING_ANIMATION_H
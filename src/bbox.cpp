@@ -1,8 +1,11 @@
 #include "bbox.h"
 
+#include <algorithm>
+
 #include "constants.h"
 #include "utils.h"
 #include "ray.h"
+#include "raypacket.h"
 
 void BBox::MakeEmpty()
 {
@@ -21,6 +24,12 @@ void BBox::Add(const Vector& point)
     m_Max.z = std::max(m_Max.z, point.z);
 }
 
+void BBox::Add(const BBox& box)
+{
+    Add(box.m_Min);
+    Add(box.m_Max);
+}
+
 bool BBox::IsInside(const Vector& point) const
 {
     bool result = IsBetween(point.x, m_Min.x, m_Max.x)
@@ -96,6 +105,41 @@ bool BBox::TestIntersect(const Ray& ray) const
     return false;
 }
 
+bool BBox::TestIntersect(const RayPacket& packet) const
+{
+    // The slabs' distance intervals, bounded over all the rays. The box is inflated a bit, beyond the tolerance of
+    // the single-ray tests (IsInside() allows 1e-6), so that rounding never culls a box one of the rays would hit.
+    double enter = -INF;
+    double exit = INF;
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        if (!packet.IsAxisCoherent(dim))
+            continue;
+
+        const double eps = 1e-5 + 1e-9*std::max(std::fabs(m_Min[dim]), std::fabs(m_Max[dim]));
+        const bool positive = packet.GetInvDirMin(dim) > 0;
+        const double nearPlane = positive ? m_Min[dim] - eps : m_Max[dim] + eps;
+        const double farPlane = positive ? m_Max[dim] + eps : m_Min[dim] - eps;
+        const double invMin = packet.GetInvDirMin(dim);
+        const double invMax = packet.GetInvDirMax(dim);
+        const double originMin = packet.GetOriginMin()[dim];
+        const double originMax = packet.GetOriginMax()[dim];
+
+        const double nearDists[4] = {
+            (nearPlane - originMin)*invMin, (nearPlane - originMin)*invMax,
+            (nearPlane - originMax)*invMin, (nearPlane - originMax)*invMax
+        };
+        const double farDists[4] = {
+            (farPlane - originMin)*invMin, (farPlane - originMin)*invMax,
+            (farPlane - originMax)*invMin, (farPlane - originMax)*invMax
+        };
+        enter = std::max(enter, *std::min_element(nearDists, nearDists + 4));
+        exit = std::min(exit, *std::max_element(farDists, farDists + 4));
+    }
+
+    return exit >= 0 && enter <= exit;
+}
+
 double BBox::ClosestIntersection(const Ray& ray) const
 {
     if (IsInside(ray.start))
@@ -207,4 +251,10 @@ double BBox::GetArea() const
     double result = 2.*(m_Max.x - m_Min.x)*(m_Max.y - m_Min.y)*(m_Max.z - m_Min.z);
     result = std::abs(result);
     return result;
+}
+
+double BBox::GetSurfaceArea() const
+{
+    const Vector size = m_Max - m_Min;
+    return 2.*(size.x*size.y + size.y*size.z + size.z*size.x);
 }
\ No newline at end of file
@@ -17,6 +17,7 @@ enum class Axis
 bool IntersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& dist);
 
 struct Ray;
+class RayPacket;
 class BBox
 {
 public:
@@ -29,12 +30,16 @@ public:
     void SetMax(const Vector& max) { m_Max = max; }
 
     double GetArea() const;
+    double GetSurfaceArea() const;
 
     void MakeEmpty();
     void Add(const Vector& point);
+    void Add(const BBox& box);
 
     bool IsInside(const Vector& point) const;
     bool TestIntersect(const Ray& ray) const;
+    /// false only if none of the packet's rays can hit the box (which TestIntersect() of each would confirm)
+    bool TestIntersect(const RayPacket& packet) const;
     double ClosestIntersection(const Ray& ray) const;
     bool IntersectTriangle(const Vector& a, const Vector& b, const Vector& c) const;
     void Split(Axis axis, double where, BBox& left, BBox& right) const;
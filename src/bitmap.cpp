@@ -184,13 +184,13 @@ bool Bitmap::SaveBMP(const char* filename)
     if (!fp) return false;
     BmpHeader hd;
     BmpInfoHeader hi;
-    char xx[VFB_MAX_SIZE * 3];
 
 
     // fill in the header:
     int rowsz = m_Width * 3;
     if (rowsz % 4)
         rowsz += 4 - (rowsz % 4); // each row in of the image should be filled with zeroes to the next multiple-of-four boundary
+    std::vector<char> xx(rowsz, 0);
     hd.fs = rowsz * m_Height + 54; //std image size
     hd.lzero = 0;
     hd.bfImgOffset = 54;
@@ -213,7 +213,7 @@ bool Bitmap::SaveBMP(const char* filename)
             xx[x * 3 + 1] = (0xff00   & t) >> 8;
             xx[x * 3 + 2] = (0xff0000 & t) >> 16;
         }
-        fwrite(xx, rowsz, 1, fp);
+        fwrite(xx.data(), rowsz, 1, fp);
     }
     fclose(fp);
     return true;
@@ -0,0 +1,179 @@
+#include "buckets.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#include "constants.h"
+#include "scene.h"
+#include "utils.h"
+
+Rect::Rect(int _x0, int _y0, int _x1, int _y1)
+: x0{_x0}
+, y0{_y0}
+, x1{_x1}
+, y1{_y1}
+{
+    w = x1 - x0;
+    h = y1 - y0;
+}
+
+void Rect::Clip(int maxX, int maxY)
+{
+    x1 = std::min(x1, maxX);
+    y1 = std::min(y1, maxY);
+    w = std::max(0, x1 - x0);
+    h = std::max(0, y1 - y0);
+}
+
+int GetBucketSize()
+{
+    return scene.settings.bucketSize;
+}
+
+bool ParseBucketOrder(const char* name, BucketOrder& outOrder)
+{
+    if (!strcmp(name, "rows")) outOrder = BucketOrder::Rows;
+    else if (!strcmp(name, "hilbert")) outOrder = BucketOrder::Hilbert;
+    else if (!strcmp(name, "morton")) outOrder = BucketOrder::Morton;
+    else if (!strcmp(name, "spiral")) outOrder = BucketOrder::Spiral;
+    else return false;
+    return true;
+}
+
+/// the index of (x, y) along the Hilbert curve which fills a size x size grid (size is a power of 2)
+static unsigned HilbertIndex(unsigned size, unsigned x, unsigned y)
+{
+    unsigned index = 0;
+    for (unsigned s = size / 2; s > 0; s /= 2)
+    {
+        const unsigned rx = (x & s) ? 1 : 0;
+        const unsigned ry = (y & s) ? 1 : 0;
+        index += s * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant, so the sub-curve connects to its neighbours
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+/// the index of (x, y) along the Morton (Z-order) curve: the bits of x and y, interleaved
+static unsigned MortonIndex(unsigned x, unsigned y)
+{
+    unsigned index = 0;
+    for (unsigned bit = 0; bit < 16; ++bit)
+        index |= ((x >> bit) & 1) << (2*bit) | ((y >> bit) & 1) << (2*bit + 1);
+    return index;
+}
+
+std::vector<Rect> GetBucketList(int frameWidth, int frameHeight)
+{
+    const int bucket_size = GetBucketSize();
+    const int bw = (frameWidth - 1) / bucket_size + 1;
+    const int bh = (frameHeight - 1) / bucket_size + 1;
+
+    // the buckets' grid coordinates, in the requested order
+    std::vector<std::pair<int, int>> cells;
+    for (int y = 0; y < bh; ++y)
+        for (int x = 0; x < bw; ++x)
+            cells.push_back({x, y});
+
+    // the curves are traversed over the smallest power-of-two grid which covers the buckets,
+    // skipping the cells outside of the frame (the order of the rest is kept)
+    unsigned gridSize = 1;
+    while (gridSize < static_cast<unsigned>(std::max(bw, bh)))
+        gridSize *= 2;
+
+    std::vector<double> keys(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        const int x = cells[i].first;
+        const int y = cells[i].second;
+        switch (scene.settings.bucketOrder)
+        {
+            case BucketOrder::Rows:
+                keys[i] = y * bw + (y % 2 == 0 ? x : bw - 1 - x); // boustrophedon
+                break;
+            case BucketOrder::Hilbert:
+                keys[i] = HilbertIndex(gridSize, x, y);
+                break;
+            case BucketOrder::Morton:
+                keys[i] = MortonIndex(x, y);
+                break;
+            case BucketOrder::Spiral:
+            {
+                // ring by ring (the Chebyshev distance to the centre), and clockwise within a ring
+                const double dx = x - (bw - 1) / 2.;
+                const double dy = y - (bh - 1) / 2.;
+                const double ring = std::max(fabs(dx), fabs(dy)); // a multiple of 0.5
+                keys[i] = NearestInt(ring * 2) * 8 + (atan2(dy, dx) + PI) / (2*PI) * 7.999;
+                break;
+            }
+        }
+    }
+
+    std::vector<size_t> order(cells.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+    const GlobalSettings& settings = scene.settings;
+    std::vector<Rect> result;
+    result.reserve(order.size());
+    for (size_t i : order)
+    {
+        const int x = cells[i].first;
+        const int y = cells[i].second;
+        Rect r(x*bucket_size, y*bucket_size, (x + 1)*bucket_size, (y + 1)*bucket_size);
+        r.Clip(frameWidth, frameHeight);
+        if (settings.useRegion)
+        {
+            const Rect& region = settings.region;
+            r = Rect(std::max(r.x0, region.x0), std::max(r.y0, region.y0), std::min(r.x1, region.x1), std::min(r.y1, region.y1));
+            if (r.w <= 0 || r.h <= 0)
+                continue;
+        }
+        result.push_back(r);
+    }
+
+    // a share of the buckets, for one of tileCount machines: taking every tileCount-th one (rather than a
+    // contiguous block) keeps the shares similarly expensive, as neighbouring buckets usually are
+    if (settings.tileCount > 1)
+    {
+        std::vector<Rect> share;
+        for (size_t i = settings.tileIndex; i < result.size(); i += settings.tileCount)
+            share.push_back(result[i]);
+        result.swap(share);
+    }
+
+    return result;
+}
+
+Rect GetBucketGridBounds(const std::vector<Rect>& buckets, int frameWidth, int frameHeight)
+{
+    if (buckets.empty())
+        return Rect(0, 0, 0, 0);
+
+    const int bucket_size = GetBucketSize();
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+    for (const Rect& r : buckets)
+    {
+        x0 = std::min(x0, r.x0 / bucket_size * bucket_size);
+        y0 = std::min(y0, r.y0 / bucket_size * bucket_size);
+        x1 = std::max(x1, (r.x1 + bucket_size - 1) / bucket_size * bucket_size);
+        y1 = std::max(y1, (r.y1 + bucket_size - 1) / bucket_size * bucket_size);
+    }
+
+    Rect result(x0, y0, x1, y1);
+    result.Clip(frameWidth, frameHeight);
+    return result;
+}
@@ -0,0 +1,39 @@
+#ifndef RAYTRACING_BUCKETS_H
+#define RAYTRACING_BUCKETS_H
+
+#include <vector>
+
+/**
+ * @File buckets.h
+ * @Brief the rectangles the frame is rendered in, and the order they are handed out (no display code, so the
+ * scene settings can use them)
+ */
+
+struct Rect
+{
+    int x0, y0, x1, y1, w, h;
+
+    Rect() {}
+    Rect(int _x0, int _y0, int _x1, int _y1);
+
+    void Clip(int maxX, int maxY); // clips the rectangle against image size
+};
+
+enum class BucketOrder
+{
+    Rows,    //!< row by row, alternating the direction (boustrophedon)
+    Hilbert, //!< along a Hilbert curve: consecutive buckets are always neighbours
+    Morton,  //!< along a Z-order curve: nearly as coherent, cheaper to compute
+    Spiral   //!< from the centre outwards, for previews
+};
+
+bool ParseBucketOrder(const char* name, BucketOrder& outOrder);
+
+int GetBucketSize(); //!< from the scene settings
+/// the buckets to render, in the order from the scene settings. For partial renders (see GlobalSettings::region and
+/// tileIndex), only the chosen ones are listed (those on the region's border are clipped to it)
+std::vector<Rect> GetBucketList(int frameWidth, int frameHeight);
+/// the smallest rectangle aligned to the bucket grid, which holds all the given buckets
+Rect GetBucketGridBounds(const std::vector<Rect>& buckets, int frameWidth, int frameHeight);
+
+#endif //RAYTRACING_BUCKETS_H
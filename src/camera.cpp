@@ -1,10 +1,17 @@
 #include "camera.h"
 
-#include "sdl.h"
+#include "scene.h"
 #include "utils.h"
 
 void Camera::BeginFrame()
 {
+    const double frame = scene.frame;
+    if (m_PositionKeys.IsAnimated()) m_Position = m_PositionKeys.Evaluate(frame);
+    if (m_YawKeys.IsAnimated()) m_Yaw = m_YawKeys.Evaluate(frame);
+    if (m_PitchKeys.IsAnimated()) m_Pitch = m_PitchKeys.Evaluate(frame);
+    if (m_RollKeys.IsAnimated()) m_Roll = m_RollKeys.Evaluate(frame);
+    if (m_FOVKeys.IsAnimated()) m_FOV = m_FOVKeys.Evaluate(frame);
+
     double wantedAngle = ToRadians(m_FOV/2.);
     double wantedLength = tan(wantedAngle);
     double actualLength = sqrt(Sqr(m_AspectRatio) + 1.);
@@ -25,8 +32,8 @@ void Camera::BeginFrame()
 
 Ray Camera::GetScreenRay(double x, double y) const
 {
-    const int frameWidth = GetFrameWidth();
-    const int frameHeight = GetFrameHeight();
+    const int frameWidth = scene.settings.frameWidth;
+    const int frameHeight = scene.settings.frameHeight;
     const Vector throughPoint =
             m_TopLeft + (m_TopRight - m_TopLeft)*(x / frameWidth) +
                         (m_BottomLeft - m_TopLeft)*(y / frameHeight);
@@ -37,16 +44,27 @@ Ray Camera::GetScreenRay(double x, double y) const
     ray.dir = throughPoint - m_Position;
     ray.dir.Normalize();
 
+    // the camera ray starts the sample's ray tree, with all of its budget
+    if (scene.settings.rayBudget > 0)
+        ray.budget = scene.settings.rayBudget;
+
     return ray;
 }
 
 void Camera::FillProperties(ParsedBlock& pb)
 {
-    pb.RequiredProp("position");
+    pb.GetAnimatedProp("keyPosition", m_PositionKeys);
+    if (!m_PositionKeys.IsAnimated())
+        pb.RequiredProp("position");
     pb.GetVectorProp("position", &m_Position);
     pb.GetDoubleProp("aspectRatio", &m_AspectRatio, 1e-6);
     pb.GetDoubleProp("fov", &m_FOV, 0.0001, 179);
     pb.GetDoubleProp("yaw", &m_Yaw);
     pb.GetDoubleProp("pitch", &m_Pitch, -90, 90);
     pb.GetDoubleProp("roll", &m_Roll);
+
+    pb.GetAnimatedProp("keyYaw", m_YawKeys);
+    pb.GetAnimatedProp("keyPitch", m_PitchKeys);
+    pb.GetAnimatedProp("keyRoll", m_RollKeys);
+    pb.GetAnimatedProp("keyFOV", m_FOVKeys);
 }
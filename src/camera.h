@@ -1,6 +1,7 @@
 #ifndef RAYTRACING_CAMERA_H
 #define RAYTRACING_CAMERA_H
 
+#include "animation.h"
 #include "matrix.h"
 #include "ray.h"
 #include "vector.h"
@@ -37,6 +38,13 @@ private:
 
     double m_AspectRatio = 4./3.;
     double m_FOV = 90.;
+
+    // keyframes (keyPosition, keyYaw, ...); when present, they override the static values in BeginFrame()
+    Track<Vector> m_PositionKeys;
+    Track<double> m_YawKeys;
+    Track<double> m_PitchKeys;
+    Track<double> m_RollKeys;
+    Track<double> m_FOVKeys;
 };
 
 #endif //RAYTRACING_CAMERA_H
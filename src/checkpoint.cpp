@@ -0,0 +1,336 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <SDL.h>
+
+#include "utils.h"
+
+namespace
+{
+
+const char MAGIC[8] = {'Q', 'D', 'C', 'H', 'K', 'P', 'T', '1'};
+
+/// the file starts with this (the machine which resumes is the one which wrote it, so it's stored as it is); then
+/// come the bucket flags (numBuckets bytes), the pixels (width*height*3 floats) and the aux data
+struct FileHeader
+{
+    char magic[8];
+    uint64_t sceneKey;
+    uint64_t bucketsKey;
+    int32_t frame;
+    int32_t mode;
+    int32_t pass;
+    int32_t width;
+    int32_t height;
+    int32_t numBuckets;
+    uint64_t auxSize;
+    uint64_t values[4];
+};
+
+/// 64-bit FNV-1a
+uint64_t Hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+uint64_t HashFile(const char* filename)
+{
+    uint64_t hash = Hash(nullptr, 0);
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return hash;
+
+    FileRAII fd(f);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        hash = Hash(buffer, n, hash);
+    return hash;
+}
+
+uint64_t HashBuckets(const std::vector<Rect>& buckets)
+{
+    uint64_t hash = Hash(nullptr, 0);
+    for (const Rect& r : buckets)
+    {
+        const int32_t corners[4] = {r.x0, r.y0, r.x1, r.y1};
+        hash = Hash(corners, sizeof(corners), hash);
+    }
+    return hash;
+}
+
+} // namespace
+
+Checkpoint::Checkpoint()
+: m_Lock(SDL_CreateMutex())
+{
+}
+
+Checkpoint::~Checkpoint()
+{
+    SDL_DestroyMutex(m_Lock);
+}
+
+void Checkpoint::Init(const std::string& filename, double interval, const char* sceneFile)
+{
+    m_Filename = filename;
+    m_Interval = interval;
+    m_SceneKey = HashFile(sceneFile);
+    m_LastSaveTicks = SDL_GetTicks();
+}
+
+bool Checkpoint::Load()
+{
+    FILE* f = fopen(m_Filename.c_str(), "rb");
+    if (!f)
+    {
+        printf("No checkpoint in `%s', starting from the beginning\n", m_Filename.c_str());
+        return false;
+    }
+    FileRAII fd(f);
+
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        printf("`%s' isn't a checkpoint, starting from the beginning\n", m_Filename.c_str());
+        return false;
+    }
+    if (header.sceneKey != m_SceneKey)
+    {
+        printf("The checkpoint `%s' is of a different scene, starting from the beginning\n", m_Filename.c_str());
+        return false;
+    }
+
+    std::vector<uint8_t> done(std::max(0, header.numBuckets));
+    std::vector<float> pixels(static_cast<size_t>(std::max(0, header.width)) * std::max(0, header.height) * 3);
+    std::vector<uint8_t> aux(pixels.size() / 3 * header.auxSize);
+    if (fread(done.data(), 1, done.size(), f) != done.size() ||
+        fread(pixels.data(), sizeof(float), pixels.size(), f) != pixels.size() ||
+        fread(aux.data(), 1, aux.size(), f) != aux.size())
+    {
+        printf("The checkpoint `%s' is truncated, starting from the beginning\n", m_Filename.c_str());
+        return false;
+    }
+
+    m_Frame = header.frame;
+    m_Mode = static_cast<CheckpointMode>(header.mode);
+    m_Pass = header.pass;
+    std::copy(header.values, header.values + 4, m_Values);
+    m_BucketsKey = header.bucketsKey;
+    m_Done.swap(done);
+    m_Width = header.width;
+    m_Height = header.height;
+    m_AuxSize = header.auxSize;
+    m_Pixels.swap(pixels);
+    m_Aux.swap(aux);
+
+    const long numDone = std::count(m_Done.begin(), m_Done.end(), 1);
+    printf("Resuming from `%s': frame %d, pass %d, %ld of %d buckets done\n", m_Filename.c_str(), m_Frame, m_Pass,
+           numDone, (int) m_Done.size());
+    return true;
+}
+
+bool Checkpoint::Resume(int frame, CheckpointMode mode, const std::vector<Rect>& buckets, int width, int height,
+                        const void* aux, size_t auxSize)
+{
+    MutexRAII raii(m_Lock);
+
+    m_Buckets = buckets;
+    m_BucketIndex.clear();
+    for (int i = 0; i < (int) buckets.size(); ++i)
+        m_BucketIndex[std::make_pair(buckets[i].x0, buckets[i].y0)] = i;
+
+    const uint64_t bucketsKey = HashBuckets(buckets);
+    if (frame == m_Frame && mode == m_Mode && m_Pass >= 0 && bucketsKey == m_BucketsKey && width == m_Width &&
+        height == m_Height && auxSize == m_AuxSize && m_Done.size() == buckets.size())
+        return true;
+
+    m_Frame = frame;
+    m_Mode = mode;
+    m_Pass = -1;
+    std::fill(m_Values, m_Values + 4, 0);
+    m_BucketsKey = bucketsKey;
+    m_Done.assign(buckets.size(), 0);
+    m_Width = width;
+    m_Height = height;
+    m_AuxSize = auxSize;
+    m_Pixels.assign(static_cast<size_t>(width) * height * 3, 0.f);
+    if (aux)
+        m_Aux.assign(static_cast<const uint8_t*>(aux), static_cast<const uint8_t*>(aux) + static_cast<size_t>(width) * height * auxSize);
+    else
+        m_Aux.clear();
+    return false;
+}
+
+void Checkpoint::Restore(Framebuffer& vfb, void* aux) const
+{
+    MutexRAII raii(m_Lock);
+
+    const float* p = m_Pixels.data();
+    for (int y = 0; y < m_Height; ++y)
+        for (int x = 0; x < m_Width; ++x, p += 3)
+            vfb[y][x] = Color(p[0], p[1], p[2]);
+
+    if (aux)
+        memcpy(aux, m_Aux.data(), m_Aux.size());
+}
+
+void Checkpoint::StartPass(int pass, std::initializer_list<uint64_t> values)
+{
+    MutexRAII raii(m_Lock);
+
+    if (pass == m_Pass)
+        return; // resumed
+
+    m_Pass = pass;
+    std::fill(m_Values, m_Values + 4, 0);
+    std::copy(values.begin(), values.begin() + std::min<size_t>(values.size(), 4), m_Values);
+    std::fill(m_Done.begin(), m_Done.end(), 0);
+}
+
+int Checkpoint::FindBucket(const Rect& r) const
+{
+    const auto it = m_BucketIndex.find(std::make_pair(r.x0, r.y0));
+    return it != m_BucketIndex.end() ? it->second : -1;
+}
+
+bool Checkpoint::IsBucketDone(const Rect& r) const
+{
+    MutexRAII raii(m_Lock);
+
+    const int index = FindBucket(r);
+    return index >= 0 && m_Done[index];
+}
+
+std::vector<Rect> Checkpoint::GetRemainingBuckets() const
+{
+    MutexRAII raii(m_Lock);
+
+    std::vector<Rect> remaining;
+    for (size_t i = 0; i < m_Buckets.size(); ++i)
+        if (!m_Done[i])
+            remaining.push_back(m_Buckets[i]);
+    return remaining;
+}
+
+void Checkpoint::BucketDone(const Rect& r, const Framebuffer& vfb, const void* aux)
+{
+    MutexRAII raii(m_Lock);
+
+    const int index = FindBucket(r);
+    if (index < 0)
+        return;
+
+    for (int y = r.y0; y < r.y1; ++y)
+    {
+        float* p = &m_Pixels[(static_cast<size_t>(y) * m_Width + r.x0) * 3];
+        for (int x = r.x0; x < r.x1; ++x, p += 3)
+        {
+            p[0] = vfb[y][x].r;
+            p[1] = vfb[y][x].g;
+            p[2] = vfb[y][x].b;
+        }
+
+        if (aux && m_AuxSize)
+        {
+            const size_t offset = (static_cast<size_t>(y) * m_Width + r.x0) * m_AuxSize;
+            memcpy(&m_Aux[offset], static_cast<const uint8_t*>(aux) + offset, r.w * m_AuxSize);
+        }
+    }
+    m_Done[index] = 1;
+
+    if (SDL_GetTicks() - m_LastSaveTicks >= m_Interval * 1000)
+        SaveLocked();
+}
+
+void Checkpoint::Save()
+{
+    MutexRAII raii(m_Lock);
+    SaveLocked();
+}
+
+void Checkpoint::SaveLocked()
+{
+    const Uint32 startTicks = SDL_GetTicks();
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.sceneKey = m_SceneKey;
+    header.bucketsKey = m_BucketsKey;
+    header.frame = m_Frame;
+    header.mode = static_cast<int32_t>(m_Mode);
+    header.pass = m_Pass;
+    header.width = m_Width;
+    header.height = m_Height;
+    header.numBuckets = (int32_t) m_Done.size();
+    header.auxSize = m_AuxSize;
+    std::copy(m_Values, m_Values + 4, header.values);
+
+    // written next to the checkpoint, and then renamed over it, so there's always a complete one
+    const std::string tempFilename = m_Filename + ".tmp";
+    FILE* f = fopen(tempFilename.c_str(), "wb");
+    if (!f)
+    {
+        printf("Cannot write the checkpoint `%s'\n", tempFilename.c_str());
+        return;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(m_Done.data(), 1, m_Done.size(), f) == m_Done.size();
+    ok = ok && fwrite(m_Pixels.data(), sizeof(float), m_Pixels.size(), f) == m_Pixels.size();
+    ok = ok && fwrite(m_Aux.data(), 1, m_Aux.size(), f) == m_Aux.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok)
+    {
+        printf("Cannot write the checkpoint `%s'\n", tempFilename.c_str());
+        remove(tempFilename.c_str());
+        return;
+    }
+
+#ifdef _WIN32
+    remove(m_Filename.c_str()); // rename() doesn't replace files there
+#endif
+    if (rename(tempFilename.c_str(), m_Filename.c_str()) != 0)
+    {
+        printf("Cannot replace the checkpoint `%s'\n", m_Filename.c_str());
+        return;
+    }
+
+    m_LastSaveTicks = SDL_GetTicks();
+    ++m_NumSaves;
+    m_BytesWritten += sizeof(header) + m_Done.size() + m_Pixels.size() * sizeof(float) + m_Aux.size();
+    m_SaveSeconds += (m_LastSaveTicks - startTicks) / 1000.;
+}
+
+void Checkpoint::FinishFrame(bool lastFrame)
+{
+    MutexRAII raii(m_Lock);
+
+    if (lastFrame)
+    {
+        remove(m_Filename.c_str());
+        return;
+    }
+
+    // the next frame starts from the beginning (this one is saved already)
+    ++m_Frame;
+    m_Mode = CheckpointMode::None;
+    m_Pass = -1;
+    m_Done.clear();
+    m_Width = m_Height = 0;
+    m_AuxSize = 0;
+    m_Pixels.clear();
+    m_Aux.clear();
+    SaveLocked();
+}
+
+void Checkpoint::PrintStatistics() const
+{
+    printf("Checkpoints: %d written, %.1f MB in %.2lfs\n", m_NumSaves, m_BytesWritten / (1024 * 1024), m_SaveSeconds);
+}
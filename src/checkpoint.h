@@ -0,0 +1,116 @@
+#ifndef RAYTRACING_CHECKPOINT_H
+#define RAYTRACING_CHECKPOINT_H
+
+#include "framebuffer.h"
+#include "sdl.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+/// the render modes, which can be resumed from a checkpoint (each has its own meaning of a pass)
+enum class CheckpointMode
+{
+    None,         //!< nothing started (yet) in this frame
+    SimpleAA,     //!< pass 0: the simple pass; pass 1: the (non-adaptive) AA pass
+    Adaptive,     //!< a pass is a round of the adaptive AA
+    Progressive,  //!< a pass is one sample per pixel
+    Workers       //!< a single pass, rendered on worker processes
+};
+
+/**
+ * @class Checkpoint
+ * @brief periodically saves the state of a long render, so that it can be resumed (--checkpoint and --resume)
+ *
+ * The state is the pass the render mode is in (with a few numbers it needs to go on with it), which buckets of that
+ * pass are finished, and a snapshot of the image and of the mode's per-pixel data (e.g. the progressive accumulation
+ * buffer). The snapshot isn't taken from the live buffers, which the buckets in flight are writing to: each finished
+ * bucket is copied into it, so it always holds the finished buckets of this pass, and the rest as of the end of
+ * the previous one. Resuming picks up right there.
+ *
+ * The file is written at most once every `interval' seconds (by the thread which finishes a bucket after that), into
+ * a temporary file, which is then renamed over the previous checkpoint, so a crash while writing leaves that intact.
+ * A checkpoint only resumes the render it's from: the same scene file (contents), frame size and bucket list.
+ */
+class Checkpoint
+{
+public:
+    Checkpoint();
+    ~Checkpoint();
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator = (const Checkpoint&) = delete;
+
+    /// sets up the file; the render is identified by the contents of the scene file
+    void Init(const std::string& filename, double interval, const char* sceneFile);
+
+    /// reads the checkpoint file (for --resume); false if there is none, or it's from some other render
+    bool Load();
+
+    int GetFrame() const { return m_Frame; } //!< the frame to start (or go on) with
+
+    /// Starts a render mode. If the checkpoint holds the state of the same mode, frame and buckets, returns true, and
+    /// the caller should go on from there (see Restore(), GetPass(), GetValue(), GetRemainingBuckets()); otherwise
+    /// it starts afresh. aux is the mode's per-pixel data (width*height items, auxSize bytes each), as it is before
+    /// the first pass.
+    bool Resume(int frame, CheckpointMode mode, const std::vector<Rect>& buckets, int width, int height,
+                const void* aux = nullptr, size_t auxSize = 0);
+
+    /// copies the snapshot into vfb and aux (see Resume())
+    void Restore(Framebuffer& vfb, void* aux) const;
+
+    int GetPass() const { return m_Pass; }
+    uint64_t GetValue(int index) const { return m_Values[index]; }
+
+    /// Starts a pass (with the given numbers, which describe the state at its start). Unless that's the pass which
+    /// was resumed, no buckets are finished in it yet.
+    void StartPass(int pass, std::initializer_list<uint64_t> values = {});
+
+    bool IsBucketDone(const Rect& r) const;
+    std::vector<Rect> GetRemainingBuckets() const; //!< of the current pass
+
+    /// the bucket r is finished in this pass: its pixels (and aux, if the mode has per-pixel data) are copied into the
+    /// snapshot, and the file is written, if it's time. Can be called from any thread.
+    void BucketDone(const Rect& r, const Framebuffer& vfb, const void* aux);
+
+    void Save(); //!< writes the file now (e.g. the render was interrupted)
+
+    /// the frame is complete: either goes on to the next one, or (after the last one) deletes the file
+    void FinishFrame(bool lastFrame);
+
+    void PrintStatistics() const;
+
+private:
+    std::string m_Filename;
+    double m_Interval = 60;
+    uint64_t m_SceneKey = 0;
+    SDL_mutex* m_Lock = nullptr;
+    unsigned m_LastSaveTicks = 0;
+
+    // the state:
+    int m_Frame = 0;
+    CheckpointMode m_Mode = CheckpointMode::None;
+    int m_Pass = -1;
+    uint64_t m_Values[4] = {};
+    uint64_t m_BucketsKey = 0;
+    std::vector<Rect> m_Buckets;
+    std::map<std::pair<int, int>, int> m_BucketIndex; //!< by the top-left corner
+    std::vector<uint8_t> m_Done; //!< per bucket
+    int m_Width = 0;
+    int m_Height = 0;
+    size_t m_AuxSize = 0;
+    std::vector<float> m_Pixels; //!< R, G, B
+    std::vector<uint8_t> m_Aux;
+
+    // statistics:
+    int m_NumSaves = 0;
+    double m_BytesWritten = 0;
+    double m_SaveSeconds = 0;
+
+    int FindBucket(const Rect& r) const;
+    void SaveLocked();
+};
+
+#endif //RAYTRACING_CHECKPOINT_H
@@ -25,9 +25,9 @@ unsigned Color::toRGB32(int redShift/* = 16*/, int greenShift/* = 8*/, int blueS
 
 unsigned Color::toSRGB32(int redShift/* = 16*/, int greenShift/* = 8*/, int blueShift/* = 0*/) const
 {
-    unsigned red = ConvertTo8Bit_sRGB(r);
-    unsigned green = ConvertTo8Bit_sRGB(g);
-    unsigned blue = ConvertTo8Bit_sRGB(b);
+    unsigned red = ConvertTo8Bit_sRGB_LUT(r);
+    unsigned green = ConvertTo8Bit_sRGB_LUT(g);
+    unsigned blue = ConvertTo8Bit_sRGB_LUT(b);
 
     unsigned rgbColor = (blue << blueShift) | (green << greenShift) | (red << redShift);
     return rgbColor;
@@ -0,0 +1,562 @@
+#include "coordinator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+RenderCoordinator::RenderCoordinator(const char* program, const char* sceneFile, int numWorkers)
+: m_Program(program)
+, m_SceneFile(sceneFile)
+, m_NumWorkers(numWorkers)
+{
+}
+
+namespace
+{
+
+/// what goes over the socket. Both ends are the same binary on the same machine, so the messages are sent as they are.
+enum MessageType
+{
+    MSG_READY = 1, //!< worker -> coordinator: the scene is loaded
+    MSG_BUCKET,    //!< coordinator -> worker: render this bucket (of this frame)
+    MSG_TILE       //!< worker -> coordinator: the rendered bucket, followed by its pixels (w*h*3 floats, row by row)
+};
+
+struct Message
+{
+    int type;
+    int frame;
+    int x0, y0, x1, y1;
+};
+
+// The connection to the other end: a socket on Unix; on Windows, a duplex pipe, whose HANDLE is passed around in the
+// fd (the HANDLEs of a process fit in 32 bits, even on 64-bit Windows)
+
+#ifdef _WIN32
+
+HANDLE ToHandle(int fd)
+{
+    return reinterpret_cast<HANDLE>(static_cast<intptr_t>(fd));
+}
+
+void IgnoreBrokenPipes()
+{
+    // (writing to a pipe without a reader fails there anyway)
+}
+
+bool ReadAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        DWORD n = 0;
+        if (!ReadFile(ToHandle(fd), p, static_cast<DWORD>(std::min<size_t>(size, 1 << 20)), &n, nullptr) || n == 0)
+            return false; // the other end is gone
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        DWORD n = 0;
+        if (!WriteFile(ToHandle(fd), p, static_cast<DWORD>(std::min<size_t>(size, 1 << 20)), &n, nullptr) || n == 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void CloseConnection(int fd)
+{
+    CloseHandle(ToHandle(fd));
+}
+
+#else // _WIN32
+
+void IgnoreBrokenPipes()
+{
+    // writing to a dead peer should fail, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+}
+
+bool ReadAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        const ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false; // the other end is gone
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void CloseConnection(int fd)
+{
+    close(fd);
+}
+
+#endif // _WIN32
+
+} // namespace
+
+RenderCoordinator::~RenderCoordinator()
+{
+    for (Worker& worker : m_Workers)
+        StopWorker(worker, false);
+}
+
+bool RenderCoordinator::Start()
+{
+    IgnoreBrokenPipes();
+
+#ifdef _WIN32
+    // (the workers are waited for with WaitForMultipleObjects)
+    if (m_NumWorkers > MAXIMUM_WAIT_OBJECTS)
+    {
+        printf("Using %d worker processes, the most there can be on Windows\n", MAXIMUM_WAIT_OBJECTS);
+        m_NumWorkers = MAXIMUM_WAIT_OBJECTS;
+    }
+#endif
+
+    for (int i = 0; i < m_NumWorkers; ++i)
+        if (!SpawnWorker())
+            return false;
+
+    printf("Started %d worker processes\n", m_NumWorkers);
+    return true;
+}
+
+#ifdef _WIN32
+
+bool RenderCoordinator::SpawnWorker()
+{
+    // a named pipe, because the anonymous ones only go one way
+    static int numPipes = 0;
+    char pipeName[64];
+    snprintf(pipeName, sizeof(pipeName), "\\\\.\\pipe\\raytracing-%lu-%d", GetCurrentProcessId(), ++numPipes);
+    const HANDLE pipe = CreateNamedPipeA(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 1 << 16, 1 << 16, 0,
+                                         nullptr);
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        printf("Cannot create a pipe for a worker (error %lu)\n", GetLastError());
+        return false;
+    }
+
+    // only the worker's end is inherited
+    SECURITY_ATTRIBUTES inherited{sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE};
+    const HANDLE workerEnd = CreateFileA(pipeName, GENERIC_READ | GENERIC_WRITE, 0, &inherited, OPEN_EXISTING, 0,
+                                         nullptr);
+    if (workerEnd == INVALID_HANDLE_VALUE)
+    {
+        printf("Cannot connect a pipe for a worker (error %lu)\n", GetLastError());
+        CloseHandle(pipe);
+        return false;
+    }
+
+    std::string commandLine = "\"" + m_Program + "\" --worker-fd " +
+                              std::to_string(reinterpret_cast<intptr_t>(workerEnd)) + " \"" + m_SceneFile + "\"";
+    STARTUPINFOA startupInfo = {};
+    startupInfo.cb = sizeof(startupInfo);
+    PROCESS_INFORMATION processInfo = {};
+    const BOOL started = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr,
+                                        &startupInfo, &processInfo);
+
+    // the workers started later mustn't inherit this worker's end: they would keep it open, and the coordinator
+    // wouldn't see this worker die
+    CloseHandle(workerEnd);
+    if (!started)
+    {
+        printf("Cannot start a worker (error %lu)\n", GetLastError());
+        CloseHandle(pipe);
+        return false;
+    }
+    CloseHandle(processInfo.hThread);
+
+    Worker worker;
+    worker.pid = static_cast<int>(processInfo.dwProcessId);
+    worker.fd = static_cast<int>(reinterpret_cast<intptr_t>(pipe));
+    worker.process = reinterpret_cast<intptr_t>(processInfo.hProcess);
+    m_Workers.push_back(worker);
+    return true;
+}
+
+void RenderCoordinator::StopWorker(Worker& worker, bool kill)
+{
+    // an idle worker exits when the pipe is closed; a busy one would only notice after its bucket
+    const HANDLE process = reinterpret_cast<HANDLE>(worker.process);
+    CloseConnection(worker.fd);
+    if (kill || worker.busy)
+        TerminateProcess(process, 1);
+
+    WaitForSingleObject(process, INFINITE);
+    if (kill)
+    {
+        DWORD exitCode = 0;
+        GetExitCodeProcess(process, &exitCode);
+        printf("Worker %d exited with code 0x%lx\n", worker.pid, exitCode);
+    }
+    CloseHandle(process);
+
+    worker.fd = -1;
+    worker.pid = -1;
+    worker.process = 0;
+}
+
+bool RenderCoordinator::WaitForWorkers(std::vector<char>& outReadable) const
+{
+    outReadable.assign(m_Workers.size(), 0);
+
+    std::vector<HANDLE> processes;
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+        if (m_Workers[i].pid >= 0)
+        {
+            processes.push_back(reinterpret_cast<HANDLE>(m_Workers[i].process));
+            indices.push_back(i);
+        }
+
+    // The pipes can't be waited for, so they are peeked at, and in between, the coordinator waits for a worker to
+    // exit, for a millisecond (it has nothing else to do, and a tile takes much longer to render)
+    while (true)
+    {
+        bool any = false;
+        for (size_t i : indices)
+        {
+            DWORD available = 0;
+            // (when peeking fails, the worker is gone, which the read will tell)
+            if (!PeekNamedPipe(ToHandle(m_Workers[i].fd), nullptr, 0, nullptr, &available, nullptr) || available > 0)
+                outReadable[i] = any = true;
+        }
+        if (any)
+            return true;
+
+        const DWORD result = WaitForMultipleObjects(static_cast<DWORD>(processes.size()), processes.data(), FALSE, 1);
+        if (result == WAIT_FAILED)
+        {
+            printf("Cannot wait for the workers (error %lu)\n", GetLastError());
+            return false;
+        }
+        if (result - WAIT_OBJECT_0 < processes.size())
+        {
+            // it has exited (whatever it sent before is still read first)
+            outReadable[indices[result - WAIT_OBJECT_0]] = true;
+            return true;
+        }
+    }
+}
+
+#else // _WIN32
+
+bool RenderCoordinator::SpawnWorker()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("Cannot create a socket for a worker");
+        return false;
+    }
+
+    // the workers started later mustn't inherit the coordinator's end: they would keep it open, and this worker
+    // wouldn't see the coordinator hang up
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    const std::string fdArg = std::to_string(fds[1]);
+    char* args[] = {
+        const_cast<char*>(m_Program.c_str()),
+        const_cast<char*>("--worker-fd"),
+        const_cast<char*>(fdArg.c_str()),
+        const_cast<char*>(m_SceneFile.c_str()),
+        nullptr
+    };
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Cannot start a worker");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        // the child (only exec from here: the coordinator has other threads, whose locks may be held)
+        execvp(args[0], args);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    Worker worker;
+    worker.pid = pid;
+    worker.fd = fds[0];
+    m_Workers.push_back(worker);
+    return true;
+}
+
+void RenderCoordinator::StopWorker(Worker& worker, bool kill)
+{
+    // an idle worker exits when the socket is closed; a busy one would only notice after its bucket
+    CloseConnection(worker.fd);
+    if (kill || worker.busy)
+        ::kill(worker.pid, SIGKILL);
+
+    int status = 0;
+    waitpid(worker.pid, &status, 0);
+    if (kill)
+    {
+        if (WIFSIGNALED(status))
+            printf("Worker %d was killed by signal %d\n", worker.pid, WTERMSIG(status));
+        else
+            printf("Worker %d exited with code %d\n", worker.pid, WEXITSTATUS(status));
+    }
+
+    worker.fd = -1;
+    worker.pid = -1;
+}
+
+bool RenderCoordinator::WaitForWorkers(std::vector<char>& outReadable) const
+{
+    outReadable.assign(m_Workers.size(), 0);
+
+    std::vector<pollfd> fds;
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+        if (m_Workers[i].pid >= 0)
+        {
+            fds.push_back({m_Workers[i].fd, POLLIN, 0});
+            indices.push_back(i);
+        }
+
+    while (poll(fds.data(), fds.size(), -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("poll");
+            return false;
+        }
+    }
+
+    for (size_t k = 0; k < fds.size(); ++k)
+        outReadable[indices[k]] = fds[k].revents != 0;
+    return true;
+}
+
+#endif // _WIN32
+
+bool RenderCoordinator::Render(int frame, const std::vector<Rect>& buckets,
+                               const std::function<bool(const Rect&, const Framebuffer&)>& onTile)
+{
+    std::deque<Rect> pending(buckets.begin(), buckets.end());
+    size_t numDone = 0;
+    int numReplacements = 0;
+    bool interrupted = false;
+
+    // the worker doesn't answer (or did something unexpected): its bucket goes back to the queue, and if it had
+    // loaded the scene, it gets replaced
+    auto loseWorker = [&](Worker& worker)
+    {
+        if (worker.busy)
+        {
+            printf("Worker %d failed; bucket (%d, %d)-(%d, %d) is handed out again\n", worker.pid,
+                   worker.bucket.x0, worker.bucket.y0, worker.bucket.x1, worker.bucket.y1);
+            pending.push_front(worker.bucket);
+            ++m_NumReissued;
+            worker.busy = false;
+        }
+        if (worker.ready && m_NumRespawns < m_NumWorkers)
+        {
+            ++m_NumRespawns;
+            ++numReplacements;
+        }
+        StopWorker(worker, true);
+    };
+
+    std::vector<float> pixels;
+    Framebuffer tile;
+    std::vector<char> readable;
+    while (numDone < buckets.size() && !interrupted)
+    {
+        // hand out the buckets to the idle workers
+        for (Worker& worker : m_Workers)
+        {
+            if (worker.pid < 0 || !worker.ready || worker.busy || pending.empty())
+                continue;
+
+            const Rect& r = pending.front();
+            const Message message{MSG_BUCKET, frame, r.x0, r.y0, r.x1, r.y1};
+            worker.busy = true;
+            worker.bucket = r;
+            pending.pop_front();
+            if (!WriteAll(worker.fd, &message, sizeof(message)))
+                loseWorker(worker);
+        }
+
+        // wait for the results
+        if (std::none_of(m_Workers.begin(), m_Workers.end(), [](const Worker& w) { return w.pid >= 0; }))
+        {
+            printf("No workers left; the render failed\n");
+            return false;
+        }
+
+        if (!WaitForWorkers(readable))
+            return false;
+
+        for (size_t i = 0; i < m_Workers.size(); ++i)
+        {
+            Worker& worker = m_Workers[i];
+            if (worker.pid < 0 || !readable[i])
+                continue;
+
+            Message message;
+            if (!ReadAll(worker.fd, &message, sizeof(message)))
+            {
+                loseWorker(worker);
+                continue;
+            }
+
+            if (message.type == MSG_READY)
+            {
+                worker.ready = true;
+                continue;
+            }
+
+            const Rect& r = worker.bucket;
+            if (message.type != MSG_TILE || !worker.busy || message.x0 != r.x0 || message.y0 != r.y0 ||
+                message.x1 != r.x1 || message.y1 != r.y1)
+            {
+                printf("Worker %d sent an unexpected message\n", worker.pid);
+                loseWorker(worker);
+                continue;
+            }
+
+            pixels.resize(static_cast<size_t>(r.w) * r.h * 3);
+            if (!ReadAll(worker.fd, pixels.data(), pixels.size() * sizeof(float)))
+            {
+                loseWorker(worker);
+                continue;
+            }
+            worker.busy = false;
+
+            tile.Resize(r.w, r.h);
+            const float* p = pixels.data();
+            for (int y = 0; y < r.h; ++y)
+                for (int x = 0; x < r.w; ++x, p += 3)
+                    tile[y][x] = Color(p[0], p[1], p[2]);
+
+            ++numDone;
+            if (!onTile(r, tile))
+            {
+                interrupted = true;
+                break;
+            }
+        }
+
+        // the workers still busy with an interrupted render would send their tiles to the next one
+        if (interrupted)
+            for (Worker& worker : m_Workers)
+                if (worker.pid >= 0 && worker.busy)
+                {
+                    StopWorker(worker, false);
+                    ++numReplacements;
+                }
+
+        m_Workers.erase(std::remove_if(m_Workers.begin(), m_Workers.end(), [](const Worker& w) { return w.pid < 0; }),
+                        m_Workers.end());
+        for (; numReplacements > 0; --numReplacements)
+            SpawnWorker();
+    }
+
+    if (m_NumReissued)
+        printf("%d bucket(s) handed out again, %d worker(s) replaced so far\n", m_NumReissued, m_NumRespawns);
+    return !interrupted;
+}
+
+int RunRenderWorker(int fd, const std::function<void(int frame)>& beginFrame,
+                    const std::function<void(const Rect& r, Framebuffer& tile)>& renderBucket)
+{
+    // the coordinator is gone, if writing fails; that's handled below
+    IgnoreBrokenPipes();
+
+    const Message ready{MSG_READY, 0, 0, 0, 0, 0};
+    if (!WriteAll(fd, &ready, sizeof(ready)))
+        return 1;
+
+    int currentFrame = -1;
+    Framebuffer tile;
+    std::vector<float> pixels;
+    Message message;
+    while (ReadAll(fd, &message, sizeof(message)))
+    {
+        if (message.type != MSG_BUCKET)
+            return 1;
+
+        if (message.frame != currentFrame)
+        {
+            currentFrame = message.frame;
+            beginFrame(currentFrame);
+        }
+
+        const Rect r(message.x0, message.y0, message.x1, message.y1);
+        tile.Resize(r.w, r.h);
+        renderBucket(r, tile);
+
+        pixels.resize(static_cast<size_t>(r.w) * r.h * 3);
+        float* p = pixels.data();
+        for (int y = 0; y < r.h; ++y)
+            for (int x = 0; x < r.w; ++x, p += 3)
+            {
+                p[0] = tile[y][x].r;
+                p[1] = tile[y][x].g;
+                p[2] = tile[y][x].b;
+            }
+
+        message.type = MSG_TILE;
+        if (!WriteAll(fd, &message, sizeof(message)) || !WriteAll(fd, pixels.data(), pixels.size() * sizeof(float)))
+            return 1;
+    }
+
+    // the coordinator hung up: the render is over
+    CloseConnection(fd);
+    return 0;
+}
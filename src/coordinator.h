@@ -0,0 +1,76 @@
+#ifndef RAYTRACING_COORDINATOR_H
+#define RAYTRACING_COORDINATOR_H
+
+#include "framebuffer.h"
+#include "sdl.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @class RenderCoordinator
+ * @brief spreads the buckets of a frame over local worker processes
+ *
+ * Each worker is the raytracer itself, started with --worker-fd and the same scene file; it parses and preprocesses
+ * the scene in its own address space, and is connected to the coordinator with a Unix socket (a named pipe on
+ * Windows). The buckets are handed out on demand (one at a time to each idle worker), so a worker stuck with the
+ * expensive part of the frame doesn't hold up the others, and the rendered tiles are sent back to be stitched together
+ * by the caller.
+ *
+ * If a worker dies, the bucket it was rendering is handed to another one, and a replacement worker is started (up to
+ * as many replacements as there were workers; a worker which dies before it's ready, e.g. because the scene doesn't
+ * parse, isn't replaced). The workers live as long as the coordinator, so an animation only loads the scene once.
+ */
+class RenderCoordinator
+{
+public:
+    /// the workers are started as `program --worker-fd <fd> sceneFile' (the fd being a pipe HANDLE on Windows)
+    RenderCoordinator(const char* program, const char* sceneFile, int numWorkers);
+    ~RenderCoordinator(); //!< stops the workers
+
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator = (const RenderCoordinator&) = delete;
+
+    bool Start(); //!< starts the workers
+
+    /// Renders the buckets of the given frame on the workers, calling onTile(bucket, pixels) (on the calling thread)
+    /// as each one arrives (pixels[0][0] being the top-left pixel of the bucket). If onTile returns false, the render
+    /// is interrupted. Returns whether all buckets were rendered.
+    bool Render(int frame, const std::vector<Rect>& buckets,
+                const std::function<bool(const Rect&, const Framebuffer&)>& onTile);
+
+private:
+    struct Worker
+    {
+        int pid = -1;
+        int fd = -1;            //!< the coordinator's end of the connection (a pipe HANDLE on Windows)
+        intptr_t process = 0;   //!< the process HANDLE (only on Windows)
+        bool ready = false; //!< it has loaded the scene
+        bool busy = false;  //!< it's rendering `bucket'
+        Rect bucket{0, 0, 0, 0};
+    };
+
+    std::string m_Program;
+    std::string m_SceneFile;
+    int m_NumWorkers;
+    int m_NumRespawns = 0;
+    int m_NumReissued = 0;
+    std::vector<Worker> m_Workers; //!< the live ones
+
+    bool SpawnWorker();
+    void StopWorker(Worker& worker, bool kill);
+
+    /// waits until some of the workers have sent something (or died), and flags those in outReadable (by their
+    /// index in m_Workers). Returns false on errors.
+    bool WaitForWorkers(std::vector<char>& outReadable) const;
+};
+
+/// The worker's side (see RenderCoordinator): reads buckets from the connection fd, renders each with renderBucket
+/// (after calling beginFrame(frame), whenever the frame changes), and sends them back, until the coordinator hangs up.
+/// Returns the process' exit code.
+int RunRenderWorker(int fd, const std::function<void(int frame)>& beginFrame,
+                    const std::function<void(const Rect& r, Framebuffer& tile)>& renderBucket);
+
+#endif //RAYTRACING_COORDINATOR_H
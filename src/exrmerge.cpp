@@ -0,0 +1,142 @@
+#include "exrmerge.h"
+
+#include <cstdio>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <Iex.h>
+
+namespace
+{
+struct PixelSum
+{
+    float r = 0, g = 0, b = 0, a = 0;
+};
+}
+
+bool MergeEXRFiles(const char* outputFile, const std::vector<std::string>& inputFiles)
+{
+    Imath::Box2i displayWindow;
+    int width = 0, height = 0;
+    std::vector<PixelSum> frame;
+
+    for (const std::string& filename : inputFiles)
+    {
+        try
+        {
+            Imf::InputFile file(filename.c_str());
+            const Imf::Header& header = file.header();
+            const Imath::Box2i& dataWindow = header.dataWindow();
+            if (frame.empty())
+            {
+                displayWindow = header.displayWindow();
+                width = displayWindow.max.x - displayWindow.min.x + 1;
+                height = displayWindow.max.y - displayWindow.min.y + 1;
+                frame.resize(static_cast<size_t>(width) * height);
+            }
+            else if (header.displayWindow().min.x != displayWindow.min.x || header.displayWindow().min.y != displayWindow.min.y ||
+                     header.displayWindow().max.x != displayWindow.max.x || header.displayWindow().max.y != displayWindow.max.y)
+            {
+                printf("`%s' is a part of a different frame (its display window doesn't match)\n", filename.c_str());
+                return false;
+            }
+
+            if (dataWindow.min.x < displayWindow.min.x || dataWindow.min.y < displayWindow.min.y ||
+                dataWindow.max.x > displayWindow.max.x || dataWindow.max.y > displayWindow.max.y)
+            {
+                printf("`%s' has pixels outside of the frame\n", filename.c_str());
+                return false;
+            }
+
+            // read the data window straight into its place in the frame
+            const int partWidth = dataWindow.max.x - dataWindow.min.x + 1;
+            const int partHeight = dataWindow.max.y - dataWindow.min.y + 1;
+            std::vector<PixelSum> part(static_cast<size_t>(partWidth) * partHeight);
+            const size_t xStride = sizeof(PixelSum);
+            const size_t yStride = xStride * partWidth;
+            char* base = reinterpret_cast<char*>(part.data()) - dataWindow.min.x * xStride - dataWindow.min.y * yStride;
+
+            Imf::FrameBuffer frameBuffer;
+            frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, base + 0*sizeof(float), xStride, yStride));
+            frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, base + 1*sizeof(float), xStride, yStride));
+            frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, base + 2*sizeof(float), xStride, yStride));
+            frameBuffer.insert("A", Imf::Slice(Imf::FLOAT, base + 3*sizeof(float), xStride, yStride, 1, 1, 1.0)); // no alpha: all rendered
+            file.setFrameBuffer(frameBuffer);
+            file.readPixels(dataWindow.min.y, dataWindow.max.y);
+
+            // the parts don't overlap, and the unrendered pixels are black, so they just add up
+            for (int y = 0; y < partHeight; ++y)
+                for (int x = 0; x < partWidth; ++x)
+                {
+                    const PixelSum& in = part[y * partWidth + x];
+                    PixelSum& out = frame[(y + dataWindow.min.y - displayWindow.min.y) * width + (x + dataWindow.min.x - displayWindow.min.x)];
+                    out.r += in.r;
+                    out.g += in.g;
+                    out.b += in.b;
+                    out.a += in.a;
+                }
+
+            printf("`%s': %dx%d pixels at (%d, %d)\n", filename.c_str(), partWidth, partHeight, dataWindow.min.x, dataWindow.min.y);
+        }
+        catch (Iex::BaseExc& ex)
+        {
+            printf("Cannot read `%s': %s\n", filename.c_str(), ex.what());
+            return false;
+        }
+    }
+
+    if (frame.empty())
+        return false;
+
+    long long missing = 0, overlapping = 0;
+    for (PixelSum& pixel : frame)
+    {
+        if (pixel.a < 0.5f)
+        {
+            ++missing;
+        }
+        else if (pixel.a > 1.5f)
+        {
+            // rendered more than once: take the average
+            ++overlapping;
+            pixel.r /= pixel.a;
+            pixel.g /= pixel.a;
+            pixel.b /= pixel.a;
+        }
+    }
+
+    try
+    {
+        Imf::Header header(displayWindow, displayWindow);
+        header.channels().insert("R", Imf::Channel(Imf::FLOAT));
+        header.channels().insert("G", Imf::Channel(Imf::FLOAT));
+        header.channels().insert("B", Imf::Channel(Imf::FLOAT));
+
+        const size_t xStride = sizeof(PixelSum);
+        const size_t yStride = xStride * width;
+        char* base = reinterpret_cast<char*>(frame.data()) - displayWindow.min.x * xStride - displayWindow.min.y * yStride;
+
+        Imf::FrameBuffer frameBuffer;
+        frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, base + 0*sizeof(float), xStride, yStride));
+        frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, base + 1*sizeof(float), xStride, yStride));
+        frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, base + 2*sizeof(float), xStride, yStride));
+
+        Imf::OutputFile file(outputFile, header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(height);
+    }
+    catch (Iex::BaseExc& ex)
+    {
+        printf("Cannot write `%s': %s\n", outputFile, ex.what());
+        return false;
+    }
+
+    printf("Merged %d files into `%s' (%dx%d)\n", (int) inputFiles.size(), outputFile, width, height);
+    if (missing)
+        printf("Warning: %lld pixels weren't rendered by any of the parts\n", missing);
+    if (overlapping)
+        printf("Warning: %lld pixels were rendered by more than one part\n", overlapping);
+    return true;
+}
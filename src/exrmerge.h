@@ -0,0 +1,13 @@
+#ifndef RAYTRACING_EXRMERGE_H
+#define RAYTRACING_EXRMERGE_H
+
+#include <string>
+#include <vector>
+
+/// Assembles the final frame from partial renders (see --region and --tile-index): every input's data window is
+/// placed in the frame (their display windows have to match), weighted by its alpha (1 where the part was rendered;
+/// inputs without alpha count as fully rendered). Reports the pixels no input rendered, or more than one did.
+/// The output has float R, G, B channels, covering the whole frame.
+bool MergeEXRFiles(const char* outputFile, const std::vector<std::string>& inputFiles);
+
+#endif //RAYTRACING_EXRMERGE_H
@@ -0,0 +1,26 @@
+#include "framebuffer.h"
+
+#include <cstddef>
+#include <cstdint>
+
+static const uintptr_t CACHE_LINE_SIZE = 64;
+
+Framebuffer::Framebuffer(int width, int height)
+{
+    Resize(width, height);
+}
+
+void Framebuffer::Resize(int width, int height)
+{
+    m_Width = width;
+    m_Height = height;
+    m_Stride = (width + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+
+    // the vector only guarantees the alignment of float; over-allocate, and start at the first Color
+    // which is on a cache line boundary (there's one among the first 16, as 16 Colors are 3 cache lines)
+    m_Storage.assign(static_cast<size_t>(m_Stride) * height + ROW_ALIGNMENT, Color());
+
+    m_Data = m_Storage.data();
+    while (reinterpret_cast<uintptr_t>(m_Data) % CACHE_LINE_SIZE != 0 && m_Data < m_Storage.data() + ROW_ALIGNMENT)
+        ++m_Data;
+}
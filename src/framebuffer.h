@@ -0,0 +1,42 @@
+#ifndef RAYTRACING_FRAMEBUFFER_H
+#define RAYTRACING_FRAMEBUFFER_H
+
+#include <vector>
+
+#include "color.h"
+
+/// The virtual framebuffer (VFB): a heap-allocated, floating-point image of any size.
+/// Rows are padded to a whole number of cache lines and start on a cache line boundary, so
+/// buckets (whose size is a multiple of ROW_ALIGNMENT pixels) never share cache lines
+/// with their neighbours, when rendered on different threads.
+class Framebuffer
+{
+public:
+    Framebuffer() = default;
+    Framebuffer(int width, int height);
+
+    // m_Data points into m_Storage, so a plain copy would alias the other buffer
+    Framebuffer(const Framebuffer&) = delete;
+    Framebuffer& operator = (const Framebuffer&) = delete;
+
+    void Resize(int width, int height); //!< the contents are cleared to black
+
+    int GetWidth() const { return m_Width; }
+    int GetHeight() const { return m_Height; }
+    int GetStride() const { return m_Stride; } //!< the distance between two rows, in pixels
+
+    Color* operator[](int y) { return m_Data + y*m_Stride; } //!< fb[y][x] is the pixel at (x, y)
+    const Color* operator[](int y) const { return m_Data + y*m_Stride; }
+
+    /// pixels, for which the rows are padded: 16 Colors (192 bytes) are 3 cache lines
+    static const int ROW_ALIGNMENT = 16;
+
+private:
+    int m_Width = 0;
+    int m_Height = 0;
+    int m_Stride = 0;
+    std::vector<Color> m_Storage; //!< with room for aligning m_Data
+    Color* m_Data = nullptr;
+};
+
+#endif //RAYTRACING_FRAMEBUFFER_H
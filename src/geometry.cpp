@@ -3,6 +3,17 @@
 
 #include "geometry.h"
 
+uint64_t Geometry::IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const
+{
+    uint64_t hits = 0;
+    ForEachRay(mask, [&](int i)
+    {
+        if (Intersect(packet[i], outInfos[i]))
+            hits |= RayBit(i);
+    });
+    return hits;
+}
+
 bool Plane::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
 {
     if ( ray.start.y > m_Height && ray.dir.y >= 0. )
@@ -34,6 +45,16 @@ bool Plane::IsInside(const Vector& point) const
     return result;
 }
 
+bool Plane::GetBoundingBox(BBox& outBBox) const
+{
+    if (m_Limit >= 1e98) // the default: infinite
+        return false;
+
+    outBBox.SetMin({-m_Limit, m_Height, -m_Limit});
+    outBBox.SetMax({+m_Limit, m_Height, +m_Limit});
+    return true;
+}
+
 Plane::Plane(double height, double limit)
 : m_Height(height)
 , m_Limit(limit)
@@ -92,6 +113,13 @@ bool Sphere::IsInside(const Vector& point) const
     return result;
 }
 
+bool Sphere::GetBoundingBox(BBox& outBBox) const
+{
+    outBBox.SetMin(m_Center - Vector(m_Radius, m_Radius, m_Radius));
+    outBBox.SetMax(m_Center + Vector(m_Radius, m_Radius, m_Radius));
+    return true;
+}
+
 Sphere::Sphere(const Vector& center, double radius)
 : m_Center(center)
 , m_Radius(radius)
@@ -169,6 +197,13 @@ bool Cube::IsInside(const Vector& point) const
     return result;
 }
 
+bool Cube::GetBoundingBox(BBox& outBBox) const
+{
+    outBBox.SetMin(m_Center - Vector(m_HalfSide, m_HalfSide, m_HalfSide));
+    outBBox.SetMax(m_Center + Vector(m_HalfSide, m_HalfSide, m_HalfSide));
+    return true;
+}
+
 Cube::Cube(const Vector& center, double halfSide)
 : m_Center(center)
 , m_HalfSide(halfSide)
@@ -241,6 +276,18 @@ bool CsgOp::IsInside(const Vector& point) const
     return result;
 }
 
+bool CsgOp::GetBoundingBox(BBox& outBBox) const
+{
+    // whatever the operator, the result is within the union of the operands
+    BBox leftBBox, rightBBox;
+    if (!m_Left || !m_Right || !m_Left->GetBoundingBox(leftBBox) || !m_Right->GetBoundingBox(rightBBox))
+        return false;
+
+    outBBox = leftBBox;
+    outBBox.Add(rightBBox);
+    return true;
+}
+
 CsgOp::CsgOp(Geometry* left, Geometry* right)
 : m_Left(left)
 , m_Right(right)
@@ -302,6 +349,13 @@ bool RegularPolygon::IsInside(const Vector& point) const
     return result;
 }
 
+bool RegularPolygon::GetBoundingBox(BBox& outBBox) const
+{
+    outBBox.SetMin({m_Center.x - m_Radius, m_Center.y, m_Center.z - m_Radius});
+    outBBox.SetMax({m_Center.x + m_Radius, m_Center.y, m_Center.z + m_Radius});
+    return true;
+}
+
 RegularPolygon::RegularPolygon(const Vector& center, double radius, unsigned int sides)
 : m_Center(center)
 , m_Radius(radius)
@@ -317,6 +371,11 @@ void RegularPolygon::FillProperties(ParsedBlock& pb)
 }
 
 bool Node::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
+{
+    return IntersectPrimitive(ray, -1, outInfo);
+}
+
+bool Node::IntersectPrimitive(const Ray& ray, int primitive, IntersectionInfo& outInfo) const
 {
     // world space -> object's canonic space
     Ray rayCanonic = ray;
@@ -325,7 +384,9 @@ bool Node::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
 
     double rayDirLength = rayCanonic.dir.Length();
     rayCanonic.dir.Normalize();
-    if (!geometry->Intersect(rayCanonic, outInfo))
+    const bool found = (primitive < 0) ? geometry->Intersect(rayCanonic, outInfo)
+                                       : geometry->IntersectPrimitive(rayCanonic, primitive, outInfo);
+    if (!found)
         return false;
 
     // The intersection found is in object space, convert to world space:
@@ -338,6 +399,95 @@ bool Node::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
     return true;
 }
 
+uint64_t Node::IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const
+{
+    // world space -> object's canonic space, ray by ray as in IntersectPrimitive()
+    RayPacket packetCanonic;
+    double rayDirLength[RayPacket::MAX_RAYS];
+    packetCanonic.SetCount(packet.GetCount());
+    ForEachRay(mask, [&](int i)
+    {
+        Ray rayCanonic = packet[i];
+        rayCanonic.start = transform.UndoPoint(packet[i].start);
+        rayCanonic.dir = transform.UndoDirection(packet[i].dir);
+
+        rayDirLength[i] = rayCanonic.dir.Length();
+        rayCanonic.dir.Normalize();
+        packetCanonic.SetRay(i, rayCanonic);
+    });
+    packetCanonic.ComputeBounds(mask);
+
+    const uint64_t hits = geometry->IntersectPacket(packetCanonic, mask, outInfos);
+    ForEachRay(hits, [&](int i)
+    {
+        IntersectionInfo& info = outInfos[i];
+        info.normal = transform.Normal(info.normal);
+        info.normal.Normalize();
+        info.dNdx = Normalize(transform.Direction(info.dNdx));
+        info.dNdy = Normalize(transform.Direction(info.dNdy));
+        info.ip = transform.Point(info.ip);
+        info.distance /= rayDirLength[i];
+    });
+    return hits;
+}
+
+bool Node::IsAnimated() const
+{
+    return scaleKeys.IsAnimated() || rotationKeys.IsAnimated() || translationKeys.IsAnimated();
+}
+
+void Node::BeginRender()
+{
+    UpdateWorldBBox();
+}
+
+void Node::BeginFrame()
+{
+    // static nodes keep the box from BeginRender()
+    if (!IsAnimated())
+        return;
+
+    const double frame = scene.frame;
+    transform = baseTransform;
+    if (scaleKeys.IsAnimated())
+    {
+        const Vector scale = scaleKeys.Evaluate(frame);
+        transform.Scale(scale.x, scale.y, scale.z);
+    }
+    if (rotationKeys.IsAnimated())
+    {
+        const Vector angles = rotationKeys.Evaluate(frame);
+        transform.Rotate(angles.x, angles.y, angles.z);
+    }
+    if (translationKeys.IsAnimated())
+        transform.Translate(baseTransform.GetTranslation() + translationKeys.Evaluate(frame));
+
+    UpdateWorldBBox();
+}
+
+void Node::UpdateWorldBBox()
+{
+    // the geometry's box is in object space; the box around its transformed corners contains the transformed geometry
+    BBox objectBBox;
+    bounded = geometry && geometry->GetBoundingBox(objectBBox);
+    if (!bounded)
+        return;
+
+    worldBBox.MakeEmpty();
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const Vector p{(corner & 1) ? objectBBox.GetMax().x : objectBBox.GetMin().x,
+                       (corner & 2) ? objectBBox.GetMax().y : objectBBox.GetMin().y,
+                       (corner & 4) ? objectBBox.GetMax().z : objectBBox.GetMin().z};
+        worldBBox.Add(transform.Point(p));
+    }
+
+    // a little slack, so flat boxes (and rounding) don't make the box test miss grazing rays
+    const double margin = 1e-6 * (1. + (worldBBox.GetMax() - worldBBox.GetMin()).Length());
+    worldBBox.SetMin(worldBBox.GetMin() - Vector(margin, margin, margin));
+    worldBBox.SetMax(worldBBox.GetMax() + Vector(margin, margin, margin));
+}
+
 void Node::FillProperties(ParsedBlock& pb)
 {
     pb.GetGeometryProp("geometry", &geometry);
@@ -345,4 +495,9 @@ void Node::FillProperties(ParsedBlock& pb)
     pb.GetTransformProp(transform);
     pb.GetTextureProp("bump", &bump);
     pb.GetFloatProp("shadowTransparency", &shadowTransparency);
+
+    baseTransform = transform;
+    pb.GetAnimatedProp("keyScale", scaleKeys);
+    pb.GetAnimatedProp("keyRotate", rotationKeys);
+    pb.GetAnimatedProp("keyTranslate", translationKeys);
 }
@@ -3,7 +3,10 @@
 
 #include <vector>
 
+#include "animation.h"
+#include "bbox.h"
 #include "ray.h"
+#include "raypacket.h"
 #include "vector.h"
 #include "scene.h"
 #include "transform.h"
@@ -19,6 +22,7 @@ struct IntersectionInfo
     const Geometry* geometry;
     Vector rayDir;
     Vector dNdx, dNdy;
+    int primitive = -1; //!< which part of the geometry was hit (e.g. a mesh triangle), -1 if not applicable
 };
 
 /**
@@ -38,6 +42,18 @@ public:
 
     virtual bool IsInside(const Vector& point) const =0;
     virtual ElementType GetElementType() const override { return ElementType::GEOMETRY; }
+
+    /// intersects only the given primitive (as returned in IntersectionInfo::primitive), e.g. a single triangle.
+    /// Geometries which don't consist of primitives intersect as a whole.
+    virtual bool IntersectPrimitive(const Ray& ray, int primitive, IntersectionInfo& outInfo) const { return Intersect(ray, outInfo); }
+
+    /// Intersects the packet's rays in mask, each as Intersect() would, into outInfos (indexed like the rays). Returns
+    /// the mask of those which hit. Geometries with an acceleration structure traverse it with the whole packet.
+    virtual uint64_t IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const;
+
+    /// gets a box (in object space) which contains the whole geometry. Returns false if the geometry is unbounded.
+    /// Valid after BeginRender().
+    virtual bool GetBoundingBox(BBox& outBBox) const { return false; }
 };
 
 class Plane : public Geometry
@@ -47,6 +63,7 @@ public:
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override;
 
     virtual void FillProperties(ParsedBlock& pb) override;
 
@@ -62,6 +79,7 @@ public:
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override;
 
     virtual void FillProperties(ParsedBlock& pb) override;
 
@@ -78,6 +96,7 @@ public:
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override;
 
     virtual void FillProperties(ParsedBlock& pb) override;
 
@@ -93,6 +112,7 @@ public:
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override;
 
     virtual void FillProperties(ParsedBlock& pb) override;
 
@@ -111,6 +131,7 @@ public:
 
     virtual bool Operator(bool inA, bool inB) const =0;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override;
 
     virtual void FillProperties(ParsedBlock& pb) override;
 
@@ -147,11 +168,32 @@ struct Node : public Intersectable, public SceneElement
     Texture* bump = nullptr;
     float shadowTransparency = 0.f;
 
+    // Animation: keyed scale and rotation are applied after the static transform, the keyed translation
+    // is added to its offset
+    Transform baseTransform;             //!< the transform given by scale/rotate/translate
+    Track<Vector> scaleKeys;             //!< keyScale <frame> (x, y, z)
+    Track<Vector> rotationKeys;          //!< keyRotate <frame> (yaw, pitch, roll)
+    Track<Vector> translationKeys;       //!< keyTranslate <frame> (x, y, z)
+
+    bool bounded = false;                //!< is worldBBox valid (false for unbounded geometries)
+    BBox worldBBox;                      //!< the node's extent in world space, for the current frame
+
     Node() = default;
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
+    bool IntersectPrimitive(const Ray& ray, int primitive, IntersectionInfo& outInfo) const; //!< see Geometry::IntersectPrimitive()
+    uint64_t IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const; //!< see Geometry::IntersectPacket()
+
+    /// a quick test, whether the ray may hit the node at all (i.e., its world-space box)
+    bool MayIntersect(const Ray& ray) const { return !bounded || worldBBox.TestIntersect(ray); }
+
+    bool IsAnimated() const;
+
+    void UpdateWorldBBox(); //!< recomputes worldBBox from the geometry's box and the current transform
 
     virtual ElementType GetElementType() const override { return ElementType::NODE; }
+    virtual void BeginRender() override;
+    virtual void BeginFrame() override; //!< animated nodes: evaluates the transform at the current frame and refits worldBBox
     virtual void FillProperties(ParsedBlock& pb) override;
 };
 
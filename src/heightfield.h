@@ -12,6 +12,7 @@ public:
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
     virtual bool IsInside(const Vector& point) const override { return false; }
+    virtual bool GetBoundingBox(BBox& outBBox) const override { outBBox = m_BBox; return true; }
 
     virtual void BeginRender() override;
     virtual void FillProperties(ParsedBlock& pb) override;
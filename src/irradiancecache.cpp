@@ -0,0 +1,407 @@
+#include "irradiancecache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "constants.h"
+#include "geometry.h"
+#include "sampler.h"
+#include "scene.h"
+#include "utils.h"
+
+IrradianceCache irradianceCache;
+
+Color Raytrace(const Ray& ray, double& outDistance); // (main.cpp; also gives the distance to the closest hit)
+
+namespace
+{
+
+const char MAGIC[8] = {'Q', 'D', 'I', 'R', 'R', 'C', 'H', '1'};
+const int MAX_DEPTH = 24; //!< of the octree
+const int NUM_VALUES = 28; //!< per sample in the file: position, normal, irradiance, radius and the gradients
+
+/// the index of the child of a node centered at `center', which contains pos, and that child's center
+int GetChild(const Vector& center, double size, const Vector& pos, Vector& outChildCenter)
+{
+    int index = 0;
+    outChildCenter = center;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (pos[axis] >= center[axis])
+        {
+            index |= 1 << axis;
+            outChildCenter[axis] += size / 4;
+        }
+        else
+        {
+            outChildCenter[axis] -= size / 4;
+        }
+    }
+    return index;
+}
+
+} // namespace
+
+IrradianceCache::~IrradianceCache()
+{
+    Free(m_Root);
+}
+
+bool IrradianceCache::IsUsedFor(const Ray& ray)
+{
+    return scene.settings.gi && scene.settings.irradianceCache && !ray.diffuse;
+}
+
+void IrradianceCache::BeginFrame()
+{
+    const GlobalSettings& settings = scene.settings;
+    if (!settings.gi || !settings.irradianceCache || m_Root)
+        return;
+
+    // the samples outside the root cube (e.g. on an infinite plane) just stay in the root
+    const BBox bounds = scene.bvh.GetBounds();
+    if (bounds.GetMin().x > bounds.GetMax().x) // no bounded nodes
+    {
+        m_Center.Set(0, 0, 0);
+        m_Size = 2000;
+    }
+    else
+    {
+        m_Center = (bounds.GetMin() + bounds.GetMax()) * 0.5;
+        const Vector extent = bounds.GetMax() - bounds.GetMin();
+        m_Size = std::max(1e-3, std::max(extent.x, std::max(extent.y, extent.z)) * 1.01);
+    }
+    m_MinRadius = settings.irradianceCacheMinSpacing > 0 ? settings.irradianceCacheMinSpacing : m_Size * 5e-4;
+    m_MaxRadius = settings.irradianceCacheMaxSpacing > 0 ? settings.irradianceCacheMaxSpacing : m_Size * 0.1;
+    m_Root = new OctreeNode;
+
+    if (!settings.irradianceCacheFile.empty() && Load(settings.irradianceCacheFile))
+        printf("Irradiance cache: loaded %u samples from %s\n", m_NumSamples.load(), settings.irradianceCacheFile.c_str());
+}
+
+void IrradianceCache::EndRender()
+{
+    const std::string& filename = scene.settings.irradianceCacheFile;
+    if (m_Root && !filename.empty() && !Save(filename))
+        printf("Irradiance cache: could not save %s\n", filename.c_str());
+
+    Free(m_Root);
+    m_Root = nullptr;
+}
+
+Color IrradianceCache::GetIrradiance(const Ray& ray, const Vector& pos, const Vector& normal)
+{
+    if (!m_Root)
+        return Color(0, 0, 0);
+
+    m_NumLookups.fetch_add(1, std::memory_order_relaxed);
+    Color sum(0, 0, 0);
+    double weightSum = 0;
+    Lookup(m_Root, m_Center, m_Size, pos, normal, sum, weightSum);
+    if (weightSum > 0)
+    {
+        m_NumInterpolated.fetch_add(1, std::memory_order_relaxed);
+        return sum / float(weightSum);
+    }
+
+    Sample* sample = ComputeSample(ray, pos, normal);
+    Insert(sample);
+    return sample->irradiance;
+}
+
+void IrradianceCache::Lookup(const OctreeNode* node, const Vector& center, double size, const Vector& pos,
+                             const Vector& normal, Color& sum, double& weightSum) const
+{
+    const double accuracy = scene.settings.irradianceCacheAccuracy;
+    for (const Sample* sample = node->samples.load(std::memory_order_acquire); sample; sample = sample->next)
+    {
+        // Ward's error: the sample is used where it's below `accuracy' (i.e. the weight is above 1/accuracy)
+        const Vector offset = pos - sample->pos;
+        const double error = offset.Length() / sample->radius + sqrt(std::max(0., 1 - Dot(normal, sample->normal)));
+        if (error >= accuracy)
+            continue;
+
+        // a sample in front of the point sees the light the point may not
+        if (Dot(offset, normal + sample->normal) * 0.5 < -0.01 * sample->radius)
+            continue;
+
+        const Vector rotation = sample->normal ^ normal;
+        Color extrapolated = sample->irradiance;
+        for (int c = 0; c < 3; ++c)
+        {
+            extrapolated[c] += float(Dot(rotation, sample->rotationalGradient[c]) + Dot(offset, sample->translationalGradient[c]));
+            extrapolated[c] = std::max(extrapolated[c], 0.f);
+        }
+
+        const double weight = 1 / std::max(error, 1e-9);
+        sum += extrapolated * float(weight);
+        weightSum += weight;
+    }
+
+    // a child holds the samples, which reach at most half its size out of it
+    const double childSize = size / 2;
+    for (int i = 0; i < 8; ++i)
+    {
+        const OctreeNode* child = node->children[i].load(std::memory_order_acquire);
+        if (!child)
+            continue;
+
+        Vector childCenter;
+        for (int axis = 0; axis < 3; ++axis)
+            childCenter[axis] = center[axis] + ((i >> axis) & 1 ? size : -size) / 4;
+        if (fabs(pos.x - childCenter.x) <= childSize && fabs(pos.y - childCenter.y) <= childSize &&
+            fabs(pos.z - childCenter.z) <= childSize)
+            Lookup(child, childCenter, childSize, pos, normal, sum, weightSum);
+    }
+}
+
+IrradianceCache::Sample* IrradianceCache::ComputeSample(const Ray& ray, const Vector& pos, const Vector& normal) const
+{
+    // M x N strata of the cosine-weighted hemisphere: M rings (of equal projected area), N sectors
+    const unsigned numRays = std::max(scene.settings.irradianceCacheSamples, 4u);
+    const int M = std::max(1, int(sqrt(numRays / PI) + 0.5));
+    const int N = std::max(3, int(numRays / M));
+
+    Vector a, b;
+    OrthonormalSystem(normal, a, b);
+
+    std::vector<Color> radiance(M*N);
+    std::vector<double> distance(M*N);
+    Sampler& sampler = GetSampler();
+    for (int j = 0; j < M; ++j)
+        for (int k = 0; k < N; ++k)
+        {
+            double u, v;
+            sampler.Get2D(u, v);
+            const double sinTheta = sqrt((j + u) / M);
+            const double phi = 2 * PI * (k + v) / N;
+
+            // the rays bring the indirect light only (they don't see the lights, which the shaders sample anyway)
+            Ray newRay = ray;
+            newRay.start = pos + normal*1e-6;
+            newRay.dir = (a*cos(phi) + b*sin(phi))*sinTheta + normal*sqrt(std::max(0., 1 - Sqr(sinTheta)));
+            newRay.depth++;
+            newRay.throughput = Color(1, 1, 1);
+            newRay.share = 1;
+            newRay.pdf = 0;
+            newRay.diffuse = true;
+            newRay.budget = INF; // (the sample is shared by many pixels; its rays aren't any one's)
+
+            const Sampler::State branch = sampler.Branch();
+            const Sampler::State parent = sampler.GetState();
+            sampler.SetState(branch);
+            radiance[j*N + k] = Raytrace(newRay, distance[j*N + k]);
+            sampler.SetState(parent);
+        }
+
+    Sample* sample = new Sample;
+    sample->pos = pos;
+    sample->normal = normal;
+    sample->irradiance = Color(0, 0, 0);
+    double inverseDistanceSum = 0;
+    for (int i = 0; i < M*N; ++i)
+    {
+        sample->irradiance += radiance[i];
+        inverseDistanceSum += 1 / distance[i];
+    }
+    sample->irradiance /= float(M*N);
+    const double harmonicMean = inverseDistanceSum > 0 ? M*N / inverseDistanceSum : INF;
+    sample->radius = std::min(std::max(harmonicMean, m_MinRadius), m_MaxRadius);
+
+    // Ward & Heckbert's gradients (divided by PI, as the irradiance is in the units of the shaders)
+    for (int c = 0; c < 3; ++c)
+    {
+        sample->rotationalGradient[c].Set(0, 0, 0);
+        sample->translationalGradient[c].Set(0, 0, 0);
+    }
+    for (int k = 0; k < N; ++k)
+    {
+        const double phiCenter = 2 * PI * (k + 0.5) / N;
+        const Vector vCenter = b*cos(phiCenter) - a*sin(phiCenter);
+        const double phi = 2 * PI * k / N;
+        const Vector u = a*cos(phi) + b*sin(phi);
+        const Vector v = b*cos(phi) - a*sin(phi);
+        const int previousK = (k + N - 1) % N;
+
+        for (int j = 0; j < M; ++j)
+        {
+            const Color& L = radiance[j*N + k];
+            const double sinCenter = sqrt((j + 0.5) / M);
+            const double tanCenter = sinCenter / sqrt(1 - Sqr(sinCenter));
+
+            // across the ring boundary, towards the pole (the change along u)
+            Color acrossRing(0, 0, 0);
+            if (j > 0)
+            {
+                const double sinLow = sqrt(double(j) / M);
+                const double r = std::min(distance[j*N + k], distance[(j - 1)*N + k]);
+                acrossRing = (L - radiance[(j - 1)*N + k]) * float(2 * PI / N * sinLow * (1 - Sqr(sinLow)) / r);
+            }
+
+            // across the sector boundary (the change along v)
+            const double cosLow = sqrt(1 - double(j) / M);
+            const double cosHigh = sqrt(std::max(0., 1 - double(j + 1) / M));
+            const double r = std::min(distance[j*N + k], distance[j*N + previousK]);
+            const Color acrossSector = (L - radiance[j*N + previousK]) * float((cosLow - cosHigh) / (sinCenter * r));
+
+            for (int c = 0; c < 3; ++c)
+            {
+                sample->rotationalGradient[c] += vCenter * (-tanCenter * L[c]);
+                sample->translationalGradient[c] += u*acrossRing[c] + v*acrossSector[c];
+            }
+        }
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        sample->rotationalGradient[c] = sample->rotationalGradient[c] * (1. / (M*N));
+        sample->translationalGradient[c] = sample->translationalGradient[c] * (1. / PI);
+    }
+
+    return sample;
+}
+
+void IrradianceCache::Insert(Sample* sample)
+{
+    // the deepest node which contains the sample, and is at least twice its radius of validity
+    const double validRadius = scene.settings.irradianceCacheAccuracy * sample->radius;
+    OctreeNode* node = m_Root;
+    Vector center = m_Center;
+    double size = m_Size;
+    const bool inside = fabs(sample->pos.x - center.x) <= size / 2 && fabs(sample->pos.y - center.y) <= size / 2 &&
+                        fabs(sample->pos.z - center.z) <= size / 2;
+    for (int depth = 0; inside && depth < MAX_DEPTH && size / 2 >= 2 * validRadius; ++depth)
+    {
+        Vector childCenter;
+        const int index = GetChild(center, size, sample->pos, childCenter);
+        OctreeNode* child = node->children[index].load(std::memory_order_acquire);
+        if (!child)
+        {
+            // another thread may have created it meanwhile; then that one is used
+            OctreeNode* created = new OctreeNode;
+            if (node->children[index].compare_exchange_strong(child, created, std::memory_order_acq_rel))
+                child = created;
+            else
+                delete created;
+        }
+        node = child;
+        center = childCenter;
+        size /= 2;
+    }
+
+    Sample* head = node->samples.load(std::memory_order_relaxed);
+    do
+    {
+        sample->next = head;
+    } while (!node->samples.compare_exchange_weak(head, sample, std::memory_order_release, std::memory_order_relaxed));
+    ++m_NumSamples;
+}
+
+bool IrradianceCache::Load(const std::string& filename)
+{
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return false;
+
+    FileRAII closer(f);
+    char magic[sizeof(MAGIC)];
+    unsigned count;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        fread(&count, sizeof(count), 1, f) != 1)
+    {
+        printf("Irradiance cache: %s isn't a cache file\n", filename.c_str());
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        double values[NUM_VALUES];
+        if (fread(values, sizeof(values), 1, f) != 1)
+        {
+            printf("Irradiance cache: %s is truncated\n", filename.c_str());
+            return false;
+        }
+
+        Sample* sample = new Sample;
+        sample->pos.Set(values[0], values[1], values[2]);
+        sample->normal.Set(values[3], values[4], values[5]);
+        sample->irradiance = Color(float(values[6]), float(values[7]), float(values[8]));
+        sample->radius = values[9];
+        for (int c = 0; c < 3; ++c)
+        {
+            sample->rotationalGradient[c].Set(values[10 + c*3], values[11 + c*3], values[12 + c*3]);
+            sample->translationalGradient[c].Set(values[19 + c*3], values[20 + c*3], values[21 + c*3]);
+        }
+        Insert(sample);
+    }
+    return true;
+}
+
+bool IrradianceCache::Save(const std::string& filename) const
+{
+    std::vector<const Sample*> samples;
+    std::vector<const OctreeNode*> stack = {m_Root};
+    while (!stack.empty())
+    {
+        const OctreeNode* node = stack.back();
+        stack.pop_back();
+        for (const Sample* sample = node->samples.load(); sample; sample = sample->next)
+            samples.push_back(sample);
+        for (const auto& child : node->children)
+            if (child.load())
+                stack.push_back(child.load());
+    }
+
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f)
+        return false;
+
+    FileRAII closer(f);
+    const unsigned count = unsigned(samples.size());
+    bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, f) == 1 && fwrite(&count, sizeof(count), 1, f) == 1;
+    for (const Sample* sample : samples)
+    {
+        double values[NUM_VALUES] = {
+            sample->pos.x, sample->pos.y, sample->pos.z,
+            sample->normal.x, sample->normal.y, sample->normal.z,
+            sample->irradiance.r, sample->irradiance.g, sample->irradiance.b,
+            sample->radius,
+        };
+        for (int c = 0; c < 3; ++c)
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                values[10 + c*3 + axis] = sample->rotationalGradient[c][axis];
+                values[19 + c*3 + axis] = sample->translationalGradient[c][axis];
+            }
+        ok = ok && fwrite(values, sizeof(values), 1, f) == 1;
+    }
+    if (ok)
+        printf("Irradiance cache: saved %u samples to %s\n", count, filename.c_str());
+    return ok;
+}
+
+void IrradianceCache::Free(OctreeNode* node)
+{
+    if (!node)
+        return;
+
+    for (auto& child : node->children)
+        Free(child.load());
+    for (Sample* sample = node->samples.load(); sample;)
+    {
+        Sample* next = sample->next;
+        delete sample;
+        sample = next;
+    }
+    delete node;
+}
+
+void IrradianceCache::PrintStatistics() const
+{
+    const unsigned long long lookups = m_NumLookups;
+    if (lookups)
+        printf("Irradiance cache: %u samples, %.2lf%% of %llu lookups interpolated\n", m_NumSamples.load(),
+               100. * m_NumInterpolated / lookups, lookups);
+}
@@ -0,0 +1,95 @@
+#ifndef RAYTRACING_IRRADIANCECACHE_H
+#define RAYTRACING_IRRADIANCECACHE_H
+
+#include <atomic>
+#include <string>
+
+#include "bbox.h"
+#include "color.h"
+#include "ray.h"
+#include "vector.h"
+
+/**
+ * @class IrradianceCache
+ * @brief Ward's irradiance cache: the indirect diffuse light, computed at sparse points and interpolated in between
+ *
+ * In GI, a diffuse hit which isn't itself on a diffuse ray's path (i.e. the first diffuse bounce from the camera,
+ * possibly through mirrors and glass) takes its indirect light from here. If the cached samples around the point
+ * (as judged by Ward's weight, with the accuracy `a') don't cover it, a new one is computed there: a stratified,
+ * cosine-distributed hemisphere of rays (traced as full GI paths), from which come the irradiance, the harmonic mean
+ * distance to the surroundings (which sets how far the sample is good for) and the rotational and translational
+ * gradients (Ward & Heckbert, "Irradiance Gradients", 1992), which the interpolation extrapolates each sample with.
+ *
+ * The samples live in an octree: each in the node of about its radius of validity, which contains it; a lookup
+ * visits the nodes along the point's path down the tree (with their neighbours). The tree is shared by the render
+ * threads without locks: children are created, and samples prepended to a node's list, with compare-and-swap, so
+ * the lookups only ever see complete samples. Two threads may compute a sample for the same spot, at worst.
+ *
+ * The cache persists through the whole render (so the AA passes and the progressive iterations reuse the samples of
+ * the earlier ones), and can be saved to (and loaded from) a file, for fly-throughs of a static scene.
+ * The irradiance is in the units of the shaders: a white Lambert surface reflects exactly it.
+ */
+class IrradianceCache
+{
+public:
+    IrradianceCache() = default;
+    ~IrradianceCache();
+
+    IrradianceCache(const IrradianceCache&) = delete;
+    IrradianceCache& operator = (const IrradianceCache&) = delete;
+
+    /// sets up the octree around the scene's (bounded) nodes, and loads the file, the first time it's called
+    void BeginFrame();
+    void EndRender(); //!< saves the file (if there is one), and frees the samples
+
+    /// the (interpolated, or freshly computed) indirect irradiance at the point, where the ray hit the surface with the
+    /// given normal (turned to the ray's side)
+    Color GetIrradiance(const Ray& ray, const Vector& pos, const Vector& normal);
+
+    /// whether the hits of the ray take their indirect light from the cache
+    static bool IsUsedFor(const Ray& ray);
+
+    void PrintStatistics() const; //!< prints the number of samples computed and loaded, and how many lookups were interpolated
+
+private:
+    struct Sample
+    {
+        Vector pos;
+        Vector normal;
+        Color irradiance;
+        double radius;                   //!< the harmonic mean distance to the surroundings (clamped)
+        Vector rotationalGradient[3];    //!< per color component
+        Vector translationalGradient[3]; //!< per color component
+        Sample* next = nullptr;          //!< in the octree node's list
+    };
+
+    struct OctreeNode
+    {
+        std::atomic<OctreeNode*> children[8] = {};
+        std::atomic<Sample*> samples{nullptr};
+    };
+
+    /// adds the valid samples around pos (in the node and the children which reach pos) to the sums
+    void Lookup(const OctreeNode* node, const Vector& center, double size, const Vector& pos, const Vector& normal,
+                Color& sum, double& weightSum) const;
+
+    Sample* ComputeSample(const Ray& ray, const Vector& pos, const Vector& normal) const;
+    void Insert(Sample* sample);
+
+    bool Load(const std::string& filename);
+    bool Save(const std::string& filename) const;
+    void Free(OctreeNode* node);
+
+    OctreeNode* m_Root = nullptr;
+    Vector m_Center;
+    double m_Size = 0;          //!< of the root cube
+    double m_MinRadius = 0;
+    double m_MaxRadius = 0;
+    std::atomic<unsigned> m_NumSamples{0};
+    std::atomic<unsigned long long> m_NumLookups{0};
+    std::atomic<unsigned long long> m_NumInterpolated{0};
+};
+
+extern IrradianceCache irradianceCache;
+
+#endif //RAYTRACING_IRRADIANCECACHE_H
@@ -1,7 +1,165 @@
 #include "light.h"
 
+#include "utils.h"
+
+#include <algorithm>
+
 void Light::FillProperties(ParsedBlock& pb)
 {
     pb.GetVectorProp("pos", &pos);
     pb.GetDoubleProp("intensity", &intensity);
-}
\ No newline at end of file
+}
+
+void Light::GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const
+{
+    outSamplePos = pos;
+    outIntensity = intensity;
+}
+
+void Light::EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const
+{
+    outPos = pos;
+    outDir = UniformSphereSample(u1, u2);
+}
+
+void RectLight::FillProperties(ParsedBlock& pb)
+{
+    pb.GetDoubleProp("intensity", &intensity);
+    pb.GetTransformProp(m_Transform);
+    pb.GetIntProp("xSubd", &m_XSubd, 1);
+    pb.GetIntProp("ySubd", &m_YSubd, 1);
+    pb.GetIntProp("probeSamples", &m_ProbeSamples, 1);
+
+    if (GetNumSamples() > MAX_LIGHT_SAMPLES)
+        pb.SignalError("Too many light samples (xSubd*ySubd)");
+}
+
+void RectLight::BeginRender()
+{
+    pos = m_Transform.Point(Vector(0, 0, 0));
+    m_Normal = Normalize(m_Transform.Normal(Vector(0, -1, 0)));
+    m_Area = (m_Transform.Direction(Vector(1, 0, 0)) ^ m_Transform.Direction(Vector(0, 0, 1))).Length();
+}
+
+void RectLight::GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const
+{
+    outSamplePos = m_Transform.Point(Vector(u - 0.5, 0, v - 0.5));
+
+    // the light is one-sided; it's also dimmer at grazing angles
+    const double cosTheta = Dot(m_Normal, Normalize(shadePos - outSamplePos));
+    outIntensity = cosTheta > 0 ? intensity*cosTheta : 0.;
+}
+
+double RectLight::GetPdf(const Vector& shadePos, const Vector& samplePos) const
+{
+    // uniform over the area; per solid angle, that's distance^2 / (cos * area)
+    const Vector toShadePos = shadePos - samplePos;
+    const double distanceSqr = toShadePos.LengthSqr();
+    const double cosTheta = Dot(m_Normal, toShadePos) / sqrt(distanceSqr);
+    return cosTheta > 0 ? distanceSqr / (cosTheta * m_Area) : 0.;
+}
+
+bool RectLight::Intersect(const Ray& ray, double& outDist, double& outRadiance) const
+{
+    // only the lit side is hit
+    if (Dot(ray.dir, m_Normal) >= 0)
+        return false;
+
+    const Vector start = m_Transform.UndoPoint(ray.start);
+    const Vector dir = m_Transform.UndoDirection(ray.dir);
+    if (fabs(dir.y) < 1e-12)
+        return false;
+
+    const double distance = -start.y / dir.y;
+    const Vector p = start + dir*distance;
+    if (distance <= 0 || fabs(p.x) > 0.5 || fabs(p.z) > 0.5)
+        return false;
+
+    // GetSample()'s intensity is the light of the whole area, from which the shaders take intensity*cos/distance^2
+    outDist = distance;
+    outRadiance = PI * intensity / m_Area;
+    return true;
+}
+
+void RectLight::EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const
+{
+    // uniform over the area, and cosine-distributed (like GetSample()'s cosTheta falloff) below it
+    outPos = m_Transform.Point(Vector(u1 - 0.5, 0, u2 - 0.5));
+    outDir = CosineHemisphereSample(u3, u4, m_Normal);
+}
+
+void SphereLight::FillProperties(ParsedBlock& pb)
+{
+    pb.GetVectorProp("pos", &pos);
+    pb.GetDoubleProp("intensity", &intensity);
+    pb.GetDoubleProp("radius", &m_Radius, 0.);
+    pb.GetIntProp("numSamples", &m_NumSamples, 1, MAX_LIGHT_SAMPLES);
+    pb.GetIntProp("probeSamples", &m_ProbeSamples, 1);
+}
+
+void SphereLight::GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const
+{
+    const Vector toShadePos = shadePos - pos;
+    if (toShadePos.LengthSqr() <= Sqr(m_Radius))
+    {
+        // we're inside the light
+        outSamplePos = pos;
+        outIntensity = intensity;
+        return;
+    }
+
+    Vector a, b;
+    OrthonormalSystem(Normalize(toShadePos), a, b);
+
+    double x, y;
+    ConcentricDiscSample(u, v, x, y);
+
+    outSamplePos = pos + (a*x + b*y)*m_Radius;
+    outIntensity = intensity;
+}
+
+double SphereLight::GetPdf(const Vector& shadePos, const Vector& samplePos) const
+{
+    const Vector toShadePos = shadePos - pos;
+    if (toShadePos.LengthSqr() <= Sqr(m_Radius))
+        return 0.;
+
+    // uniform over the disc facing shadePos
+    const Vector fromSample = shadePos - samplePos;
+    const double distanceSqr = fromSample.LengthSqr();
+    const double cosTheta = Dot(Normalize(toShadePos), fromSample) / sqrt(distanceSqr);
+    return cosTheta > 0 ? distanceSqr / (cosTheta * PI * Sqr(m_Radius)) : 0.;
+}
+
+bool SphereLight::Intersect(const Ray& ray, double& outDist, double& outRadiance) const
+{
+    // the rays hit what the samples are taken on: the disc facing the ray's start, so both find the same points, with
+    // the densities GetPdf() gives
+    const Vector toStart = ray.start - pos;
+    const double radiusSqr = Sqr(m_Radius);
+    if (toStart.LengthSqr() <= radiusSqr)
+        return false;
+
+    const Vector discNormal = Normalize(toStart);
+    const double cosTheta = -Dot(ray.dir, discNormal);
+    if (cosTheta <= 0)
+        return false;
+
+    const double distance = Dot(toStart, discNormal) / cosTheta;
+    if ((ray.start + ray.dir*distance - pos).LengthSqr() > radiusSqr)
+        return false;
+
+    // the samples light a point like a point light of the given intensity, each at its own distance, spread over the
+    // disc (of area PI*radius^2); per solid angle, the disc is cos times smaller than its area
+    outDist = distance;
+    outRadiance = intensity / (radiusSqr * cosTheta);
+    return true;
+}
+
+void SphereLight::EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const
+{
+    // a uniformly bright (diffuse) sphere shines equally in all directions, like the point light it's sampled as
+    const Vector normal = UniformSphereSample(u1, u2);
+    outPos = pos + normal*m_Radius;
+    outDir = CosineHemisphereSample(u3, u4, normal);
+}
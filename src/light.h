@@ -1,15 +1,88 @@
 #ifndef RAYTRACING_LIGHT_H
 #define RAYTRACING_LIGHT_H
 
+#include "ray.h"
 #include "scene.h"
+#include "transform.h"
 
+/// A point light. Area lights derive from it and override the sampling functions below;
+/// `pos' is then the center of the light, used wherever a single representative point is enough.
 struct Light : public SceneElement
 {
     Vector pos;
-    double intensity;
+    double intensity = 0.;
 
     virtual ElementType GetElementType() const override { return ElementType::LIGHT; }
     virtual void FillProperties(ParsedBlock& pb) override;
+
+    /// the full number of shadow samples, taken in the penumbra
+    virtual int GetNumSamples() const { return 1; }
+
+    /// the number of samples, taken first. If all of them agree on the visibility, the rest are skipped
+    virtual int GetNumProbeSamples() const { return 1; }
+
+    /// Maps a point (u, v) from the unit square to a point on the light.
+    /// outIntensity is the intensity of that point as seen from `shadePos' (before the distance falloff)
+    virtual void GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const;
+
+    /// The density (per solid angle, as seen from `shadePos') of GetSample() picking samplePos, for a uniform (u, v).
+    /// 0 for a point light, which only the light samples can find.
+    virtual double GetPdf(const Vector& shadePos, const Vector& samplePos) const { return 0.; }
+
+    /// Whether the ray hits the light (in GI, the diffuse rays may). outDist is the distance to the hit, and outRadiance
+    /// the light coming back along the ray, in the units the shaders use (so a diffuse ray which hits the light brings,
+    /// on average, what GetSample() lights the point with).
+    virtual bool Intersect(const Ray& ray, double& outDist, double& outRadiance) const { return false; }
+
+    /// The total power the light emits, in the units the shaders use (the photons, which it's split into, light a
+    /// surface as much as the light samples do). For a point light, shining equally in all directions, 4*PI*intensity.
+    virtual double GetPower() const { return 4 * PI * intensity; }
+
+    /// Maps a point (u1, u2, u3, u4) from the unit hypercube to a photon leaving the light, distributed like its light
+    virtual void EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const;
+};
+
+/// A rectangular light. In its canonic space it's the square (-0.5, 0, -0.5)..(0.5, 0, 0.5), shining downwards (-Y).
+/// Use scale/rotate/translate to place it.
+struct RectLight : public Light
+{
+    virtual void FillProperties(ParsedBlock& pb) override;
+    virtual void BeginRender() override;
+
+    virtual int GetNumSamples() const override { return m_XSubd*m_YSubd; }
+    virtual int GetNumProbeSamples() const override { return m_ProbeSamples; }
+    virtual void GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const override;
+    virtual double GetPdf(const Vector& shadePos, const Vector& samplePos) const override;
+    virtual bool Intersect(const Ray& ray, double& outDist, double& outRadiance) const override;
+    virtual double GetPower() const override { return PI * intensity; }
+    virtual void EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const override;
+
+private:
+    Transform m_Transform;
+    Vector m_Normal;
+    double m_Area = 1.;
+    int m_XSubd = 2;
+    int m_YSubd = 2;
+    int m_ProbeSamples = 4;
+};
+
+/// A spherical light. The samples are taken on the disc, which the sphere projects to, as seen from the shaded point;
+/// in GI, the rays hit the same disc (as seen from where they start), so the two are weighted against each other right.
+struct SphereLight : public Light
+{
+    virtual void FillProperties(ParsedBlock& pb) override;
+
+    virtual int GetNumSamples() const override { return m_NumSamples; }
+    virtual int GetNumProbeSamples() const override { return m_ProbeSamples; }
+    virtual void GetSample(double u, double v, const Vector& shadePos, Vector& outSamplePos, double& outIntensity) const override;
+    virtual double GetPdf(const Vector& shadePos, const Vector& samplePos) const override;
+    virtual bool Intersect(const Ray& ray, double& outDist, double& outRadiance) const override;
+    virtual void EmitPhoton(double u1, double u2, double u3, double u4, Vector& outPos, Vector& outDir) const override;
+
+private:
+    double m_Radius = 1.;
+    int m_NumSamples = 16;
+    int m_ProbeSamples = 4;
 };
 
 #endif //RAYTRACING_LIGHT_H
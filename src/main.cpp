@@ -1,51 +1,72 @@
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <cstring>
+#include <memory>
 #include <SDL.h>
+#include <type_traits>
 #include <vector>
 
+#include "bitmap.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "color.h"
+#include "coordinator.h"
 #include "environment.h"
+#include "exrmerge.h"
+#include "framebuffer.h"
 #include "geometry.h"
+#include "irradiancecache.h"
+#include "parallel.h"
 #include "random_generator.h"
+#include "sampler.h"
 #include "sdl.h"
 #include "shading.h"
+#include "shadinghelper.h"
 #include "texture.h"
+#include "tiledexroutput.h"
 #include "utils.h"
+#include "wavefront.h"
 
-Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
-bool needChange[VFB_MAX_SIZE][VFB_MAX_SIZE] = {{false}};
+Framebuffer vfb; //!< sized from the scene settings, once they are parsed
+RenderCoordinator* coordinator = nullptr; //!< when rendering on worker processes (--workers)
+Checkpoint* checkpoint = nullptr; //!< when saving the progress of the render (--checkpoint)
 
-Color Raytrace(const Ray& ray)
+Color Raytrace(const Ray& ray);
+
+/// the recursive engine's secondary rays: each is traced right away, from its own branch of the sample's numbers
+class RecursiveRays : public SecondaryRays
 {
-    if (ray.depth > scene.settings.maxTraceDepth)
-        return Color{0, 0, 0};
+public:
+    virtual bool ReturnsLight() const override { return true; }
 
-    const Node* closestNode = nullptr;
-    double closestDist = INF;
-    IntersectionInfo closestInfo = IntersectionInfo();
-    for (const Node* node : scene.nodes)
+protected:
+    virtual Color TraceRay(const Ray& ray, const Color& factor) override
     {
-        IntersectionInfo info;
-        if (!node->Intersect(ray, info))
-            continue;
-
-        if (closestDist <= info.distance)
-            continue;
-
-        closestDist = info.distance;
-        closestNode = node;
-        closestInfo = info;
+        return Raytrace(ray)*factor;
     }
+};
 
-    // check if we hit the sky
+/// the light coming along the ray, which hits closestNode (or nothing) at closestInfo
+static Color ShadeClosestHit(const Ray& ray, const Node* closestNode, IntersectionInfo& closestInfo)
+{
+    // (in GI, the diffuse rays may hit the area lights)
     Color result{0, 0, 0};
+    if (ShadingHelper::HitLight(ray, closestNode ? closestInfo.distance : INF, result))
+        return result;
+
+    // check if we hit the sky
     if (closestNode)
     {
         closestInfo.rayDir = ray.dir;
         if (closestNode->bump)
             closestNode->bump->ModifyNormal(closestInfo);
 
-        result = closestNode->shader->Shade(ray, closestInfo);
+        RecursiveRays rays;
+        rays.SetWeight(ray.throughput);
+        rays.SetBudget(ray.budget);
+        result = closestNode->shader->Shade(ray, closestInfo, rays);
     }
     else if (scene.environment)
     {
@@ -55,109 +76,678 @@ Color Raytrace(const Ray& ray)
     return result;
 }
 
-bool IsTooDifferent(int x, int y)
+Color Raytrace(const Ray& ray)
 {
-    const int dx[] = {0,  0, -1, 1, -1, -1, 1,  1};
-    const int dy[] = {1, -1,  0, 0, -1,  1, 1, -1};
-    for (unsigned i = 0; i < COUNT_OF(dx); ++i)
-    {
-        unsigned nx = (unsigned) x + dx[i];
-        unsigned ny = (unsigned) y + dy[i];
-        if (VFB_MAX_SIZE <= nx || VFB_MAX_SIZE <= ny)
-            continue;
+    if (ray.depth > scene.settings.maxTraceDepth)
+        return Color{0, 0, 0};
 
-        double diff = 0;
-        for ( unsigned j = 0; j < 3; ++j )
-        {
-//            if (vfb[y][x][j] >= 1 && vfb[ny][nx][j] >= 1)
-////                continue;
+    IntersectionInfo closestInfo = IntersectionInfo();
+    const Node* closestNode = scene.bvh.Intersect(ray, closestInfo);
+    return ShadeClosestHit(ray, closestNode, closestInfo);
+}
 
-            diff += std::abs(vfb[y][x][j] - vfb[ny][nx][j]);
-        }
+Color Raytrace(const Ray& ray, double& outDistance)
+{
+    // (the distance is wanted even for a ray which is too deep to be shaded)
+    IntersectionInfo closestInfo = IntersectionInfo();
+    const Node* closestNode = scene.bvh.Intersect(ray, closestInfo);
+    outDistance = closestNode ? closestInfo.distance : INF;
+    if (ray.depth > scene.settings.maxTraceDepth)
+        return Color{0, 0, 0};
 
-        if (diff > scene.settings.aaThreshold)
-            return true;
+    return ShadeClosestHit(ray, closestNode, closestInfo);
+}
+
+/// Traces the sampleIndex-th camera sample of pixel (x, y). Unless jittered, the ray goes through
+/// the pixel's corner (which is what the non-AA render does); otherwise the sampler places it in the pixel.
+static Color TracePixelSample(int x, int y, unsigned sampleIndex, bool jitter)
+{
+    if (scene.settings.engine == RenderEngine::Wavefront)
+    {
+        const CameraSample sample{x, y, sampleIndex, jitter};
+        Color result;
+        TraceWavefront(&sample, 1, &result);
+        return result;
     }
 
-    return false;
+    Sampler& sampler = GetSampler();
+    sampler.StartSample(x, y, sampleIndex);
+
+    double dx = 0, dy = 0;
+    if (jitter)
+        sampler.Get2D(dx, dy);
+
+    return Raytrace(scene.camera->GetScreenRay(x + dx, y + dy));
+}
+
+/// Traces the samples firstSample..firstSample+count-1 of each pixel of r for which wanted(x, y) holds, and hands
+/// them to take(x, y, samples) (count colors, in sample order), pixel by pixel. The wavefront engine traces all
+/// samples of the bucket together.
+template <typename Wanted, typename Take>
+static void TraceBucketSamples(const Rect& r, unsigned firstSample, unsigned count, bool jitter, Wanted wanted, Take take)
+{
+    if (count == 0)
+        return;
+
+    static thread_local std::vector<CameraSample> samples;
+    static thread_local std::vector<Color> results;
+    samples.clear();
+    for (int y = r.y0; y < r.y1; ++y)
+        for (int x = r.x0; x < r.x1; ++x)
+            if (wanted(x, y))
+                for (unsigned i = 0; i < count; ++i)
+                    samples.push_back({x, y, firstSample + i, jitter});
+
+    results.resize(samples.size());
+    if (scene.settings.engine == RenderEngine::Wavefront)
+        TraceWavefront(samples.data(), samples.size(), results.data());
+    else
+        for (size_t i = 0; i < samples.size(); ++i)
+            results[i] = TracePixelSample(samples[i].x, samples[i].y, samples[i].sampleIndex, samples[i].jitter);
+
+    for (size_t i = 0; i < samples.size(); i += count)
+        take(samples[i].x, samples[i].y, &results[i]);
+}
+
+/// all pixels of the bucket (for TraceBucketSamples())
+static bool AllPixels(int, int)
+{
+    return true;
+}
+
+/// With --checkpoint: starts the render mode in the checkpoint, or, if that holds the mode's state (with --resume),
+/// restores vfb and aux (the mode's per-pixel data: width*height items of auxSize bytes). Returns whether it did.
+static bool ResumeRender(CheckpointMode mode, const std::vector<Rect>& buckets, void* aux = nullptr, size_t auxSize = 0)
+{
+    if (!checkpoint || !checkpoint->Resume(scene.frame, mode, buckets, vfb.GetWidth(), vfb.GetHeight(), aux, auxSize))
+        return false;
+
+    checkpoint->Restore(vfb, aux);
+    DisplayVFB(vfb, scene.settings.useSRGB);
+    return true;
+}
+
+/// the buckets which aren't finished in the current pass (with --checkpoint, a resumed render has done some)
+static std::vector<Rect> GetRemainingBuckets(const std::vector<Rect>& buckets)
+{
+    return checkpoint ? checkpoint->GetRemainingBuckets() : buckets;
 }
 
 bool SimpleRender()
 {
     SetWindowCaption("Quad Damage: Simple Pass");
 
-    std::vector<Rect> buckets = GetBucketList();
-    for (Rect& r : buckets)
+    if (checkpoint)
+        checkpoint->StartPass(0);
+    return ParallelForBuckets(GetRemainingBuckets(GetBucketList(vfb.GetWidth(), vfb.GetHeight())), [](const Rect& r)
     {
-        for (int y = r.y0; y < r.y1; ++y)
-            for (int x = r.x0; x < r.x1; ++x)
+        TraceBucketSamples(r, 0, 1, false, AllPixels, [](int x, int y, const Color* samples)
+        {
+            vfb[y][x] = samples[0];
+        });
+
+        if (checkpoint)
+            checkpoint->BucketDone(r, vfb, nullptr);
+        return DisplayVFBRect(r, vfb, scene.settings.useSRGB);
+    });
+}
+
+/// Non-adaptive AA: every pixel gets aaSamples samples; sample 0 is the one from the simple pass
+void AARender()
+{
+    SetWindowCaption("Quad Damage: AA Pass");
+
+    const unsigned numSamples = scene.settings.aaSamples;
+    if (checkpoint)
+        checkpoint->StartPass(1);
+    ParallelForBuckets(GetRemainingBuckets(GetBucketList(vfb.GetWidth(), vfb.GetHeight())), [numSamples](const Rect& r)
+    {
+        if (scene.settings.showAA)
+        {
+            for (int y = r.y0; y < r.y1; ++y)
+                for (int x = r.x0; x < r.x1; ++x)
+                    vfb[y][x] = scene.settings.aaDebugColor;
+        }
+        else
+        {
+            TraceBucketSamples(r, 1, numSamples - 1, true, AllPixels, [numSamples](int x, int y, const Color* samples)
             {
-                const Ray ray = scene.camera->GetScreenRay(x, y);
-                vfb[y][x] = Raytrace(ray);
-            }
+                Color result = vfb[y][x];
+                for (unsigned i = 0; i < numSamples - 1; ++i)
+                    result += samples[i];
 
-        if (!DisplayVFBRect(r, vfb, scene.settings.useSRGB))
-            return false;
+                vfb[y][x] = result / double(numSamples);
+            });
+        }
+
+        if (checkpoint)
+            checkpoint->BucketDone(r, vfb, nullptr);
+        return DisplayVFBRect(r, vfb, scene.settings.useSRGB);
+    });
+}
+
+/// The running statistics of a pixel's samples (Welford's algorithm). The noise is estimated
+/// from the intensity, clamped to the displayable range, so a few very bright samples
+/// (which would show as white anyway) don't keep the pixel sampling forever.
+struct PixelEstimate
+{
+    Color mean;
+    double intensityMean = 0;
+    double intensityM2 = 0; //!< sum of squared differences from the mean
+    unsigned count = 0;
+    bool active = true; //!< still needs more samples
+
+    void AddSample(const Color& sample)
+    {
+        ++count;
+        mean += (sample - mean) / float(count);
+
+        const double intensity = Clamp(double(sample.Intensity()), 0., 1.);
+        const double delta = intensity - intensityMean;
+        intensityMean += delta / count;
+        intensityM2 += delta * (intensity - intensityMean);
     }
 
-    return true;
+    /// the standard error of the intensity's mean
+    double GetError() const
+    {
+        return count > 1 ? sqrt(intensityM2 / ((count - 1) * double(count))) : INF;
+    }
+};
+static_assert(std::is_trivially_copyable<PixelEstimate>::value, "the estimates are saved in checkpoints as they are");
+
+/// how many samples to add to the still active pixels, which have samplesPerPixel samples each: double them, within
+/// maxSamples, and within what is left of the budget (shared evenly among the active pixels)
+static unsigned GetNextBatch(unsigned samplesPerPixel, unsigned long long numActive,
+                             unsigned long long samplesTaken, unsigned long long budget)
+{
+    unsigned batch = std::min(samplesPerPixel, scene.settings.maxSamples - samplesPerPixel);
+    if (budget != ULLONG_MAX && numActive > 0)
+        batch = static_cast<unsigned>(std::min<unsigned long long>(batch, (budget - std::min(budget, samplesTaken)) / numActive));
+    return batch;
 }
 
-void AARender()
+/// Adaptive AA: all pixels get minSamples samples (regardless of the budget), then, in passes, the noisy ones get more, until their
+/// estimated error is below noiseThreshold, or they reach maxSamples, or the frame exhausts its sample budget.
+/// Every pass samples all still active pixels alike, so the budget is spread over the whole frame
+/// (and not taken by the first buckets), and the result doesn't depend on the thread count.
+void AdaptiveRender()
 {
-    SetWindowCaption("Quad Damage: AA Pass");
+    const GlobalSettings& settings = scene.settings;
+    const int width = vfb.GetWidth();
+    const int height = vfb.GetHeight();
+    const std::vector<Rect> buckets = GetBucketList(vfb.GetWidth(), vfb.GetHeight());
 
-    if (!scene.settings.wantAA)
-        return;
+    // (for a partial render, only the pixels in the buckets count)
+    unsigned long long numPixels = 0;
+    for (const Rect& r : buckets)
+        numPixels += static_cast<unsigned long long>(r.w) * r.h;
+    const unsigned long long budget = settings.sampleBudget > 0
+                                      ? static_cast<unsigned long long>(settings.sampleBudget * numPixels)
+                                      : ULLONG_MAX;
 
-    const double kernel[5][2] = {
-            {0.0, 0.0},
-            {0.6, 0.0},
-            {0.0, 0.6},
-            {0.3, 0.3},
-            {0.6, 0.6}
-    };
-    const int kernelSize = COUNT_OF(kernel);
+    std::vector<PixelEstimate> estimates(static_cast<size_t>(width) * height);
 
-    std::vector<Rect> buckets = GetBucketList();
-    for (Rect& r : buckets)
+    unsigned long long samplesTaken = 0;
+    unsigned long long numActive = numPixels;
+    unsigned samplesPerPixel = 0; // that all active pixels have
+    unsigned batch = settings.minSamples;
+    int pass = 0;
+    if (ResumeRender(CheckpointMode::Adaptive, buckets, estimates.data(), sizeof(PixelEstimate)))
     {
-        for (int y = r.y0; y < r.y1; ++y)
-            for (int x = r.x0; x < r.x1; ++x)
-                needChange[x][y] = !scene.settings.wantAdaptiveAA || IsTooDifferent(x, y);
+        pass = checkpoint->GetPass();
+        samplesTaken = checkpoint->GetValue(0);
+        numActive = checkpoint->GetValue(1);
+        samplesPerPixel = static_cast<unsigned>(checkpoint->GetValue(2));
+        batch = static_cast<unsigned>(checkpoint->GetValue(3));
+    }
 
-        for (int y = r.y0; y < r.y1; ++y)
-            for (int x = r.x0; x < r.x1; ++x)
+    while (numActive > 0 && batch > 0)
+    {
+        SetWindowCaption("Quad Damage: Adaptive Pass %.0f", pass + 1.f);
+
+        // (the buckets of this pass, which were finished before resuming, count too)
+        unsigned long long resumedActive = 0;
+        if (checkpoint)
+        {
+            checkpoint->StartPass(pass, {samplesTaken, numActive, samplesPerPixel, batch});
+            for (const Rect& r : buckets)
+                if (checkpoint->IsBucketDone(r))
+                    for (int y = r.y0; y < r.y1; ++y)
+                        for (int x = r.x0; x < r.x1; ++x)
+                            resumedActive += estimates[y*width + x].active;
+        }
+
+        std::atomic<unsigned long long> stillActive{resumedActive};
+        const unsigned firstSample = samplesPerPixel;
+        const bool completed = ParallelForBuckets(GetRemainingBuckets(buckets), [&](const Rect& r)
+        {
+            auto isActive = [&](int x, int y) { return estimates[y*width + x].active; };
+            TraceBucketSamples(r, firstSample, batch, true, isActive, [&](int x, int y, const Color* samples)
             {
-                if (!needChange[x][y])
-                    continue;
+                PixelEstimate& estimate = estimates[y*width + x];
+                for (unsigned i = 0; i < batch; ++i)
+                    estimate.AddSample(samples[i]);
 
-                if (scene.settings.showAA)
-                    vfb[y][x] = scene.settings.aaDebugColor;
+                estimate.active = estimate.count < settings.maxSamples && estimate.GetError() > settings.noiseThreshold;
+                if (estimate.active)
+                    ++stillActive;
+
+                if (settings.showAA) // shows the sample density
+                    vfb[y][x] = settings.aaDebugColor * (estimate.count / float(settings.maxSamples));
                 else
-                {
-                    Color result = vfb[y][x];
-                    for (int i = 1; i < kernelSize; ++i)
+                    vfb[y][x] = estimate.mean;
+            });
+
+            if (checkpoint)
+                checkpoint->BucketDone(r, vfb, estimates.data());
+            return DisplayVFBRect(r, vfb, settings.useSRGB);
+        });
+
+        if (!completed)
+            return;
+
+        samplesTaken += numActive * batch;
+        samplesPerPixel += batch;
+        numActive = stillActive;
+        ++pass;
+
+        batch = GetNextBatch(samplesPerPixel, numActive, samplesTaken, budget);
+    }
+
+    printf("Adaptive AA: %d passes, %.2lf samples per pixel on average", pass, double(samplesTaken) / numPixels);
+    if (numActive > 0)
+        printf(", %llu pixels ran out of sample budget", numActive);
+    printf("\n");
+}
+
+/// Progressive rendering: each iteration adds one jittered sample to every pixel, into a float accumulation buffer,
+/// and the running average is displayed. Stops at the sample or time limit (checked between iterations, so
+/// every pixel always has the same number of samples), or when the user closes the window.
+void ProgressiveRender()
+{
+    const GlobalSettings& settings = scene.settings;
+    const int width = vfb.GetWidth();
+    const int height = vfb.GetHeight();
+    std::vector<Color> accumulated(static_cast<size_t>(width) * height);
+    const std::vector<Rect> buckets = GetBucketList(vfb.GetWidth(), vfb.GetHeight());
+
+    const Uint32 startTicks = SDL_GetTicks();
+    unsigned numSamples = 0;
+    if (ResumeRender(CheckpointMode::Progressive, buckets, accumulated.data(), sizeof(Color)))
+        numSamples = checkpoint->GetPass();
+
+    while (settings.progressiveSamples == 0 || numSamples < settings.progressiveSamples)
+    {
+        if (settings.progressiveTimeLimit > 0 && (SDL_GetTicks() - startTicks) / 1000. >= settings.progressiveTimeLimit)
+            break;
+
+        const unsigned sampleIndex = numSamples;
+        const float invCount = 1.f / (sampleIndex + 1);
+        if (checkpoint)
+            checkpoint->StartPass(sampleIndex);
+        const bool completed = ParallelForBuckets(GetRemainingBuckets(buckets), [&](const Rect& r)
+        {
+            TraceBucketSamples(r, sampleIndex, 1, true, AllPixels, [&](int x, int y, const Color* samples)
+            {
+                Color& sum = accumulated[y*width + x];
+                sum += samples[0];
+                vfb[y][x] = sum * invCount;
+            });
+
+            if (checkpoint)
+                checkpoint->BucketDone(r, vfb, accumulated.data());
+            return DisplayVFBRect(r, vfb, settings.useSRGB);
+        });
+
+        if (!completed)
+            break;
+
+        ++numSamples;
+        SetWindowCaption("Quad Damage: Progressive, %.0f samples per pixel", float(numSamples));
+    }
+
+    printf("Progressive: %u samples per pixel in %.2lfs\n", numSamples, (SDL_GetTicks() - startTicks) / 1000.);
+}
+
+/// Deadline mode: the best image that can be had in `deadline' seconds. A coarse pass (one pixel of every 4x4 block,
+/// with shallower rays) shows the whole frame quickly; then every pixel gets a sample, and a second one (so that its
+/// noise can be estimated), and then come the passes of the adaptive AA, each going through the buckets from the
+/// noisiest one down. The clock is checked before every sample, so the render stops right at the deadline, wherever
+/// it is, and every pixel shows the best estimate it has.
+void DeadlineRender()
+{
+    const GlobalSettings& settings = scene.settings;
+    const int width = vfb.GetWidth();
+    const std::vector<Rect> buckets = GetBucketList(vfb.GetWidth(), vfb.GetHeight());
+    const Uint32 startTicks = SDL_GetTicks();
+    const Uint32 budgetMs = static_cast<Uint32>(settings.deadline * 1000);
+    auto expired = [&]() { return SDL_GetTicks() - startTicks >= budgetMs; };
+
+    // the coarse pass
+    const int COARSE_BLOCK = 4;
+    const unsigned maxTraceDepth = settings.maxTraceDepth;
+    scene.settings.maxTraceDepth = std::min(maxTraceDepth, 2u);
+    SetWindowCaption("Quad Damage: Deadline, coarse pass");
+    ParallelForBuckets(buckets, [&](const Rect& r)
+    {
+        for (int y = r.y0; y < r.y1; y += COARSE_BLOCK)
+            for (int x = r.x0; x < r.x1; x += COARSE_BLOCK)
+            {
+                if (expired())
+                    return false;
+
+                const Color c = TracePixelSample(x, y, 0, false);
+                for (int by = y; by < std::min(y + COARSE_BLOCK, r.y1); ++by)
+                    for (int bx = x; bx < std::min(x + COARSE_BLOCK, r.x1); ++bx)
+                        vfb[by][bx] = c;
+            }
+
+        return DisplayVFBRect(r, vfb, settings.useSRGB);
+    });
+    scene.settings.maxTraceDepth = maxTraceDepth;
+
+    // the refinement: passes 0 and 1 give every pixel its first and second sample; the later ones double the samples
+    // of the pixels, which are still noisy
+    std::vector<PixelEstimate> estimates(static_cast<size_t>(width) * vfb.GetHeight());
+    auto isNoisy = [&](const PixelEstimate& estimate)
+    {
+        return estimate.count < settings.maxSamples && estimate.GetError() > settings.noiseThreshold;
+    };
+
+    int pass = 0;
+    bool converged = false;
+    while (!expired())
+    {
+        SetWindowCaption("Quad Damage: Deadline, refinement pass %.0f", pass + 1.f);
+
+        // the noisiest buckets go first (in the first two passes, all of them are, in their usual order)
+        std::vector<std::pair<double, Rect>> ranked;
+        for (const Rect& r : buckets)
+        {
+            double noise = 0;
+            bool hasNoisyPixels = pass < 2;
+            if (pass >= 2)
+                for (int y = r.y0; y < r.y1; ++y)
+                    for (int x = r.x0; x < r.x1; ++x)
                     {
-                        const Ray ray = scene.camera->GetScreenRay(x + kernel[i][0], y + kernel[i][1]);
-                        result += Raytrace(ray);
+                        const PixelEstimate& estimate = estimates[y*width + x];
+                        if (isNoisy(estimate))
+                        {
+                            hasNoisyPixels = true;
+                            noise += estimate.GetError();
+                        }
                     }
+            if (hasNoisyPixels)
+                ranked.emplace_back(noise, r);
+        }
+        if (ranked.empty())
+        {
+            converged = true;
+            break;
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<double, Rect>& a, const std::pair<double, Rect>& b)
+        {
+            return a.first > b.first;
+        });
+        std::vector<Rect> order;
+        for (const auto& item : ranked)
+            order.push_back(item.second);
 
-                    vfb[y][x] = result /  double(kernelSize);
+        const bool completed = ParallelForBuckets(order, [&](const Rect& r)
+        {
+            bool inTime = true;
+            for (int y = r.y0; y < r.y1 && inTime; ++y)
+                for (int x = r.x0; x < r.x1 && inTime; ++x)
+                {
+                    PixelEstimate& estimate = estimates[y*width + x];
+                    unsigned batch;
+                    if (pass < 2)
+                        batch = pass + 1 - estimate.count;
+                    else if (isNoisy(estimate))
+                        batch = std::min(estimate.count, settings.maxSamples - estimate.count);
+                    else
+                        continue;
+
+                    for (unsigned i = 0; i < batch && (inTime = !expired()); ++i)
+                        estimate.AddSample(TracePixelSample(x, y, estimate.count, true));
+
+                    if (estimate.count == 0)
+                        continue; // (the coarse pass' color stays)
+                    if (settings.showAA) // shows the sample density
+                        vfb[y][x] = settings.aaDebugColor * (estimate.count / float(settings.maxSamples));
+                    else
+                        vfb[y][x] = estimate.mean;
+                }
+
+            return DisplayVFBRect(r, vfb, settings.useSRGB) && inTime;
+        });
+
+        if (!completed)
+            break;
+        ++pass;
+    }
+
+    // the quality reached
+    unsigned long long numPixels = 0, numSampled = 0, numEstimated = 0, numConverged = 0, numSamples = 0;
+    double sumSquaredNoise = 0;
+    for (const Rect& r : buckets)
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+            {
+                const PixelEstimate& estimate = estimates[y*width + x];
+                ++numPixels;
+                numSamples += estimate.count;
+                numSampled += estimate.count > 0;
+                if (estimate.count > 1)
+                {
+                    ++numEstimated;
+                    numConverged += estimate.GetError() <= settings.noiseThreshold;
+                    sumSquaredNoise += Sqr(estimate.GetError());
                 }
             }
 
-        if (!DisplayVFBRect(r, vfb, scene.settings.useSRGB))
-            return;
+    printf("Deadline: %.3lfs of %.3lfs, %s after %d full refinement passes\n", (SDL_GetTicks() - startTicks) / 1000.,
+           settings.deadline, converged ? "converged" : "stopped", pass);
+    printf("Deadline quality: %.1f%% of the pixels sampled at full resolution, %.2lf samples per pixel on average, "
+           "%.1f%% converged (noise below %g), RMS noise %.4lf\n",
+           100. * numSampled / numPixels, double(numSamples) / numPixels, 100. * numConverged / numPixels,
+           settings.noiseThreshold, numEstimated ? sqrt(sumSquaredNoise / numEstimated) : 0.);
+}
+
+/// Renders the bucket r to completion into tile (tile[0][0] being the top-left pixel of r). Used for the streamed
+/// output, where the frame is never whole in memory, so there are no frame-wide passes: the adaptive AA does its
+/// passes within the bucket, and the sample budget is per bucket.
+static void RenderBucket(const Rect& r, Framebuffer& tile)
+{
+    const GlobalSettings& settings = scene.settings;
+    if (!settings.wantAA || !settings.wantAdaptiveAA)
+    {
+        const unsigned numSamples = settings.wantAA ? settings.aaSamples : 1;
+        TraceBucketSamples(r, 0, 1, false, AllPixels, [&](int x, int y, const Color* samples)
+        {
+            tile[y - r.y0][x - r.x0] = samples[0];
+        });
+        TraceBucketSamples(r, 1, numSamples - 1, true, AllPixels, [&](int x, int y, const Color* samples)
+        {
+            Color& result = tile[y - r.y0][x - r.x0];
+            for (unsigned i = 0; i < numSamples - 1; ++i)
+                result += samples[i];
+        });
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+                tile[y - r.y0][x - r.x0] /= double(numSamples);
+        return;
+    }
+
+    const unsigned long long numPixels = static_cast<unsigned long long>(r.w) * r.h;
+    const unsigned long long budget = settings.sampleBudget > 0
+                                      ? static_cast<unsigned long long>(settings.sampleBudget * numPixels)
+                                      : ULLONG_MAX;
+    std::vector<PixelEstimate> estimates(numPixels);
+
+    unsigned long long samplesTaken = 0;
+    unsigned long long numActive = numPixels;
+    unsigned samplesPerPixel = 0;
+    unsigned batch = settings.minSamples;
+    while (numActive > 0 && batch > 0)
+    {
+        unsigned long long stillActive = 0;
+        auto isActive = [&](int x, int y) { return estimates[(y - r.y0)*r.w + (x - r.x0)].active; };
+        TraceBucketSamples(r, samplesPerPixel, batch, true, isActive, [&](int x, int y, const Color* samples)
+        {
+            PixelEstimate& estimate = estimates[(y - r.y0)*r.w + (x - r.x0)];
+            for (unsigned i = 0; i < batch; ++i)
+                estimate.AddSample(samples[i]);
+
+            estimate.active = estimate.count < settings.maxSamples && estimate.GetError() > settings.noiseThreshold;
+            if (estimate.active)
+                ++stillActive;
+        });
+
+        samplesTaken += numActive * batch;
+        samplesPerPixel += batch;
+        numActive = stillActive;
+        batch = GetNextBatch(samplesPerPixel, numActive, samplesTaken, budget);
     }
+
+    for (int y = r.y0; y < r.y1; ++y)
+        for (int x = r.x0; x < r.x1; ++x)
+        {
+            const PixelEstimate& estimate = estimates[(y - r.y0)*r.w + (x - r.x0)];
+            tile[y - r.y0][x - r.x0] = settings.showAA ? settings.aaDebugColor * (estimate.count / float(settings.maxSamples))
+                                                       : estimate.mean;
+        }
+}
+
+/// Renders straight into a tiled EXR file: each bucket is rendered to completion in its own small buffer,
+/// written out as a tile, and freed, so only the buckets in flight are in memory. No window is shown.
+bool StreamingRender(const char* filename)
+{
+    const int frameWidth = scene.settings.frameWidth;
+    const int frameHeight = scene.settings.frameHeight;
+    const std::vector<Rect> buckets = GetBucketList(frameWidth, frameHeight);
+
+    TiledEXROutput output;
+    const bool opened = scene.settings.IsPartialRender()
+                        ? output.OpenPartial(filename, frameWidth, frameHeight, GetBucketSize(),
+                                             GetBucketGridBounds(buckets, frameWidth, frameHeight))
+                        : output.Open(filename, frameWidth, frameHeight, GetBucketSize());
+    if (!opened)
+        return false;
+
+    std::atomic<int> bucketsDone{0};
+    auto writeTile = [&](const Rect& r, const Framebuffer& tile)
+    {
+        if (!output.WriteTile(r, tile))
+            return false;
+
+        const int done = ++bucketsDone;
+        if (done % 64 == 0 || done == (int) buckets.size())
+            printf("%d of %d buckets written\n", done, (int) buckets.size());
+        return true;
+    };
+
+    bool completed;
+    if (coordinator)
+    {
+        completed = coordinator->Render(scene.frame, buckets, writeTile);
+    }
+    else
+    {
+        scene.BeginFrame();
+        completed = ParallelForBuckets(buckets, [&](const Rect& r)
+        {
+            Framebuffer tile(r.w, r.h);
+            RenderBucket(r, tile);
+            return writeTile(r, tile);
+        });
+    }
+
+    output.Close();
+    return completed;
+}
+
+/// Saves the buckets of a partial render, from vfb, into a partial EXR (see TiledEXROutput::OpenPartial())
+static bool SavePartialEXR(const char* filename)
+{
+    const int frameWidth = vfb.GetWidth();
+    const int frameHeight = vfb.GetHeight();
+    const std::vector<Rect> buckets = GetBucketList(frameWidth, frameHeight);
+
+    TiledEXROutput output;
+    if (!output.OpenPartial(filename, frameWidth, frameHeight, GetBucketSize(), GetBucketGridBounds(buckets, frameWidth, frameHeight)))
+        return false;
+
+    Framebuffer tile;
+    for (const Rect& r : buckets)
+    {
+        tile.Resize(r.w, r.h);
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+                tile[y - r.y0][x - r.x0] = vfb[y][x];
+
+        if (!output.WriteTile(r, tile))
+            return false;
+    }
+
+    output.Close();
+    printf("Saved the rendered part as '%s'\n", filename);
+    return true;
+}
+
+/// Renders on the worker processes, and shows the buckets as they come. Like the streamed output, each bucket is
+/// rendered to completion, so the adaptive AA is done per bucket.
+bool CoordinatedRender()
+{
+    SetWindowCaption("Quad Damage: rendering on worker processes");
+
+    const std::vector<Rect> buckets = GetBucketList(vfb.GetWidth(), vfb.GetHeight());
+    ResumeRender(CheckpointMode::Workers, buckets);
+    if (checkpoint)
+        checkpoint->StartPass(0);
+    return coordinator->Render(scene.frame, GetRemainingBuckets(buckets), [](const Rect& r, const Framebuffer& tile)
+    {
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+                vfb[y][x] = tile[y - r.y0][x - r.x0];
+
+        if (checkpoint)
+            checkpoint->BucketDone(r, vfb, nullptr);
+        return DisplayVFBRect(r, vfb, scene.settings.useSRGB);
+    });
 }
 
 void Render()
 {
+    if (coordinator)
+    {
+        CoordinatedRender();
+        return;
+    }
+
     scene.BeginFrame();
 
-    if (SimpleRender())
-        AARender();
+    if (scene.settings.deadline > 0)
+    {
+        DeadlineRender();
+    }
+    else if (scene.settings.progressive)
+    {
+        ProgressiveRender();
+    }
+    else if (scene.settings.wantAA && scene.settings.wantAdaptiveAA)
+    {
+        AdaptiveRender();
+    }
+    else
+    {
+        // (a resumed render may be past the simple pass)
+        const bool resumed = ResumeRender(CheckpointMode::SimpleAA, GetBucketList(vfb.GetWidth(), vfb.GetHeight()));
+        const bool simplePassDone = resumed && checkpoint->GetPass() >= 1;
+        if ((simplePassDone || SimpleRender()) && scene.settings.wantAA)
+            AARender();
+    }
 }
 
 int RenderSceneThreaded(void*)
@@ -174,37 +764,569 @@ void DebugRaytrace(int x, int y)
     Raytrace(ray);
 }
 
-const char* DEFAULT_SCENE = "../data/heightfield.qdmg";
+/// Renders the scene (headless) with each of the bucket sizes, and reports the throughput
+void BenchmarkBucketSizes(const std::vector<int>& bucketSizes)
+{
+    GlobalSettings& settings = scene.settings;
+    if (settings.progressive && settings.progressiveSamples == 0 && settings.progressiveTimeLimit <= 0)
+    {
+        printf("Can't benchmark an unlimited progressive render\n");
+        return;
+    }
+
+    InitHeadless();
+    vfb.Resize(settings.frameWidth, settings.frameHeight);
+    scene.BeginRender();
+
+    const int originalBucketSize = settings.bucketSize;
+    const double megapixels = settings.frameWidth * double(settings.frameHeight) / 1e6;
+    printf("Benchmarking bucket sizes, %dx%d, %d threads\n", settings.frameWidth, settings.frameHeight, GetNumRenderThreads());
+
+    // the first render also warms up the caches (and the lazily built structures), so it's not counted
+    for (int i = -1; i < (int) bucketSizes.size(); ++i)
+    {
+        settings.bucketSize = bucketSizes[std::max(i, 0)];
+        const Uint32 startTicks = SDL_GetTicks();
+        Render();
+        const double seconds = std::max(SDL_GetTicks() - startTicks, 1u) / 1000.;
+        if (i < 0)
+            continue;
+
+        printf("bucket size %4d: %4d buckets, %7.2lfs, %7.3lf Mpixels/s\n", settings.bucketSize,
+               (int) GetBucketList(settings.frameWidth, settings.frameHeight).size(), seconds, megapixels / seconds);
+    }
+
+    settings.bucketSize = originalBucketSize;
+    scene.EndRender();
+    CloseGraphics();
+}
+
+/// Renders progressively (one more jittered sample per pixel at a time) and, after each iteration, prints the time,
+/// the ray throughput (camera and secondary rays per second) and the RMSE against a reference image of the same
+/// size (e.g. a long render of the scene, saved as EXR), to see how fast the render (e.g. in GI) converges.
+/// Runs for progressiveSamples (default 64) samples per pixel, or progressiveTimeLimit seconds.
+void BenchmarkConvergence(const std::string& referenceFile)
+{
+    GlobalSettings& settings = scene.settings;
+    Bitmap reference;
+    if (!reference.LoadImage(referenceFile.c_str()))
+    {
+        printf("Could not load the reference image %s\n", referenceFile.c_str());
+        return;
+    }
+    if (reference.GetWidth() != unsigned(settings.frameWidth) || reference.GetHeight() != unsigned(settings.frameHeight))
+    {
+        printf("The reference image is %ux%u, the frame is %dx%d\n", reference.GetWidth(), reference.GetHeight(),
+               settings.frameWidth, settings.frameHeight);
+        return;
+    }
+
+    InitHeadless();
+    vfb.Resize(settings.frameWidth, settings.frameHeight);
+    scene.BeginRender();
+    scene.BeginFrame();
+
+    const int width = settings.frameWidth;
+    const int height = settings.frameHeight;
+    const unsigned maxSamples = settings.progressiveSamples ? settings.progressiveSamples : 64;
+    std::vector<Color> accumulated(static_cast<size_t>(width) * height);
+    const std::vector<Rect> buckets = GetBucketList(width, height);
+    printf("Convergence, %dx%d, %d threads, %s\n", width, height, GetNumRenderThreads(), settings.gi ? "GI" : "no GI");
+
+    const Uint32 startTicks = SDL_GetTicks();
+    const unsigned long long startRays = SecondaryRays::GetNumRays();
+    for (unsigned numSamples = 1; numSamples <= maxSamples; ++numSamples)
+    {
+        ParallelForBuckets(buckets, [&](const Rect& r)
+        {
+            TraceBucketSamples(r, numSamples - 1, 1, true, AllPixels, [&](int x, int y, const Color* samples)
+            {
+                accumulated[y*width + x] += samples[0];
+            });
+            return true;
+        });
+
+        const double seconds = std::max(SDL_GetTicks() - startTicks, 1u) / 1000.;
+        const double rays = double(SecondaryRays::GetNumRays() - startRays) + double(width) * height * numSamples;
+        double sumSqr = 0;
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                const Color difference = accumulated[y*width + x] / float(numSamples) - reference.GetPixel(x, y);
+                sumSqr += Sqr(difference.r) + Sqr(difference.g) + Sqr(difference.b);
+            }
+        printf("%4u spp: %8.2lfs, %7.3lf Mrays/s, RMSE %.5lf\n", numSamples, seconds, rays / seconds / 1e6,
+               sqrt(sumSqr / (3. * width * height)));
+
+        if (settings.progressiveTimeLimit > 0 && seconds >= settings.progressiveTimeLimit)
+            break;
+    }
+
+    scene.EndRender();
+    CloseGraphics();
+}
+
+/// Moves many instances around, and compares keeping the top-level BVH up to date by refitting it (with the
+/// automatic rebuilds), rebuilding it every frame, and testing the nodes one by one: the per-frame update time,
+/// and the ray throughput in the resulting structure. No scene file is needed.
+void BenchmarkSceneBVH(int numInstances)
+{
+    using Clock = std::chrono::steady_clock;
+    const int numFrames = 60;
+    const int raysPerFrame = 10000;
+    const double worldSize = 200;
+
+    Sphere sphere;
+    Cube cube;
+    std::vector<std::unique_ptr<Node>> storage;
+    std::vector<Node*> nodes;
+    Random rng(1234);
+    auto randomVector = [&](double range)
+    {
+        return Vector((rng.RandDouble() - .5) * range, (rng.RandDouble() - .5) * range, (rng.RandDouble() - .5) * range);
+    };
+    for (int i = 0; i < numInstances; ++i)
+    {
+        storage.emplace_back(new Node);
+        Node* node = storage.back().get();
+        node->geometry = (i % 2) ? static_cast<Geometry*>(&sphere) : &cube;
+        const double size = 1 + 2 * rng.RandDouble();
+        node->transform.Scale(size, size, size);
+        node->transform.Translate(randomVector(worldSize));
+        node->baseTransform = node->transform;
+        // each instance drifts (up to ~90 units over the animation) and tumbles
+        node->translationKeys.AddKey(0, Vector(0, 0, 0));
+        node->translationKeys.AddKey(numFrames, randomVector(3 * numFrames));
+        node->rotationKeys.AddKey(0, Vector(0, 0, 0));
+        node->rotationKeys.AddKey(numFrames, randomVector(720));
+        node->BeginRender();
+        nodes.push_back(node);
+    }
+
+    enum Strategy { REFIT, REBUILD, FLAT_LIST, NUM_STRATEGIES };
+    const char* names[NUM_STRATEGIES] = {"refit", "rebuild", "flat list"};
+    SceneBVH bvhs[NUM_STRATEGIES];
+    double updateSeconds[NUM_STRATEGIES] = {};
+    double traceSeconds[NUM_STRATEGIES] = {};
+    long long hits[NUM_STRATEGIES] = {};
+
+    printf("Benchmarking the top-level BVH: %d moving instances, %d frames, %d rays per frame\n",
+           numInstances, numFrames, raysPerFrame);
+    for (int frame = 0; frame < numFrames; ++frame)
+    {
+        scene.frame = frame;
+        for (Node* node: nodes)
+            node->BeginFrame();
+
+        // the same rays for each strategy
+        std::vector<Ray> rays(raysPerFrame);
+        for (Ray& ray: rays)
+        {
+            ray.start = randomVector(worldSize);
+            do ray.dir = randomVector(2); while (ray.dir.LengthSqr() > 1 || ray.dir.LengthSqr() < 1e-6);
+            ray.dir.Normalize();
+        }
+
+        for (int strategy = 0; strategy < NUM_STRATEGIES; ++strategy)
+        {
+            const Clock::time_point updateStart = Clock::now();
+            if (strategy == REFIT)
+                bvhs[strategy].Update(nodes);
+            else if (strategy == REBUILD)
+                bvhs[strategy].Build(nodes);
+            const Clock::time_point traceStart = Clock::now();
+
+            for (const Ray& ray: rays)
+            {
+                IntersectionInfo info;
+                if (strategy != FLAT_LIST)
+                {
+                    hits[strategy] += bvhs[strategy].Intersect(ray, info) != nullptr;
+                    continue;
+                }
+
+                bool found = false;
+                for (const Node* node: nodes)
+                    found |= node->MayIntersect(ray) && node->Intersect(ray, info);
+                hits[strategy] += found;
+            }
+
+            const Clock::time_point traceEnd = Clock::now();
+            updateSeconds[strategy] += std::chrono::duration<double>(traceStart - updateStart).count();
+            traceSeconds[strategy] += std::chrono::duration<double>(traceEnd - traceStart).count();
+        }
+    }
+
+    for (int strategy = 0; strategy < NUM_STRATEGIES; ++strategy)
+    {
+        printf("%-9s: update %8.3lf ms/frame, %7.3lf Mrays/s, %lld hits", names[strategy],
+               1000 * updateSeconds[strategy] / numFrames, numFrames * raysPerFrame / traceSeconds[strategy] / 1e6, hits[strategy]);
+        if (strategy != FLAT_LIST)
+            printf(", %d builds, %d refits, final SAH cost %.2lf", bvhs[strategy].GetNumBuilds(),
+                   bvhs[strategy].GetNumRefits(), bvhs[strategy].GetCost());
+        printf("\n");
+    }
+    scene.frame = 0;
+}
+
+struct CommandLine
+{
+    const char* sceneFile = "../data/heightfield.qdmg";
+    bool benchmarkBuckets = false;
+    std::vector<int> bucketSizes = {16, 32, 48, 64, 96, 128};
+    int benchmarkBVHInstances = 0; //!< if nonzero, run the BVH benchmark with that many instances
+    std::string convergenceReference; //!< if not empty, run the convergence benchmark against this image
+
+    // partial renders:
+    bool useRegion = false;
+    Rect region{0, 0, 0, 0};
+    int tileIndex = 0;
+    int tileCount = 1;
+
+    std::vector<std::string> mergeFiles; //!< --merge: the output, then the parts
+
+    int numWorkers = 0; //!< render on this many worker processes; -1: one per render thread
+    int workerFd = -1;  //!< we are a worker process, talking to the coordinator over this socket (or pipe HANDLE)
+
+    bool wantCheckpoint = false;
+    std::string checkpointFile; //!< empty: the scene file + ".checkpoint"
+    double checkpointInterval = 60;
+    bool resume = false;
+
+    double deadline = -1; //!< overrides the scene's deadline setting, if not negative
+
+    bool overrideEngine = false;
+    RenderEngine engine = RenderEngine::Recursive;
+};
+
+static void PrintUsage(const char* program)
+{
+    printf("Usage: %s [options] [scene file]\n", program);
+    printf("Options:\n");
+    printf("  --benchmark-buckets[=s1,s2,...]  render with each bucket size (default 16,32,48,64,96,128) and report the throughput\n");
+    printf("  --benchmark-bvh[=instances]      compare refitting and rebuilding the top-level BVH, with (default 500) moving instances\n");
+    printf("  --benchmark-convergence=image    render progressively, printing the rays per second and the RMSE against the\n");
+    printf("                                   (reference) image after each sample per pixel\n");
+    printf("  --region x0,y0,x1,y1             render only the pixels x0 <= x < x1, y0 <= y < y1\n");
+    printf("  --tile-index i/N                 render only the i-th (0 <= i < N) of N shares of the buckets\n");
+    printf("                                   (with an EXR outputFile, these save a partial EXR, with just the rendered part)\n");
+    printf("  --merge output.exr part1.exr ... assemble the partial EXRs into the whole frame\n");
+    printf("  --workers[=N]                    render on N (default: numThreads, or one per CPU core) worker processes,\n");
+    printf("                                   which load the scene on their own and get the buckets on demand\n");
+    printf("  --checkpoint[=file]              save the progress of the render (by default, to <scene file>.checkpoint)\n");
+    printf("  --checkpoint-interval=seconds    save it at most this often (default 60)\n");
+    printf("  --resume                         go on from the checkpoint (implies --checkpoint)\n");
+    printf("  --deadline=seconds               render the best image possible in this time (0: no deadline)\n");
+    printf("  --engine=recursive|wavefront     trace the rays depth-first, or in stages over queues of rays\n");
+}
+
+static bool ParseCommandLine(int argc, char* argv[], CommandLine& outCommandLine)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            outCommandLine.sceneFile = arg;
+        }
+        else if (!strcmp(arg, "--benchmark-buckets"))
+        {
+            outCommandLine.benchmarkBuckets = true;
+        }
+        else if (!strncmp(arg, "--benchmark-buckets=", 20))
+        {
+            outCommandLine.benchmarkBuckets = true;
+            outCommandLine.bucketSizes.clear();
+            for (const std::string& size : Split(arg + 20, ','))
+            {
+                const int bucketSize = atoi(size.c_str());
+                if (bucketSize <= 0)
+                    return false;
+                outCommandLine.bucketSizes.push_back(bucketSize);
+            }
+            if (outCommandLine.bucketSizes.empty())
+                return false;
+        }
+        else if (!strncmp(arg, "--benchmark-convergence=", 24) && arg[24])
+        {
+            outCommandLine.convergenceReference = arg + 24;
+        }
+        else if (!strcmp(arg, "--benchmark-bvh"))
+        {
+            outCommandLine.benchmarkBVHInstances = 500;
+        }
+        else if (!strncmp(arg, "--benchmark-bvh=", 16))
+        {
+            outCommandLine.benchmarkBVHInstances = atoi(arg + 16);
+            if (outCommandLine.benchmarkBVHInstances <= 0)
+                return false;
+        }
+        else if (!strcmp(arg, "--region") && i + 1 < argc)
+        {
+            Rect& r = outCommandLine.region;
+            if (4 != sscanf(argv[++i], "%d,%d,%d,%d", &r.x0, &r.y0, &r.x1, &r.y1))
+                return false;
+            r = Rect(r.x0, r.y0, r.x1, r.y1);
+            if (r.x0 < 0 || r.y0 < 0 || r.w <= 0 || r.h <= 0)
+                return false;
+            outCommandLine.useRegion = true;
+        }
+        else if (!strcmp(arg, "--tile-index") && i + 1 < argc)
+        {
+            int& index = outCommandLine.tileIndex;
+            int& count = outCommandLine.tileCount;
+            if (2 != sscanf(argv[++i], "%d/%d", &index, &count) || count < 1 || index < 0 || index >= count)
+                return false;
+        }
+        else if (!strcmp(arg, "--workers"))
+        {
+            outCommandLine.numWorkers = -1;
+        }
+        else if (!strncmp(arg, "--workers=", 10))
+        {
+            outCommandLine.numWorkers = atoi(arg + 10);
+            if (outCommandLine.numWorkers <= 0)
+                return false;
+        }
+        else if (!strcmp(arg, "--worker-fd") && i + 1 < argc)
+        {
+            // (used by the coordinator, when it starts the workers)
+            outCommandLine.workerFd = atoi(argv[++i]);
+        }
+        else if (!strcmp(arg, "--checkpoint"))
+        {
+            outCommandLine.wantCheckpoint = true;
+        }
+        else if (!strncmp(arg, "--checkpoint=", 13))
+        {
+            outCommandLine.wantCheckpoint = true;
+            outCommandLine.checkpointFile = arg + 13;
+        }
+        else if (!strncmp(arg, "--checkpoint-interval=", 22))
+        {
+            outCommandLine.checkpointInterval = atof(arg + 22);
+            if (outCommandLine.checkpointInterval < 0)
+                return false;
+        }
+        else if (!strcmp(arg, "--resume"))
+        {
+            outCommandLine.wantCheckpoint = true;
+            outCommandLine.resume = true;
+        }
+        else if (!strncmp(arg, "--deadline=", 11))
+        {
+            outCommandLine.deadline = atof(arg + 11);
+            if (outCommandLine.deadline < 0)
+                return false;
+        }
+        else if (!strncmp(arg, "--engine=", 9))
+        {
+            if (!ParseRenderEngine(arg + 9, outCommandLine.engine))
+                return false;
+            outCommandLine.overrideEngine = true;
+        }
+        else if (!strcmp(arg, "--merge") && i + 2 < argc)
+        {
+            // takes the rest of the arguments
+            outCommandLine.mergeFiles.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 // don't remove main arguments, it's required by SDL
 int main (int argc, char* argv[])
 {
 //    test_random();
     InitRandom(42);
-    const char* sceneFile = (argc == 2 ? argv[1] : DEFAULT_SCENE);
-    if (!scene.ParseScene(sceneFile))
+    CommandLine commandLine;
+    if (!ParseCommandLine(argc, argv, commandLine))
+    {
+        PrintUsage(argv[0]);
+        return -1;
+    }
+
+    if (commandLine.benchmarkBVHInstances)
+    {
+        BenchmarkSceneBVH(commandLine.benchmarkBVHInstances);
+        return 0;
+    }
+
+    if (!commandLine.mergeFiles.empty())
+    {
+        const std::vector<std::string> parts(commandLine.mergeFiles.begin() + 1, commandLine.mergeFiles.end());
+        return MergeEXRFiles(commandLine.mergeFiles[0].c_str(), parts) ? 0 : -1;
+    }
+
+    if (!scene.ParseScene(commandLine.sceneFile))
     {
         printf("Could not parse the scene!\n");
         return -1;
     }
 
-    InitGraphics(scene.settings.frameWidth, scene.settings.frameHeight);
-    scene.BeginRender();
+    if (commandLine.deadline >= 0)
+        scene.settings.deadline = commandLine.deadline;
+    if (commandLine.overrideEngine)
+        scene.settings.engine = commandLine.engine;
+
+    // a partial render:
+    scene.settings.useRegion = commandLine.useRegion;
+    scene.settings.region = commandLine.region;
+    scene.settings.region.Clip(scene.settings.frameWidth, scene.settings.frameHeight);
+    scene.settings.tileIndex = commandLine.tileIndex;
+    scene.settings.tileCount = commandLine.tileCount;
+    if (scene.settings.IsPartialRender() && GetBucketList(scene.settings.frameWidth, scene.settings.frameHeight).empty())
+    {
+        printf("Nothing to render: no buckets in the given region/tile\n");
+        return 0;
+    }
+
+    if (commandLine.benchmarkBuckets)
+    {
+        BenchmarkBucketSizes(commandLine.bucketSizes);
+        return 0;
+    }
+
+    if (!commandLine.convergenceReference.empty())
+    {
+        BenchmarkConvergence(commandLine.convergenceReference);
+        return 0;
+    }
 
-//    const int rotations = 10;
-//    for (int i = 0; i < rotations; ++i)
-//    {
-//        g_Camera.SetYaw(1. * i * 2*PI/rotations);
-//        g_Camera.FrameBegin();
+    if (commandLine.workerFd >= 0)
+    {
+        // a worker of a --workers render: no window; the coordinator says what to render
+        InitHeadless();
+        scene.BeginRender();
+        const int result = RunRenderWorker(commandLine.workerFd, [](int frame)
+        {
+            scene.frame = frame;
+            scene.BeginFrame();
+        }, RenderBucket);
+        scene.EndRender();
+        CloseGraphics();
+        return result;
+    }
+
+    // the coordinator only hands out the buckets and collects the results, so it skips the scene's preprocessing
+    std::unique_ptr<RenderCoordinator> renderCoordinator;
+    if (commandLine.numWorkers)
+    {
+        const int numWorkers = commandLine.numWorkers > 0 ? commandLine.numWorkers : GetNumRenderThreads();
+        renderCoordinator.reset(new RenderCoordinator(argv[0], commandLine.sceneFile, numWorkers));
+        if (!renderCoordinator->Start())
+            return -1;
+        coordinator = renderCoordinator.get();
+    }
+
+    const GlobalSettings& settings = scene.settings;
+    const bool animation = settings.numFrames > 1;
+
+    std::unique_ptr<Checkpoint> renderCheckpoint;
+    if (commandLine.wantCheckpoint && settings.streamOutput)
+    {
+        printf("Checkpoints don't work with streamOutput (the tiled EXR can't be resumed); rendering without\n");
+    }
+    else if (commandLine.wantCheckpoint)
+    {
+        renderCheckpoint.reset(new Checkpoint);
+        const std::string filename = commandLine.checkpointFile.empty()
+                                     ? std::string(commandLine.sceneFile) + ".checkpoint"
+                                     : commandLine.checkpointFile;
+        renderCheckpoint->Init(filename, commandLine.checkpointInterval, commandLine.sceneFile);
+        if (commandLine.resume)
+            renderCheckpoint->Load();
+        checkpoint = renderCheckpoint.get();
+    }
+    if (settings.streamOutput)
+    {
+        // no window and no full-frame buffer: it's meant for frames which wouldn't fit in either
+        InitHeadless();
+        if (!coordinator)
+            scene.BeginRender();
+
+        bool result = true;
+        const Uint32 startTicks = SDL_GetTicks();
+        for (int frame = 0; frame < settings.numFrames && result; ++frame)
+        {
+            scene.frame = frame;
+            const std::string filename = animation ? NumberedFilename(settings.outputFile, frame) : settings.outputFile;
+            result = StreamingRender(filename.c_str());
+            if (result)
+                printf("Saved the image as '%s'\n", filename.c_str());
+        }
+        printf("Render took %.2lfs\n", (SDL_GetTicks() - startTicks) / 1000.);
+        ShadingHelper::PrintStatistics();
+        SecondaryRays::PrintStatistics();
+        irradianceCache.PrintStatistics();
+
+        if (!coordinator)
+            scene.EndRender();
+        CloseGraphics();
+        return result ? 0 : -1;
+    }
+
+    vfb.Resize(settings.frameWidth, settings.frameHeight);
+    InitGraphics(settings.frameWidth, settings.frameHeight);
+
+    // the per-scene preprocessing (KD-trees, height maps, ...) is done once; each frame only re-evaluates
+    // the animated elements and refits the node boxes (in BeginFrame())
+    if (!coordinator)
+        scene.BeginRender();
+
+    for (int frame = checkpoint ? checkpoint->GetFrame() : 0; frame < settings.numFrames && !wantToQuit; ++frame)
+    {
+        scene.frame = frame;
 
         const Uint32 startTicks = SDL_GetTicks();
         RenderScene_Threaded();
         const Uint32 elapsedMs = SDL_GetTicks() - startTicks;
-        printf("Render took %.2lfs\n", elapsedMs / 1000.);
+        if (checkpoint)
+        {
+            if (wantToQuit)
+                checkpoint->Save(); // interrupted: keep what's done so far
+            else
+                checkpoint->FinishFrame(frame + 1 == settings.numFrames);
+        }
+        if (wantToQuit && animation)
+            break;
+
+        if (animation)
+            printf("Frame %d of %d took %.2lfs\n", frame + 1, settings.numFrames, elapsedMs / 1000.);
+        else
+            printf("Render took %.2lfs\n", elapsedMs / 1000.);
         SetWindowCaption("Quad Damage: rendered in %.2fs\n", elapsedMs / 1000.f);
 
-//    }
+        if (!settings.outputFile.empty())
+        {
+            const std::string filename = animation ? NumberedFilename(settings.outputFile, frame) : settings.outputFile;
+            if (settings.IsPartialRender() && ExtensionUpper(filename.c_str()) == "EXR")
+                SavePartialEXR(filename.c_str());
+            else
+                TakeScreenshot(vfb, filename.c_str());
+        }
+    }
+    ShadingHelper::PrintStatistics();
+    SecondaryRays::PrintStatistics();
+    irradianceCache.PrintStatistics();
+    if (checkpoint)
+        checkpoint->PrintStatistics();
 
-    scene.EndRender();
+    if (coordinator)
+    {
+        // the workers aren't needed while the window is open
+        coordinator = nullptr;
+        renderCoordinator.reset();
+    }
+    else
+    {
+        scene.EndRender();
+    }
 
     WaitForUserExit();
     CloseGraphics();
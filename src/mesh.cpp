@@ -1,5 +1,6 @@
 #include "mesh.h"
 
+#include <atomic>
 #include <cassert>
 #include <numeric>
 #include <SDL.h>
@@ -16,10 +17,25 @@ Mesh::~Mesh()
         delete m_KDRoot;
 }
 
-// some debug information
-unsigned nbTriIntersections = 0;
-unsigned nbBBoxIntersections = 0;
-unsigned nbIntersections = 0;
+// some debug information; counted per thread (to avoid races and cache-line sharing), and summed on thread exit
+static std::atomic<unsigned long long> totalTriIntersections{0};
+static std::atomic<unsigned long long> totalBBoxIntersections{0};
+static std::atomic<unsigned long long> totalIntersections{0};
+
+struct IntersectionCounters
+{
+    unsigned long long triangles = 0;
+    unsigned long long bboxes = 0;
+    unsigned long long intersections = 0;
+
+    ~IntersectionCounters()
+    {
+        totalTriIntersections += triangles;
+        totalBBoxIntersections += bboxes;
+        totalIntersections += intersections;
+    }
+};
+static thread_local IntersectionCounters counters;
 
 unsigned maxDepth = 0;
 unsigned depths = 0;
@@ -35,7 +51,7 @@ bool Mesh::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
     bool found = false;
     if (m_KDRoot)
     {
-        ++nbIntersections;
+        ++counters.intersections;
 
         outInfo.distance = INF;
         found = Intersect(m_KDRoot, m_BBox, ray, outInfo);
@@ -55,6 +71,15 @@ bool Mesh::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
     return found;
 }
 
+bool Mesh::IntersectPrimitive(const Ray& ray, int primitive, IntersectionInfo& outInfo) const
+{
+    if (primitive < 0 || primitive >= static_cast<int>(m_Triangles.size()))
+        return Intersect(ray, outInfo);
+
+    outInfo.distance = INF;
+    return Intersect(ray, m_Triangles[primitive], outInfo);
+}
+
 bool Mesh::Intersect(KDTreeNode* node, BBox bbox, const Ray& ray, IntersectionInfo& outInfo) const
 {
     bool result = false;
@@ -78,7 +103,7 @@ bool Mesh::Intersect(KDTreeNode* node, BBox bbox, const Ray& ray, IntersectionIn
 
         for (unsigned i = 0; i < COUNT_OF(childBBoxes); ++i)
         {
-            ++nbBBoxIntersections;
+            ++counters.bboxes;
             const BBox& childBBox = childBBoxes[childOrder[i]];
             if (childBBox.TestIntersect(ray) && Intersect(&node->children[childOrder[i]], childBBox, ray, outInfo))
             {
@@ -91,6 +116,96 @@ bool Mesh::Intersect(KDTreeNode* node, BBox bbox, const Ray& ray, IntersectionIn
     return result;
 }
 
+uint64_t Mesh::IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const
+{
+    if (!m_KDRoot)
+        return Geometry::IntersectPacket(packet, mask, outInfos);
+
+    if (!m_BBox.TestIntersect(packet))
+        return 0;
+
+    uint64_t active = 0;
+    ForEachRay(mask, [&](int i)
+    {
+        if (!m_BBox.TestIntersect(packet[i]))
+            return;
+
+        ++counters.intersections;
+        outInfos[i].distance = INF;
+        active |= RayBit(i);
+    });
+    return active ? IntersectPacket(m_KDRoot, m_BBox, packet, active, outInfos) : 0;
+}
+
+/// Intersect(node, bbox, ray, outInfo) for the rays of the packet in mask, together; returns the mask of those which
+/// found their hit. The rays go down the tree together, while they agree on which child is the near one; where they
+/// don't (or only one is left), each goes on on its own.
+uint64_t Mesh::IntersectPacket(KDTreeNode* node, const BBox& bbox, const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const
+{
+    uint64_t result = 0;
+    if (node->IsLeaf())
+    {
+        ForEachRay(mask, [&](int i)
+        {
+            bool found = false;
+            for (const unsigned triangleIdx : *node->triangles)
+                if (Intersect(packet[i], m_Triangles[triangleIdx], outInfos[i]))
+                    found = true;
+
+            if (found && bbox.IsInside(outInfos[i].ip))
+                result |= RayBit(i);
+        });
+        return result;
+    }
+
+    const unsigned axis = static_cast<unsigned>(node->axis);
+    uint64_t startAfter = 0;
+    ForEachRay(mask, [&](int i)
+    {
+        if (packet[i].start[axis] > node->splitPosition)
+            startAfter |= RayBit(i);
+    });
+
+    if (IsSingleRay(mask) || (startAfter != 0 && startAfter != mask))
+    {
+        ForEachRay(mask, [&](int i)
+        {
+            if (Intersect(node, bbox, packet[i], outInfos[i]))
+                result |= RayBit(i);
+        });
+        return result;
+    }
+
+    BBox childBBoxes[2];
+    bbox.Split(node->axis, node->splitPosition, childBBoxes[0], childBBoxes[1]);
+
+    int childOrder[2] = {0, 1};
+    if (startAfter)
+        std::swap(childOrder[0], childOrder[1]);
+
+    for (unsigned i = 0; i < COUNT_OF(childBBoxes); ++i)
+    {
+        // the rays which found their hit in the near child don't go on to the far one
+        const uint64_t remaining = mask & ~result;
+        const BBox& childBBox = childBBoxes[childOrder[i]];
+        if (!remaining || !childBBox.TestIntersect(packet))
+            continue;
+
+        uint64_t childMask = 0;
+        ForEachRay(remaining, [&](int j)
+        {
+            ++counters.bboxes;
+            if (childBBox.TestIntersect(packet[j]))
+                childMask |= RayBit(j);
+        });
+
+        if (childMask)
+            result |= IntersectPacket(&node->children[childOrder[i]], childBBox, packet, childMask, outInfos);
+    }
+
+    return result;
+}
+
 bool Mesh::IsInside(const Vector& point) const
 {
     return false;
@@ -113,7 +228,7 @@ bool Mesh::Intersect(const Ray& ray, const MeshTriangle& triangle, IntersectionI
     if (m_BackCulling && ray.dir * triangle.geometryNormal > 0)
         return false;
 
-    ++nbTriIntersections;
+    ++counters.triangles;
 
     const Vector& A = m_Vertices[triangle.vertices[0]];
     const Vector& B = m_Vertices[triangle.vertices[1]];
@@ -163,6 +278,7 @@ bool Mesh::Intersect(const Ray& ray, const MeshTriangle& triangle, IntersectionI
     outInfo.dNdy = triangle.dNdy;
 
     outInfo.geometry = this;
+    outInfo.primitive = static_cast<int>(&triangle - &m_Triangles[0]);
 
     return true;
 }
@@ -191,8 +307,8 @@ void Mesh::BeginRender()
 
 void Mesh::EndRender()
 {
-    printf("Avg bbox intersections: %lf\n", (double)nbBBoxIntersections / nbIntersections);
-    printf("Avg triangles intersections: %lf\n", (double)nbTriIntersections / nbIntersections);
+    printf("Avg bbox intersections: %lf\n", (double)totalBBoxIntersections / totalIntersections);
+    printf("Avg triangles intersections: %lf\n", (double)totalTriIntersections / totalIntersections);
 }
 
 void Mesh::ComputeKDRoot()
@@ -28,7 +28,10 @@ public:
     void SetBackCulling(bool backCulling) { m_BackCulling = backCulling; }
 
     virtual bool Intersect(const Ray& ray, IntersectionInfo& outInfo) const override;
+    virtual bool IntersectPrimitive(const Ray& ray, int primitive, IntersectionInfo& outInfo) const override;
+    virtual uint64_t IntersectPacket(const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const override;
     virtual bool IsInside(const Vector& point) const override;
+    virtual bool GetBoundingBox(BBox& outBBox) const override { outBBox = m_BBox; return true; }
 
     virtual void FillProperties(ParsedBlock& pb) override;
     virtual void BeginRender() override;
@@ -50,6 +53,7 @@ private:
 
     bool Intersect(const Ray& ray, const MeshTriangle& triangle, IntersectionInfo& outInfo) const;
     bool Intersect(KDTreeNode* node, BBox bbox, const Ray& ray, IntersectionInfo& outInfo) const;
+    uint64_t IntersectPacket(KDTreeNode* node, const BBox& bbox, const RayPacket& packet, uint64_t mask, IntersectionInfo* outInfos) const;
 
     bool LoadFromOBJ(const char* filename);
     void GenerateTrianglesData();
@@ -0,0 +1,85 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <SDL.h>
+
+#include "scene.h"
+
+namespace
+{
+
+struct TaskQueue
+{
+    size_t count;
+    const std::function<bool(size_t)>* work;
+    std::atomic<size_t> next{0};
+    std::atomic<bool> interrupted{false};
+};
+
+int TaskWorker(void* data)
+{
+    TaskQueue& queue = *static_cast<TaskQueue*>(data);
+    while (!queue.interrupted)
+    {
+        const size_t index = queue.next++;
+        if (index >= queue.count)
+            break;
+
+        if (!(*queue.work)(index))
+            queue.interrupted = true;
+    }
+    return 0;
+}
+
+/// runs work(0..count-1) on the render threads, until a call returns false; returns whether none did
+bool ParallelForTasks(size_t count, const std::function<bool(size_t)>& work)
+{
+    TaskQueue queue;
+    queue.count = count;
+    queue.work = &work;
+
+    const int numThreads = static_cast<int>(std::min(static_cast<size_t>(GetNumRenderThreads()), count));
+    std::vector<SDL_Thread*> threads;
+    for (int i = 1; i < numThreads; ++i)
+    {
+        SDL_Thread* thread = SDL_CreateThread(TaskWorker, &queue);
+        if (thread == nullptr)
+            break; // go on with fewer threads
+        threads.push_back(thread);
+    }
+
+    // the calling thread is a worker too
+    TaskWorker(&queue);
+
+    for (SDL_Thread* thread : threads)
+        SDL_WaitThread(thread, nullptr);
+
+    return !queue.interrupted;
+}
+
+} // namespace
+
+int GetNumRenderThreads()
+{
+    if (scene.settings.numThreads > 0)
+        return scene.settings.numThreads;
+
+    // SDL 1.2 has no way to query the CPU count
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+bool ParallelForBuckets(const std::vector<Rect>& buckets, const std::function<bool(const Rect&)>& work)
+{
+    return ParallelForTasks(buckets.size(), [&](size_t index) { return work(buckets[index]); });
+}
+
+void ParallelFor(unsigned count, const std::function<void(unsigned)>& work)
+{
+    ParallelForTasks(count, [&](size_t index)
+    {
+        work(static_cast<unsigned>(index));
+        return true;
+    });
+}
@@ -0,0 +1,21 @@
+#ifndef RAYTRACING_PARALLEL_H
+#define RAYTRACING_PARALLEL_H
+
+#include <functional>
+#include <vector>
+
+#include "sdl.h"
+
+/// the number of threads to render on (the numThreads setting; 0 means one per CPU core)
+int GetNumRenderThreads();
+
+/// Calls work(bucket) for each of the buckets, on GetNumRenderThreads() threads. The buckets are handed
+/// out dynamically, in list order, so the threads stay busy and the order of GetBucketList() is mostly kept.
+/// If a call to work() returns false (e.g. the user closed the window), no new buckets are started, and
+/// the function returns false, after all running ones are done.
+bool ParallelForBuckets(const std::vector<Rect>& buckets, const std::function<bool(const Rect&)>& work);
+
+/// Calls work(i) for i = 0..count-1, on GetNumRenderThreads() threads (handed out like the buckets above)
+void ParallelFor(unsigned count, const std::function<void(unsigned)>& work);
+
+#endif //RAYTRACING_PARALLEL_H
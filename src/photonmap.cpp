@@ -0,0 +1,308 @@
+#include "photonmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <SDL.h>
+
+#include "constants.h"
+#include "geometry.h"
+#include "light.h"
+#include "parallel.h"
+#include "random_generator.h"
+#include "scene.h"
+#include "shading.h"
+#include "texture.h"
+#include "utils.h"
+
+PhotonMap photonMap;
+
+namespace
+{
+
+const unsigned BATCH_SIZE = 4096;       //!< photons emitted per batch
+const unsigned MAX_EMITTED_RATIO = 256; //!< no more than this many photons are emitted per stored one wanted
+const unsigned PHOTON_DIMENSION = 0x50484f54; //!< the random stream of the photons (different from the pixels')
+
+void EncodeRGBE(const Color& color, unsigned char* outRGBE)
+{
+    const float maxComponent = std::max(color.r, std::max(color.g, color.b));
+    if (maxComponent < 1e-32f)
+    {
+        outRGBE[0] = outRGBE[1] = outRGBE[2] = outRGBE[3] = 0;
+        return;
+    }
+
+    int exponent;
+    const float scale = frexpf(maxComponent, &exponent) * 256.f / maxComponent;
+    for (int c = 0; c < 3; ++c)
+        outRGBE[c] = (unsigned char) std::min(255.f, std::max(0.f, color[c] * scale));
+    outRGBE[3] = (unsigned char) (exponent + 128);
+}
+
+Color DecodeRGBE(const unsigned char* rgbe)
+{
+    if (rgbe[3] == 0)
+        return Color(0, 0, 0);
+
+    const float scale = ldexpf(1.f, int(rgbe[3]) - (128 + 8));
+    return Color((rgbe[0] + 0.5f) * scale, (rgbe[1] + 0.5f) * scale, (rgbe[2] + 0.5f) * scale);
+}
+
+/// the size of the left subtree of a left-balanced tree of count nodes (all levels full, but the last, which is
+/// filled from the left)
+size_t GetLeftSubtreeSize(size_t count)
+{
+    if (count <= 1)
+        return 0;
+
+    int levels = 0; // below the root
+    while ((size_t(2) << levels) <= count)
+        ++levels;
+    const size_t full = (size_t(1) << levels) - 1; // the nodes above the last level
+    const size_t last = count - full;
+    return (full - 1) / 2 + std::min(last, size_t(1) << (levels - 1));
+}
+
+} // namespace
+
+void PhotonMap::NearestPhotons::Add(double distSqr, unsigned index)
+{
+    if (heap.size() < k)
+    {
+        heap.emplace_back(distSqr, index);
+        std::push_heap(heap.begin(), heap.end());
+        if (heap.size() == k)
+            maxDistSqr = heap.front().first;
+        return;
+    }
+
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = {distSqr, index};
+    std::push_heap(heap.begin(), heap.end());
+    maxDistSqr = heap.front().first;
+}
+
+void PhotonMap::BeginFrame()
+{
+    m_Photons.clear();
+    const GlobalSettings& settings = scene.settings;
+    if (!settings.caustics || settings.causticPhotons == 0)
+        return;
+
+    std::vector<double> lightPowers;
+    double totalPower = 0;
+    for (const Light* light : scene.lights)
+    {
+        totalPower += std::max(0., light->GetPower());
+        lightPowers.push_back(totalPower);
+    }
+    if (totalPower <= 0)
+        return;
+
+    // shoot rounds of batches, until enough photons are stored: the first round as many as wanted, and the next ones
+    // as many as it seems to take
+    const Uint32 startTicks = SDL_GetTicks();
+    const unsigned wanted = settings.causticPhotons;
+    const unsigned long long maxEmitted = (unsigned long long) wanted * MAX_EMITTED_RATIO;
+    std::vector<std::vector<TracedPhoton>> batches;
+    size_t numStored = 0;
+    unsigned long long numEmitted = 0;
+    unsigned roundBatches = (wanted + BATCH_SIZE - 1) / BATCH_SIZE;
+    for (;;)
+    {
+        const unsigned first = unsigned(batches.size());
+        batches.resize(first + roundBatches);
+        ParallelFor(roundBatches, [&](unsigned i)
+        {
+            TraceBatch(first + i, lightPowers, batches[first + i]);
+        });
+
+        for (unsigned i = first; i < batches.size(); ++i)
+            numStored += batches[i].size();
+        numEmitted += (unsigned long long) roundBatches * BATCH_SIZE;
+        if (numStored >= wanted || numEmitted >= maxEmitted)
+            break;
+
+        const double rest = numStored ? double(wanted - numStored) * numEmitted / numStored : 3. * numEmitted;
+        roundBatches = unsigned(std::min(rest, double(maxEmitted - numEmitted)) / BATCH_SIZE) + 1;
+    }
+    const Uint32 traceTicks = SDL_GetTicks();
+
+    if (numStored == 0)
+    {
+        printf("Photon map: no caustic photons (of %llu emitted)\n", numEmitted);
+        return;
+    }
+
+    // each photon carries its share of all the lights' power
+    std::vector<Photon> packed;
+    packed.reserve(numStored);
+    const float photonPower = float(totalPower / numEmitted);
+    for (const std::vector<TracedPhoton>& batch : batches)
+        for (const TracedPhoton& traced : batch)
+        {
+            Photon photon;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                photon.pos[axis] = float(traced.pos[axis]);
+                photon.dir[axis] = (signed char) NearestInt(traced.dir[axis] * 127);
+            }
+            EncodeRGBE(traced.power * photonPower, photon.power);
+            photon.axis = 0;
+            packed.push_back(photon);
+        }
+    batches.clear();
+
+    m_Photons.resize(packed.size() + 1);
+    Balance(packed, 0, packed.size(), 1);
+
+    BBox bounds = scene.bvh.GetBounds();
+    if (bounds.GetMin().x > bounds.GetMax().x) // no bounded nodes
+        for (const Photon& photon : packed)
+            bounds.Add(Vector(photon.pos[0], photon.pos[1], photon.pos[2]));
+    const Vector extent = bounds.GetMax() - bounds.GetMin();
+    m_MaxRadius = settings.causticRadius > 0 ? settings.causticRadius
+                                             : std::max(1e-6, std::max(extent.x, std::max(extent.y, extent.z)) * 0.01);
+
+    const Uint32 endTicks = SDL_GetTicks();
+    printf("Photon map: %u caustic photons (of %llu emitted), %.2lf MB; traced in %.2lfs, built in %.2lfs\n",
+           unsigned(packed.size()), numEmitted, m_Photons.size() * sizeof(Photon) / (1024. * 1024.),
+           (traceTicks - startTicks) / 1000., (endTicks - traceTicks) / 1000.);
+}
+
+void PhotonMap::EndRender()
+{
+    m_Photons.clear();
+    m_Photons.shrink_to_fit();
+}
+
+void PhotonMap::TraceBatch(unsigned index, const std::vector<double>& lightPowers,
+                           std::vector<TracedPhoton>& outPhotons) const
+{
+    Random rng;
+    rng.Seed(int(index), -1, unsigned(scene.frame), PHOTON_DIMENSION);
+    const double totalPower = lightPowers.back();
+
+    for (unsigned i = 0; i < BATCH_SIZE; ++i)
+    {
+        const double pick = rng.RandDouble() * totalPower;
+        const size_t lightIndex = std::min(size_t(std::upper_bound(lightPowers.begin(), lightPowers.end(), pick) -
+                                                  lightPowers.begin()), lightPowers.size() - 1);
+        const double u1 = rng.RandDouble(), u2 = rng.RandDouble(), u3 = rng.RandDouble(), u4 = rng.RandDouble();
+
+        Ray ray;
+        scene.lights[lightIndex]->EmitPhoton(u1, u2, u3, u4, ray.start, ray.dir);
+        ray.start += ray.dir * 1e-6;
+
+        // only the photons which went through a mirror or glass make caustics; the rest of the light is sampled
+        Color power(1, 1, 1);
+        bool specular = false;
+        while (ray.depth <= scene.settings.maxTraceDepth)
+        {
+            IntersectionInfo info;
+            const Node* node = scene.bvh.Intersect(ray, info);
+            if (!node)
+                break;
+
+            info.rayDir = ray.dir;
+            if (node->bump)
+                node->bump->ModifyNormal(info);
+
+            if (specular && node->shader->SamplesLights())
+                outPhotons.push_back({info.ip, ray.dir, power});
+
+            Ray scattered;
+            Color filter;
+            if (!node->shader->ScatterPhoton(ray, info, rng, scattered, filter))
+                break;
+
+            power *= filter;
+            if (std::max(power.r, std::max(power.g, power.b)) <= 0)
+                break;
+
+            ray = scattered;
+            specular = true;
+        }
+    }
+}
+
+void PhotonMap::Balance(std::vector<Photon>& photons, size_t begin, size_t end, size_t heapIndex)
+{
+    if (begin == end)
+        return;
+
+    // split along the longest side of the photons' box, at the photon which leaves the tree left-balanced
+    float min[3] = {+LARGE_FLOAT, +LARGE_FLOAT, +LARGE_FLOAT};
+    float max[3] = {-LARGE_FLOAT, -LARGE_FLOAT, -LARGE_FLOAT};
+    for (size_t i = begin; i < end; ++i)
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            min[axis] = std::min(min[axis], photons[i].pos[axis]);
+            max[axis] = std::max(max[axis], photons[i].pos[axis]);
+        }
+    int axis = 0;
+    for (int i = 1; i < 3; ++i)
+        if (max[i] - min[i] > max[axis] - min[axis])
+            axis = i;
+
+    const size_t median = begin + GetLeftSubtreeSize(end - begin);
+    std::nth_element(photons.begin() + begin, photons.begin() + median, photons.begin() + end,
+                     [axis](const Photon& a, const Photon& b) { return a.pos[axis] < b.pos[axis]; });
+
+    m_Photons[heapIndex] = photons[median];
+    m_Photons[heapIndex].axis = (unsigned char) axis;
+    Balance(photons, begin, median, 2*heapIndex);
+    Balance(photons, median + 1, end, 2*heapIndex + 1);
+}
+
+void PhotonMap::Locate(size_t index, const Vector& pos, NearestPhotons& nearest) const
+{
+    const Photon& photon = m_Photons[index];
+    const size_t left = 2*index;
+    if (left < m_Photons.size())
+    {
+        // the near side first, so the search radius shrinks before the far one is looked at
+        const double delta = pos[photon.axis] - photon.pos[photon.axis];
+        const size_t nearChild = delta < 0 ? left : left + 1;
+        const size_t farChild = delta < 0 ? left + 1 : left;
+        if (nearChild < m_Photons.size())
+            Locate(nearChild, pos, nearest);
+        if (Sqr(delta) < nearest.maxDistSqr && farChild < m_Photons.size())
+            Locate(farChild, pos, nearest);
+    }
+
+    const double distSqr = Sqr(pos.x - photon.pos[0]) + Sqr(pos.y - photon.pos[1]) + Sqr(pos.z - photon.pos[2]);
+    if (distSqr < nearest.maxDistSqr)
+        nearest.Add(distSqr, unsigned(index));
+}
+
+Color PhotonMap::GetIrradiance(const Vector& pos, const Vector& normal) const
+{
+    if (IsEmpty())
+        return Color(0, 0, 0);
+
+    static thread_local NearestPhotons nearest;
+    nearest.k = scene.settings.causticLookupPhotons;
+    nearest.maxDistSqr = Sqr(m_MaxRadius);
+    nearest.heap.clear();
+    Locate(1, pos, nearest);
+    if (nearest.heap.empty())
+        return Color(0, 0, 0);
+
+    // the photons cover the disc of the farthest one (or the whole search disc, if fewer than k were found), and the
+    // cone filter (weights 1 - d/r) spends a third of its volume on it
+    const double radiusSqr = nearest.heap.size() < nearest.k ? Sqr(m_MaxRadius) : nearest.maxDistSqr;
+    const double radius = sqrt(radiusSqr);
+    Color sum(0, 0, 0);
+    for (const auto& found : nearest.heap)
+    {
+        // (only the photons which came from the side the surface is seen from, i.e. travelled against the normal)
+        const Photon& photon = m_Photons[found.second];
+        if (photon.dir[0] * normal.x + photon.dir[1] * normal.y + photon.dir[2] * normal.z >= 0)
+            continue;
+
+        sum += DecodeRGBE(photon.power) * float(1 - sqrt(found.first) / radius);
+    }
+    return sum * float(3 / (PI * radiusSqr));
+}
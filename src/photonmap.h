@@ -0,0 +1,80 @@
+#ifndef RAYTRACING_PHOTONMAP_H
+#define RAYTRACING_PHOTONMAP_H
+
+#include <utility>
+#include <vector>
+
+#include "color.h"
+#include "vector.h"
+
+/**
+ * @class PhotonMap
+ * @brief the caustics: photons shot from the lights, through the mirrors and glass, and kept where they land
+ *
+ * With `caustics' on, before each frame, photons leave the lights (in proportion to their power) and are traced
+ * through the specular surfaces (see Shader::ScatterPhoton()). Where one which went through at least one of those
+ * lands on a diffuse surface (one whose shader SamplesLights()), it is stored. That's the light the camera rays miss:
+ * their shadow rays are blocked by the glass, and their (GI) rays which go through it don't see the lights.
+ *
+ * The diffuse shaders add the caustic irradiance at the point, estimated from its k nearest photons (with a cone
+ * filter over the disc they cover). The photons are found in a left-balanced kd-tree, stored as an array in heap
+ * order (the children of the i-th photon are the 2i-th and the (2i+1)-th), so there are no pointers; each photon is
+ * packed in 20 bytes, so the top of the tree, which every lookup goes through, stays in the cache.
+ *
+ * The photons are traced in batches, on the render threads. Each batch has its own random numbers, so the map doesn't
+ * depend on the number of threads. The power is in the units the shaders use: a white Lambert surface, lit by the
+ * photons, reflects their irradiance.
+ */
+class PhotonMap
+{
+public:
+    void BeginFrame(); //!< traces the photons and builds the tree, if the caustics are on
+    void EndRender();  //!< frees the photons
+
+    bool IsEmpty() const { return m_Photons.size() <= 1; }
+
+    /// the caustic irradiance at pos, on a surface with the given normal (turned to the side it's seen from)
+    Color GetIrradiance(const Vector& pos, const Vector& normal) const;
+
+private:
+    struct Photon
+    {
+        float pos[3];
+        unsigned char power[4]; //!< RGBE: 8-bit mantissas, with a shared exponent
+        signed char dir[3];     //!< the direction it travelled in (towards the surface), times 127
+        unsigned char axis;     //!< the split axis of its node in the tree
+    };
+
+    /// a photon, as traced (before it's packed)
+    struct TracedPhoton
+    {
+        Vector pos;
+        Vector dir;
+        Color power;
+    };
+
+    /// the k nearest photons found so far: a max-heap of their squared distances
+    struct NearestPhotons
+    {
+        unsigned k;
+        double maxDistSqr;
+        std::vector<std::pair<double, unsigned>> heap;
+
+        void Add(double distSqr, unsigned index);
+    };
+
+    /// traces the index-th batch of photons; the lights are picked by the cumulative powers
+    void TraceBatch(unsigned index, const std::vector<double>& lightPowers, std::vector<TracedPhoton>& outPhotons) const;
+
+    /// builds the subtree (of photons[begin..end)) at the given heap index
+    void Balance(std::vector<Photon>& photons, size_t begin, size_t end, size_t heapIndex);
+
+    void Locate(size_t index, const Vector& pos, NearestPhotons& nearest) const;
+
+    std::vector<Photon> m_Photons; //!< the tree, in heap order, from index 1
+    double m_MaxRadius = 0;
+};
+
+extern PhotonMap photonMap;
+
+#endif //RAYTRACING_PHOTONMAP_H
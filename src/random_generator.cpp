@@ -1,48 +1,84 @@
 #include <math.h>
-#include <SDL_thread.h>
 
 #include "constants.h"
 #include "random_generator.h"
-#include "SDL.h"
 
-Random::Random(unsigned seed)
+static unsigned g_Seed = 0xbf14ef80;
+
+static inline unsigned Hash(unsigned x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+Random::Random(unsigned seed, unsigned stream)
+{
+    Seed(seed, stream);
+}
+
+void Random::Seed(unsigned seed, unsigned stream)
 {
-    Seed(seed);
+    // the standard PCG32 initialization
+    m_State = 0;
+    m_Inc = ((unsigned long long) stream << 1) | 1u;
+    _next();
+    m_State += seed;
+    _next();
 }
 
-void Random::Seed(unsigned s)
+void Random::Seed(int x, int y, unsigned sampleIndex, unsigned dimension)
 {
-    m_Generator.seed(s);
+    const unsigned seed = Hash(Hash(Hash(g_Seed ^ (unsigned) x) ^ (unsigned) y) ^ sampleIndex);
+    Seed(seed, dimension);
 }
 
 unsigned Random::_next(void)
 {
-    std::uniform_int_distribution<unsigned> gen;
-    return gen(m_Generator);
+    const unsigned long long old = m_State;
+    m_State = old * 6364136223846793005ull + m_Inc;
+    const unsigned xorShifted = (unsigned) (((old >> 18u) ^ old) >> 27u);
+    const unsigned rot = (unsigned) (old >> 59u);
+    return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
 }
 
 int Random::RandInt(int a, int b)
 {
-    std::uniform_int_distribution<int> gen(a, b);
-    return gen(m_Generator);
+    // unbiased: reject the values in the incomplete last range (D. Lemire's bounded integers)
+    const unsigned range = (unsigned) b - (unsigned) a + 1u;
+    if (range == 0)
+        return (int) _next(); // [INT_MIN..INT_MAX]
+
+    const unsigned threshold = -range % range;
+    unsigned r;
+    do
+    {
+        r = _next();
+    } while (r < threshold);
+    return (int) ((unsigned) a + r % range);
 }
 
 float Random::RandFloat(void)
 {
-    std::uniform_real_distribution<float> gen;
-    return gen(m_Generator);
+    return (_next() >> 8) * (1.f / (1u << 24));
 }
 
 double Random::RandDouble(void)
 {
-    std::uniform_real_distribution<double> gen;
-    return gen(m_Generator);
+    const unsigned long long hi = _next() >> 5;
+    const unsigned long long lo = _next() >> 6;
+    return ((hi << 26) | lo) * (1. / (1ull << 53));
 }
 
 double Random::Gaussian(double mean, double sigma)
 {
-    std::normal_distribution<double> gen(mean, sigma);
-    return gen(m_Generator);
+    // Box-Muller; implemented here (and not with std::normal_distribution) so that the results are the same with any STL
+    const double u = 1. - RandDouble(); // (0..1], so the log() is finite
+    const double v = RandDouble();
+    return mean + sigma * sqrt(-2 * log(u)) * cos(2 * PI * v);
 }
 
 void Random::UnitDiscSample(double &x, double &y)
@@ -56,66 +92,20 @@ void Random::UnitDiscSample(double &x, double &y)
     y = cos(angle) * rad;
 }
 
-struct HashMapEntry
-{
-    Random r;
-    unsigned key;
-    char fill[128]; // skip to the next cacheline
-};
-
-const int RGENS = 257; // 257 is a prime number
-static HashMapEntry rg_table[RGENS];
-
 void InitRandom(unsigned seed)
 {
-    for (int i = 0; i < RGENS; i++)
-        rg_table[i].key = 0xffffffff;
-
-    const int MAXWARM = 1223;
-    seed ^= 0xbf14ef80; // just in case the user passes '0'...
-
-    // initialize and warm-up the zeroth random generator:
-    rg_table[0].r.Seed(seed);
-    for (int i = 0; i < MAXWARM; i++)
-        rg_table[0].r._next();
-
-    for (int i = 1; i < RGENS; i++)
-    {
-        Random& prev = rg_table[i - 1].r;
-        Random& next = rg_table[i].r;
-        next.Seed(prev._next());
-        int n = prev.RandInt(0, MAXWARM - 1);
-        for (int i = 0; i < n; i++)
-            next._next();
-    }
+    g_Seed = seed ^ 0xbf14ef80; // just in case the user passes '0'...
 }
 
-Random& GetRandomGen(int idx)
+unsigned GetRandomSeed()
 {
-    unsigned key = idx;
-    int i = ((unsigned) idx % (unsigned) RGENS);
-    for (int k = 0; k < RGENS; k++)
-    {
-        if (rg_table[i].key == key)
-            return rg_table[i].r;
-
-        if (rg_table[i].key == 0xffffffff)
-        {
-            rg_table[i].key = key;
-            return rg_table[i].r;
-        }
-
-        i++;
-        if (i >= RGENS)
-            i -= RGENS;
-    }
-
-    return rg_table[i].r;
+    return g_Seed;
 }
 
 Random& GetRandomGen()
 {
-    return GetRandomGen(SDL_ThreadID());
+    static thread_local Random generator(g_Seed, Hash(g_Seed));
+    return generator;
 }
 
 // random generator testing code below (disabled)
@@ -130,7 +120,7 @@ Random& GetRandomGen()
 #include "sdl.h"
 #include "utils.h"
 
-extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
+extern Framebuffer vfb;
 
 static class Random* grand;
 
@@ -1,27 +1,31 @@
 #ifndef RAYTRACING_RANDOM_GENERATOR_H
 #define RAYTRACING_RANDOM_GENERATOR_H
 
-#include <random>
-
 /**
  * @File random_generator.h
  * @Brief holds the Random class, and some functions to fetch random number generators
  *
- * The Random class is based on the high-quality mt19937 (Mersenne Twister)
- * pseudo-random number generator, using the C++11 implementation
+ * The Random class is based on the small and fast PCG32 pseudo-random number generator
+ * (M. O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms
+ * for Random Number Generation"). Its whole state is 16 bytes, so it is cheap to create,
+ * copy and reseed.
  *
- * The Random class is not intended to be created and used directly.
- * Its construction is costly; instead, use one of the getRandomGen() functions.
+ * For reproducible renders, don't keep generators running across pixels; instead seed them with
+ * Seed(x, y, sampleIndex, dimension), so that the numbers don't depend on which thread rendered
+ * the pixel, or in which order. The renderer draws its numbers from the Sampler (see sampler.h), and
+ * doesn't reseed the thread's generator (GetRandomGen()), so code which uses it seeds it this way first.
  */
 class Random
 {
 private:
-    std::mt19937 m_Generator; // mersenne twister generator
+    unsigned long long m_State;
+    unsigned long long m_Inc; // selects the stream; always odd
 
 public:
-    Random(unsigned seed = 123u);
+    Random(unsigned seed = 123u, unsigned stream = 0u);
 
-    void Seed(unsigned seed);
+    void Seed(unsigned seed, unsigned stream = 0u);
+    void Seed(int x, int y, unsigned sampleIndex, unsigned dimension); // seed from the sample counters
     unsigned _next(void); // returns a raw 32-bit unbiased random integer
 
     int RandInt(int a, int b); // returns a random integer in [a..b] (a and b can be negative as well)
@@ -31,16 +35,12 @@ public:
     void UnitDiscSample(double& x, double &y); // get a random point in the unit disc (x*x + y*y <= 1)
 };
 
-/// seed the whole array of random generators.
+/// set the global seed, which is mixed into the seeds of all generators and samplers.
 void InitRandom(unsigned seed);
+unsigned GetRandomSeed();
 
-/// fetch the idx-th random generator. There are at least 250 random generators, which are prepared and ready.
-/// This function does not take any start-up time and should be very fast.
-class Random& GetRandomGen(int idx);
-
-/// fetch a fixed random generator, based on the calling thread's ID. I.e., within each thread, all calls to getRandomGen()
-/// are guaranteed to return the same object; in the same time, different threads get different random generators
-/// thus no locking is required, and no performance degradation can occur.
+/// fetch the calling thread's random generator. It is thread_local, so no locking is required,
+/// and no two threads ever share (or false-share) generator state.
 class Random& GetRandomGen(void);
 
 void test_random();
@@ -1,6 +1,8 @@
 #ifndef RAYTRACING_RAY_H_H
 #define RAYTRACING_RAY_H_H
 
+#include "color.h"
+#include "constants.h"
 #include "vector.h"
 
 struct Ray
@@ -8,6 +10,11 @@ struct Ray
     Vector start;
     Vector dir; // normalized
     unsigned depth = 0;
+    Color throughput{1, 1, 1}; //!< what the light coming along the ray is multiplied by, on its way to the pixel
+    double pdf = 0;            //!< the density its direction was drawn with by a diffuse shader (GI); 0 - it wasn't
+    bool diffuse = false;      //!< on a path through a diffuse bounce (GI); its hits don't use the irradiance cache
+    double budget = INF;       //!< the most rays the tree below it may trace (see SecondaryRays::GetBudget())
+    double share = 1;          //!< the product of the shares (of averaged samples) in the throughput (see SecondaryRays::Trace())
     bool debug = false;
 };
 
@@ -0,0 +1,35 @@
+#include "raypacket.h"
+
+#include <algorithm>
+
+#include "constants.h"
+
+void RayPacket::ComputeBounds(uint64_t mask)
+{
+    m_OriginMin.Set(+INF, +INF, +INF);
+    m_OriginMax.Set(-INF, -INF, -INF);
+    double dirMin[3] = {+INF, +INF, +INF};
+    double dirMax[3] = {-INF, -INF, -INF};
+    ForEachRay(mask, [&](int index)
+    {
+        const Ray& ray = m_Rays[index];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            m_OriginMin[axis] = std::min(m_OriginMin[axis], ray.start[axis]);
+            m_OriginMax[axis] = std::max(m_OriginMax[axis], ray.start[axis]);
+            dirMin[axis] = std::min(dirMin[axis], ray.dir[axis]);
+            dirMax[axis] = std::max(dirMax[axis], ray.dir[axis]);
+        }
+    });
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        // (BBox::TestIntersect(ray) ignores the planes of an axis, along which the ray barely moves)
+        m_AxisCoherent[axis] = dirMin[axis] > 1e-9 || dirMax[axis] < -1e-9;
+        if (!m_AxisCoherent[axis])
+            continue;
+
+        m_InvDirMin[axis] = 1. / dirMax[axis];
+        m_InvDirMax[axis] = 1. / dirMin[axis];
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include <cstdint>
+
+#include "ray.h"
+#include "vector.h"
+
+/**
+ * @class RayPacket
+ * @brief up to 64 coherent rays (e.g. the camera rays of a tile of pixels), which traverse the scene together
+ *
+ * The packet keeps bounds of its rays: a box around their origins, and the interval of the inverse directions along
+ * each axis. BBox::TestIntersect(packet) uses them to reject, with a single test, a box which none of the rays can
+ * hit, so the rays only pay for their own box tests where at least one of them gets through. Apart from that, each
+ * ray gets exactly the result it would get on its own.
+ *
+ * A subset of the rays is given as a mask (bit i: the i-th ray).
+ */
+class RayPacket
+{
+public:
+    static const int MAX_RAYS = 64;
+
+    void Clear() { m_Count = 0; }
+    void Add(const Ray& ray) { m_Rays[m_Count++] = ray; }
+    void SetCount(int count) { m_Count = count; }
+    void SetRay(int index, const Ray& ray) { m_Rays[index] = ray; }
+
+    int GetCount() const { return m_Count; }
+    uint64_t GetMask() const { return m_Count == MAX_RAYS ? ~uint64_t(0) : (uint64_t(1) << m_Count) - 1; } //!< all rays
+    const Ray& operator[](int index) const { return m_Rays[index]; }
+
+    /// computes the bounds of the rays in mask (after they're all added), which is what the packet is tested with
+    void ComputeBounds(uint64_t mask);
+
+    const Vector& GetOriginMin() const { return m_OriginMin; }
+    const Vector& GetOriginMax() const { return m_OriginMax; }
+
+    /// whether all the rays go the same way (and not too parallel to the axis' planes) along the axis; if not,
+    /// the axis doesn't bound the packet
+    bool IsAxisCoherent(int axis) const { return m_AxisCoherent[axis]; }
+    double GetInvDirMin(int axis) const { return m_InvDirMin[axis]; }
+    double GetInvDirMax(int axis) const { return m_InvDirMax[axis]; }
+
+private:
+    int m_Count = 0;
+    Ray m_Rays[MAX_RAYS];
+
+    Vector m_OriginMin;
+    Vector m_OriginMax;
+    bool m_AxisCoherent[3] = {false, false, false};
+    double m_InvDirMin[3] = {0, 0, 0};
+    double m_InvDirMax[3] = {0, 0, 0};
+};
+
+/// calls f(index) for every ray in the mask
+template <typename F>
+inline void ForEachRay(uint64_t mask, F f)
+{
+    for (int index = 0; mask; ++index, mask >>= 1)
+        if (mask & 1)
+            f(index);
+}
+
+inline uint64_t RayBit(int index) { return uint64_t(1) << index; }
+
+/// only one ray left: a packet which is down to that is traced as a single ray
+inline bool IsSingleRay(uint64_t mask) { return (mask & (mask - 1)) == 0; }
+
+#endif //RAYTRACING_RAYPACKET_H
@@ -0,0 +1,266 @@
+#include "sampler.h"
+
+#include <cmath>
+#include <cstring>
+
+#include "random_generator.h"
+#include "scene.h"
+
+namespace
+{
+
+/// a 32-bit integer hash with good avalanche (C. Wellons' "lowbias32")
+inline unsigned Hash(unsigned x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline unsigned HashCombine(unsigned seed, unsigned value)
+{
+    return Hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+/// maps 32 bits to [0..1), keeping 24 bits so the result is exactly representable and never rounds up to 1
+inline double ToUnit(unsigned bits)
+{
+    return (bits >> 8) * (1. / (1u << 24));
+}
+
+inline unsigned ReverseBits(unsigned x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+/// the second dimension of the Sobol' sequence, as a 32-bit fraction (the first is just ReverseBits(index))
+inline unsigned SobolBits1(unsigned index)
+{
+    unsigned result = 0;
+    for (unsigned v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+/// Owen scrambling of a 32-bit fraction, through the Laine-Karras hash of its reversed bits
+/// (B. Burley, "Practical Hash-based Owen Scrambling", JCGT 2020)
+inline unsigned NestedUniformScramble(unsigned x, unsigned seed)
+{
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits(x);
+}
+
+/// a pseudo-random permutation of [0..n), for any n > 0 (A. Kensler, "Correlated Multi-Jittered Sampling")
+unsigned Permute(unsigned i, unsigned n, unsigned seed)
+{
+    unsigned w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+const unsigned PRIMES[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+};
+const unsigned NUM_PRIMES = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+double RadicalInverse(unsigned index, unsigned base)
+{
+    const double invBase = 1.0 / base;
+    double invBaseN = 1.0;
+    double result = 0.0;
+    while (index)
+    {
+        unsigned next = index / base;
+        result = result * base + (index - next * base);
+        invBaseN *= invBase;
+        index = next;
+    }
+    return result * invBaseN;
+}
+
+/// shifts x by the offset, modulo 1 (Cranley-Patterson rotation)
+inline double Rotate(double x, unsigned offsetBits)
+{
+    x += ToUnit(offsetBits);
+    return x >= 1.0 ? x - 1.0 : x;
+}
+
+} // namespace
+
+void Sampler::StartSample(int x, int y, unsigned sampleIndex)
+{
+    m_PixelSeed = HashCombine(HashCombine(Hash(GetRandomSeed()), (unsigned) x), (unsigned) y);
+    m_SampleIndex = sampleIndex;
+    m_Dimension = 0;
+}
+
+void Sampler::SetState(const State& state)
+{
+    m_PixelSeed = state.pixelSeed;
+    m_SampleIndex = state.sampleIndex;
+    m_Dimension = state.dimension;
+}
+
+Sampler::State Sampler::Branch()
+{
+    // the same branch of the other samples of the pixel gets the same seed, so the branch's dimensions are
+    // stratified across them as well
+    const State branch{HashCombine(DimensionSeed(), 0x5bd1e995u), m_SampleIndex, 0};
+    m_Dimension++;
+    return branch;
+}
+
+unsigned Sampler::DimensionSeed() const
+{
+    return HashCombine(m_PixelSeed, m_Dimension);
+}
+
+unsigned Sampler::Get32Bits()
+{
+    unsigned bits = HashCombine(DimensionSeed(), m_SampleIndex);
+    m_Dimension++;
+    return bits;
+}
+
+double RandomSampler::Get1D()
+{
+    return ToUnit(Get32Bits());
+}
+
+void RandomSampler::Get2D(double& u, double& v)
+{
+    u = ToUnit(Get32Bits());
+    v = ToUnit(Get32Bits());
+}
+
+double StratifiedSampler::Get1D()
+{
+    const unsigned seed = DimensionSeed();
+    const unsigned stratum = Permute(m_SampleIndex % m_SamplesPerPixel, m_SamplesPerPixel, seed);
+    const double jitter = ToUnit(HashCombine(seed, m_SampleIndex));
+    m_Dimension++;
+    return (stratum + jitter) / m_SamplesPerPixel;
+}
+
+void StratifiedSampler::Get2D(double& u, double& v)
+{
+    // the smallest grid with at least as many cells as samples; for non-square counts a few cells stay empty
+    const unsigned nx = (unsigned) ceil(sqrt((double) m_SamplesPerPixel));
+    const unsigned ny = (m_SamplesPerPixel + nx - 1) / nx;
+    const unsigned numStrata = nx * ny;
+    const unsigned seed = DimensionSeed();
+    const unsigned stratum = Permute(m_SampleIndex % numStrata, numStrata, seed);
+    u = (stratum % nx + ToUnit(HashCombine(seed, 2*m_SampleIndex))) / nx;
+    v = (stratum / nx + ToUnit(HashCombine(seed, 2*m_SampleIndex + 1))) / ny;
+    m_Dimension++;
+}
+
+double HaltonSampler::Get1D()
+{
+    if (m_Dimension >= NUM_PRIMES)
+        return ToUnit(Get32Bits());
+
+    double result = Rotate(RadicalInverse(m_SampleIndex, PRIMES[m_Dimension]), DimensionSeed());
+    m_Dimension++;
+    return result;
+}
+
+void HaltonSampler::Get2D(double& u, double& v)
+{
+    u = Get1D();
+    v = Get1D();
+}
+
+double SobolSampler::Get1D()
+{
+    const unsigned seed = DimensionSeed();
+    const unsigned index = NestedUniformScramble(m_SampleIndex, Hash(seed));
+    m_Dimension++;
+    return ToUnit(NestedUniformScramble(ReverseBits(index), seed));
+}
+
+void SobolSampler::Get2D(double& u, double& v)
+{
+    // each dimension pair is a separate (0, 2)-sequence; shuffling the index per pair decorrelates the pairs
+    const unsigned seed = DimensionSeed();
+    const unsigned index = NestedUniformScramble(m_SampleIndex, Hash(seed));
+    u = ToUnit(NestedUniformScramble(ReverseBits(index), HashCombine(seed, 0)));
+    v = ToUnit(NestedUniformScramble(SobolBits1(index), HashCombine(seed, 1)));
+    m_Dimension++;
+}
+
+bool ParseSamplerType(const char* name, SamplerType& outType)
+{
+    if (!strcmp(name, "random")) outType = SamplerType::Random;
+    else if (!strcmp(name, "stratified")) outType = SamplerType::Stratified;
+    else if (!strcmp(name, "halton")) outType = SamplerType::Halton;
+    else if (!strcmp(name, "sobol")) outType = SamplerType::Sobol;
+    else return false;
+    return true;
+}
+
+std::unique_ptr<Sampler> CreateSampler(SamplerType type)
+{
+    switch (type)
+    {
+        case SamplerType::Random: return std::unique_ptr<Sampler>(new RandomSampler);
+        case SamplerType::Stratified: return std::unique_ptr<Sampler>(new StratifiedSampler);
+        case SamplerType::Halton: return std::unique_ptr<Sampler>(new HaltonSampler);
+        case SamplerType::Sobol: break;
+    }
+    return std::unique_ptr<Sampler>(new SobolSampler);
+}
+
+Sampler& GetSampler()
+{
+    static thread_local std::unique_ptr<Sampler> sampler;
+    static thread_local SamplerType samplerType;
+
+    if (!sampler || samplerType != scene.settings.sampler)
+    {
+        samplerType = scene.settings.sampler;
+        sampler = CreateSampler(samplerType);
+    }
+    sampler->SetSamplesPerPixel(scene.settings.GetMaxSamplesPerPixel());
+    return *sampler;
+}
@@ -0,0 +1,109 @@
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <memory>
+
+/**
+ * @File sampler.h
+ * @Brief holds the Sampler interface and its low-discrepancy implementations
+ *
+ * Every stochastic decision in the renderer (AA sub-pixel offsets, glossy and disc samples, light sample
+ * scrambles, ...) draws from the calling thread's sampler. Before tracing a camera sample, the renderer
+ * calls StartSample() with the pixel coordinates and the index of the sample within the pixel; after that
+ * each Get1D()/Get2D() call returns the next dimension of that sample.
+ *
+ * The values depend only on (pixel, sample index, dimension) - not on the thread or the order
+ * in which the pixels are rendered - and different pixels get decorrelated sequences. Each secondary ray
+ * starts a sequence of its own (see Branch()).
+ */
+class Sampler
+{
+public:
+    virtual ~Sampler() = default;
+
+    void SetSamplesPerPixel(unsigned samplesPerPixel) { m_SamplesPerPixel = samplesPerPixel ? samplesPerPixel : 1; }
+    unsigned GetSamplesPerPixel() const { return m_SamplesPerPixel; }
+
+    /// starts the sampleIndex-th sample of pixel (x, y), resetting the dimension counter
+    void StartSample(int x, int y, unsigned sampleIndex);
+
+    virtual double Get1D() =0; //!< a number in [0..1) for the next dimension
+    virtual void Get2D(double& u, double& v) =0; //!< a point in [0..1)^2 for the next (pair of) dimension(s)
+
+    unsigned Get32Bits(); //!< 32 random bits, from the next dimension (e.g. for scrambling)
+
+    /// where the current sample is in its sequence (the wavefront engine keeps one with each queued ray)
+    struct State
+    {
+        unsigned pixelSeed;
+        unsigned sampleIndex;
+        unsigned dimension;
+    };
+
+    State GetState() const { return {m_PixelSeed, m_SampleIndex, m_Dimension}; }
+    void SetState(const State& state);
+
+    /// Branches off a secondary ray (which takes a dimension): returns the state its numbers start from. They depend
+    /// only on where the branch is in this sequence, so the rays of a sample's tree can be traced in any order, and
+    /// a ray's numbers don't shift with how many the other branches took.
+    State Branch();
+
+protected:
+    unsigned m_SamplesPerPixel = 1;
+    unsigned m_PixelSeed = 0;
+    unsigned m_SampleIndex = 0;
+    unsigned m_Dimension = 0;
+
+    unsigned DimensionSeed() const; //!< a hash of the pixel and the current dimension
+};
+
+/// Independent (hashed) random numbers. The reference the others are compared to.
+class RandomSampler : public Sampler
+{
+public:
+    virtual double Get1D() override;
+    virtual void Get2D(double& u, double& v) override;
+};
+
+/// Jittered strata. The strata of each dimension are shuffled independently (per pixel), so the
+/// sample count must be known in advance (SetSamplesPerPixel())
+class StratifiedSampler : public Sampler
+{
+public:
+    virtual double Get1D() override;
+    virtual void Get2D(double& u, double& v) override;
+};
+
+/// The Halton sequence, with a different prime base per dimension and a per-pixel (Cranley-Patterson) rotation.
+/// Dimensions past the prime table fall back to hashed random numbers.
+class HaltonSampler : public Sampler
+{
+public:
+    virtual double Get1D() override;
+    virtual void Get2D(double& u, double& v) override;
+};
+
+/// The Sobol' (0, 2)-sequence, padded per dimension pair and Owen-scrambled (nested uniform scrambling,
+/// after Burley 2020). The sample index is shuffled per pixel and dimension, so the dimensions are decorrelated.
+class SobolSampler : public Sampler
+{
+public:
+    virtual double Get1D() override;
+    virtual void Get2D(double& u, double& v) override;
+};
+
+enum class SamplerType
+{
+    Random,
+    Stratified,
+    Halton,
+    Sobol
+};
+
+bool ParseSamplerType(const char* name, SamplerType& outType);
+std::unique_ptr<Sampler> CreateSampler(SamplerType type);
+
+/// the sampler of the calling thread (created on first use, of the type in the scene settings)
+Sampler& GetSampler();
+
+#endif //RAYTRACING_SAMPLER_H
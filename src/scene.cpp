@@ -14,8 +14,10 @@
 #include "environment.h"
 #include "geometry.h"
 #include "heightfield.h"
+#include "irradiancecache.h"
 #include "light.h"
 #include "mesh.h"
+#include "photonmap.h"
 #include "random_generator.h"
 #include "sdl.h"
 #include "shading.h"
@@ -43,6 +45,8 @@ public:
     virtual bool GetFilenameProp(const char* name, char* value) override;
     virtual bool GetBitmapFileProp(const char* name, Bitmap& value) override;
     virtual void GetTransformProp(Transform& T) override;
+    virtual bool GetAnimatedProp(const char* name, Track<double>& track) override;
+    virtual bool GetAnimatedProp(const char* name, Track<Vector>& track) override;
     virtual void RequiredProp(const char* name) override;
     virtual void SignalError(const char* msg) override;
     virtual void SignalWarning(const char* msg) override;
@@ -312,6 +316,56 @@ void ParsedBlockImpl::GetTransformProp(Transform& T)
     }
 }
 
+/// splits the value of a keyframe line ("<frame> <value>") into the frame and the value
+static double GetKeyFrame(int srcLine, char* value)
+{
+    char frameToken[256];
+    double frame;
+    if (!GetFrontToken(value, frameToken) || 1 != sscanf(frameToken, "%lf", &frame))
+        throw SyntaxError(srcLine, "Expected a frame number, followed by the value at that frame");
+    return frame;
+}
+
+bool ParsedBlockImpl::GetAnimatedProp(const char* name, Track<double>& track)
+{
+    bool found = false;
+    for (LineInfo& lineInfo: m_Lines)
+    {
+        if (strcmp(lineInfo.propName, name))
+            continue;
+
+        lineInfo.recognized = true;
+        char value[256];
+        strcpy(value, lineInfo.propValue);
+        const double frame = GetKeyFrame(lineInfo.line, value);
+        double d;
+        if (1 != sscanf(value, "%lf", &d)) throw SyntaxError(lineInfo.line, "Invalid float");
+        track.AddKey(frame, d);
+        found = true;
+    }
+    return found;
+}
+
+bool ParsedBlockImpl::GetAnimatedProp(const char* name, Track<Vector>& track)
+{
+    bool found = false;
+    for (LineInfo& lineInfo: m_Lines)
+    {
+        if (strcmp(lineInfo.propName, name))
+            continue;
+
+        lineInfo.recognized = true;
+        char value[256];
+        strcpy(value, lineInfo.propValue);
+        const double frame = GetKeyFrame(lineInfo.line, value);
+        Vector v;
+        Get3Doubles(lineInfo.line, value, v.x, v.y, v.z);
+        track.AddKey(frame, v);
+        found = true;
+    }
+    return found;
+}
+
 void ParsedBlockImpl::RequiredProp(const char* name)
 {
     int k1, k2;
@@ -390,7 +444,7 @@ static void StripWhiteSpace(char* s)
 
 bool DefaultSceneParser::Parse(const char* filename, Scene* ss)
 {
-    class Random& rnd = GetRandomGen(0);
+    class Random rnd(GetRandomSeed());
     m_S = ss;
     m_CurObj = nullptr;
     m_CurLine = 0;
@@ -827,7 +881,10 @@ void Scene::BeginFrame()
     for (auto& element: shaders) element->BeginFrame();
     for (auto& element: superNodes) element->BeginFrame();
     for (auto& element: nodes) element->BeginFrame();
+    bvh.Update(nodes); // after the nodes have moved
+    irradianceCache.BeginFrame(); // (after the tree, which bounds it)
     for (auto& element: lights) element->BeginFrame();
+    photonMap.BeginFrame(); // (traced through the updated tree, from the updated lights)
     camera->BeginFrame();
     settings.BeginFrame();
     if (environment)
@@ -836,6 +893,8 @@ void Scene::BeginFrame()
 
 void Scene::EndRender()
 {
+    irradianceCache.EndRender();
+    photonMap.EndRender();
     if (environment)
         environment->EndRender();
     settings.EndRender();
@@ -850,22 +909,83 @@ void Scene::EndRender()
 
 void GlobalSettings::FillProperties(ParsedBlock& pb)
 {
-    pb.GetIntProp("frameWidth", &frameWidth);
-    pb.GetIntProp("frameHeight", &frameHeight);
+    pb.GetIntProp("frameWidth", &frameWidth, 1);
+    pb.GetIntProp("frameHeight", &frameHeight, 1);
 
     pb.GetColorProp("ambientLight", &ambientLight);
 
     pb.GetBoolProp("wantAA", &wantAA);
     pb.GetBoolProp("wantAdaptiveAA", &wantAdaptiveAA);
-    pb.GetDoubleProp("aaThreshold", &aaThreshold);
+    pb.GetUnsignedProp("aaSamples", &aaSamples);
+    if (aaSamples < 1) pb.SignalError("aaSamples must be at least 1");
+    pb.GetUnsignedProp("minSamples", &minSamples);
+    pb.GetUnsignedProp("maxSamples", &maxSamples);
+    if (minSamples < 2) pb.SignalError("minSamples must be at least 2 (the noise can't be estimated from a single sample)");
+    if (maxSamples < minSamples) pb.SignalError("maxSamples must be at least minSamples");
+    pb.GetDoubleProp("noiseThreshold", &noiseThreshold, 0.);
+    pb.GetDoubleProp("sampleBudget", &sampleBudget, 0.);
+
+    pb.GetBoolProp("progressive", &progressive);
+    pb.GetUnsignedProp("progressiveSamples", &progressiveSamples);
+    pb.GetDoubleProp("progressiveTimeLimit", &progressiveTimeLimit, 0.);
+
+    pb.GetDoubleProp("deadline", &deadline, 0.);
+    pb.GetBoolProp("gi", &gi);
+    pb.GetBoolProp("irradianceCache", &irradianceCache);
+    pb.GetDoubleProp("irradianceCacheAccuracy", &irradianceCacheAccuracy, 1e-3, 10.);
+    pb.GetUnsignedProp("irradianceCacheSamples", &irradianceCacheSamples);
+    pb.GetDoubleProp("irradianceCacheMinSpacing", &irradianceCacheMinSpacing, 0.);
+    pb.GetDoubleProp("irradianceCacheMaxSpacing", &irradianceCacheMaxSpacing, 0.);
+    pb.GetBoolProp("caustics", &caustics);
+    pb.GetUnsignedProp("causticPhotons", &causticPhotons);
+    pb.GetUnsignedProp("causticLookupPhotons", &causticLookupPhotons);
+    if (causticLookupPhotons < 1) pb.SignalError("causticLookupPhotons must be at least 1");
+    pb.GetDoubleProp("causticRadius", &causticRadius, 0.);
 
     pb.GetUnsignedProp("maxTraceDepth", &maxTraceDepth);
+    pb.GetUnsignedProp("rouletteDepth", &rouletteDepth);
+    pb.GetDoubleProp("rouletteThreshold", &rouletteThreshold, 0., 1.);
+    pb.GetDoubleProp("minThroughput", &minThroughput, 0., 1.);
+    pb.GetUnsignedProp("rayBudget", &rayBudget);
+    pb.GetDoubleProp("glossyNoiseThreshold", &glossyNoiseThreshold, 0.);
+
+    char engineName[256];
+    if (pb.GetStringProp("engine", engineName) && !ParseRenderEngine(engineName, engine))
+        pb.SignalError("Unknown engine (expected recursive or wavefront)");
+    pb.GetUnsignedProp("packetSize", &packetSize);
+    if (packetSize != 1 && packetSize != 2 && packetSize != 4 && packetSize != 8)
+        pb.SignalError("packetSize must be 1, 2, 4 or 8");
+
+    char samplerName[256];
+    if (pb.GetStringProp("sampler", samplerName) && !ParseSamplerType(samplerName, sampler))
+        pb.SignalError("Unknown sampler (expected one of random, stratified, halton, sobol)");
+    pb.GetIntProp("numThreads", &numThreads, 0);
+    pb.GetIntProp("bucketSize", &bucketSize, 1);
+
+    char orderName[256];
+    if (pb.GetStringProp("bucketOrder", orderName) && !ParseBucketOrder(orderName, bucketOrder))
+        pb.SignalError("Unknown bucket order (expected one of rows, hilbert, morton, spiral)");
 
     pb.GetBoolProp("dbg", &dbg);
     pb.GetBoolProp("showAA", &showAA);
     pb.GetColorProp("aaDebugColor", &aaDebugColor);
 
     pb.GetBoolProp("useSRGB", &useSRGB);
+
+    pb.GetIntProp("numFrames", &numFrames, 1);
+
+    char filename[256];
+    if (pb.GetStringProp("outputFile", filename))
+        outputFile = filename;
+    if (pb.GetStringProp("irradianceCacheFile", filename))
+        irradianceCacheFile = filename;
+    pb.GetBoolProp("streamOutput", &streamOutput);
+    if (streamOutput && ExtensionUpper(outputFile.c_str()) != "EXR")
+        pb.SignalError("streamOutput needs an EXR outputFile");
+    if (streamOutput && progressive)
+        pb.SignalError("streamOutput doesn't work with progressive rendering");
+    if (streamOutput && deadline > 0)
+        pb.SignalError("streamOutput doesn't work with a deadline");
 }
 
 SceneElement* DefaultSceneParser::NewSceneElement(const char* className)
@@ -890,6 +1010,7 @@ SceneElement* DefaultSceneParser::NewSceneElement(const char* className)
     if (!strcmp(className, "BlinnPhong")) return new BlinnPhong;
     if (!strcmp(className, "OrenNayar")) return new OrenNayar;
     if (!strcmp(className, "Refl")) return new Reflection;
+    if (!strcmp(className, "GGX")) return new GGXReflection;
     if (!strcmp(className, "Refr")) return new Refraction;
     if (!strcmp(className, "Layered")) return new Layered;
     if (!strcmp(className, "Const")) return new ConstColorShader;
@@ -913,6 +1034,8 @@ SceneElement* DefaultSceneParser::NewSceneElement(const char* className)
 
     // light
     if (!strcmp(className, "Light")) return new Light;
+    if (!strcmp(className, "RectLight")) return new RectLight;
+    if (!strcmp(className, "SphereLight")) return new SphereLight;
 
     return nullptr;
 }
@@ -1,10 +1,15 @@
 #ifndef RAYTRACING_SCENE_H
 #define RAYTRACING_SCENE_H
 
+#include "animation.h"
+#include "buckets.h"
 #include "color.h"
 #include "colors.h"
 #include "constants.h"
+#include "sampler.h"
+#include "scenebvh.h"
 #include "vector.h"
+#include "wavefront.h"
 
 #include <climits>
 #include <string>
@@ -154,6 +159,11 @@ public:
     // "scale", "rotate" and "translate" and applies them to T.
     virtual void GetTransformProp(Transform& T) = 0;
 
+    // Gets the keys of an animated property: all lines "<name> <frame> <value>" are added to the track
+    // (e.g. "keyYaw 24 90" or "keyTranslate 24 (1, 0, 0)"). Returns true if there was at least one key.
+    virtual bool GetAnimatedProp(const char* name, Track<double>& track) = 0;
+    virtual bool GetAnimatedProp(const char* name, Track<Vector>& track) = 0;
+
     virtual void RequiredProp(const char* name) = 0; // signal an error (missing property of the given name)
 
     virtual void SignalError(const char* msg) = 0; // signal an error with a specified message
@@ -235,11 +245,53 @@ struct GlobalSettings : public SceneElement
 
     // AA-related:
     bool wantAA = true;                  //!< is Anti-Aliasing on?
-    bool wantAdaptiveAA = true;          //!< apply Anti-Aliasing only when needed
-    double aaThreshold = 0.1;            //!< threshold for adaptive Anti-Aliasing
-    bool gi;                             //!< is GI on?
+    bool wantAdaptiveAA = true;          //!< keep sampling each pixel only until its noise is low enough
+    unsigned aaSamples = 5;              //!< number of samples per pixel, for non-adaptive Anti-Aliasing
+    unsigned minSamples = 4;             //!< adaptive AA: the samples every pixel gets
+    unsigned maxSamples = 64;            //!< adaptive AA: no pixel gets more samples than this
+    double noiseThreshold = 0.005;       //!< adaptive AA: a pixel is done when the standard error of its intensity drops below this
+    double sampleBudget = 16;            //!< adaptive AA: average samples per pixel the whole frame may take (0 - no limit)
+
+    // Progressive rendering:
+    bool progressive = false;            //!< render in iterations of one jittered sample per pixel, displaying the running average
+    unsigned progressiveSamples = 0;     //!< stop after this many samples per pixel (0 - no limit)
+    double progressiveTimeLimit = 0;     //!< stop after this many seconds (0 - no limit)
+
+    // Deadline rendering:
+    double deadline = 0;                 //!< render for this many seconds, refining the noisiest parts first, then stop (0 - off)
+    bool gi = false;                     //!< is GI on? (path tracing, instead of the constant ambient light)
+
+    // Irradiance cache (in GI):
+    bool irradianceCache = false;        //!< interpolate the indirect light of the first diffuse hits from cached samples
+    double irradianceCacheAccuracy = 0.2; //!< Ward's `a': the larger, the farther the samples are reused
+    unsigned irradianceCacheSamples = 256; //!< hemisphere rays per sample
+    double irradianceCacheMinSpacing = 0; //!< the bounds of the samples' radii, in world units (0 - relative to the scene size)
+    double irradianceCacheMaxSpacing = 0;
+    std::string irradianceCacheFile;     //!< loaded before the render (if it exists), and saved after it
+
+    // Caustics (photon mapping):
+    bool caustics = false;               //!< trace photons from the lights through mirrors and glass, and add the caustics they make
+    unsigned causticPhotons = 200000;    //!< the photons to keep in the map (as many are shot as it takes to get them)
+    unsigned causticLookupPhotons = 50;  //!< the caustics at a point are estimated from this many of the nearest photons...
+    double causticRadius = 0;            //!< ...within this distance, in world units (0 - relative to the scene size)
 
     unsigned maxTraceDepth = 4;               //!< maximum recursion depth
+    unsigned rouletteDepth = 2;               //!< from this depth on, secondary rays may be ended by Russian roulette...
+    double rouletteThreshold = 0;             //!< ...if their throughput is below this (0 - no Russian roulette)
+    double minThroughput = 0;                 //!< secondary rays with a lower throughput aren't traced (biased; 0 - all are)
+    unsigned rayBudget = 0;                   //!< the most secondary rays the ray tree of a camera sample may trace (0 - no limit)
+    double glossyNoiseThreshold = 0;          //!< glossy reflections take samples by the path's weight, until their error in the
+                                              //!< pixel drops below this (0 - numSamples at the camera rays' hits, 2 deeper).
+                                              //!< Biased: the error is estimated from as few as 4 samples, which may all
+                                              //!< miss a small highlight, and so stop too early; and only the recursive
+                                              //!< engine stops early (the wavefront one only scales the count)
+    RenderEngine engine = RenderEngine::Recursive; //!< how the rays are traced ("recursive" or "wavefront")
+    unsigned packetSize = 8;                  //!< the wavefront engine traces camera and shadow rays in packets of NxN pixels (1, 2, 4 or 8; 1 - no packets)
+
+    SamplerType sampler = SamplerType::Sobol; //!< where the random numbers come from ("random", "stratified", "halton" or "sobol")
+    int numThreads = 0;                       //!< number of render threads (0 - one per CPU core)
+    int bucketSize = 48;                      //!< the size of the square buckets, in pixels
+    BucketOrder bucketOrder = BucketOrder::Rows; //!< the order the buckets are handed out ("rows", "hilbert", "morton" or "spiral")
 
     bool dbg = false;                    //!< a debugging flag (if on, various raytracing-related procedures will dump debug info to stdout).
     bool showAA = false;                 //!< will color the Anti-Aliased pixels differently
@@ -247,6 +299,30 @@ struct GlobalSettings : public SceneElement
 
     bool useSRGB = false;                //!< whether to use sRGB or RGB
 
+    // Animation:
+    int numFrames = 1;                   //!< more than one renders an animation: frames 0..numFrames-1, each saved to a numbered outputFile
+
+    // Partial renders (set from the command line: --region and --tile-index):
+    bool useRegion = false;              //!< render only the buckets which overlap region (clipped to it)
+    Rect region{0, 0, 0, 0};             //!< in pixels; x1 and y1 are exclusive
+    int tileIndex = 0;                   //!< render only every tileCount-th bucket, starting from the tileIndex-th
+    int tileCount = 1;
+
+    // Output:
+    std::string outputFile;              //!< if set, the image is saved there when the render is done
+    bool streamOutput = false;           //!< write the buckets straight into outputFile (a tiled EXR), as they finish, with no window
+                                         //!< and no full-frame buffer (for frames which don't fit in memory)
+
+    bool IsPartialRender() const { return useRegion || tileCount > 1; }
+
+    /// the most samples a pixel can get, with the current AA settings
+    unsigned GetMaxSamplesPerPixel() const
+    {
+        if (deadline > 0) return maxSamples;
+        if (progressive) return progressiveSamples ? progressiveSamples : 1; // 1: unknown count, the samples aren't stratified
+        return !wantAA ? 1 : (wantAdaptiveAA ? maxSamples : aaSamples);
+    }
+
     virtual void FillProperties(ParsedBlock& pb) override;
     virtual ElementType GetElementType() const override { return ElementType::SETTINGS; }
 };
@@ -265,6 +341,8 @@ struct Scene
     Environment* environment = nullptr;
     Camera* camera = nullptr;
     GlobalSettings settings;
+    int frame = 0; //!< the frame being rendered (the animated elements are evaluated at it, in BeginFrame())
+    SceneBVH bvh;  //!< over the nodes; built, refitted or rebuilt in BeginFrame()
 
     Scene() = default;
     virtual ~Scene();
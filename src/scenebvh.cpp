@@ -0,0 +1,542 @@
+#include "scenebvh.h"
+
+#include "constants.h"
+#include "geometry.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace
+{
+const int MAX_LEAF_SIZE = 2;
+const int MAX_DEPTH = 60;   //!< also bounds the traversal stacks
+const int NUM_BINS = 16;    //!< split candidates per node, for the binned SAH
+}
+
+void SceneBVH::Build(const std::vector<Node*>& nodes)
+{
+    m_Nodes = nodes;
+    m_Items.clear();
+    m_Unbounded.clear();
+    m_Tree.clear();
+    m_HasAnimatedNodes = false;
+
+    for (int i = 0; i < (int) nodes.size(); ++i)
+    {
+        Node* node = nodes[i];
+        m_HasAnimatedNodes |= node->IsAnimated();
+
+        Item item{node, i, Vector(0, 0, 0)};
+        if (node->bounded)
+        {
+            item.centroid = (node->worldBBox.GetMin() + node->worldBBox.GetMax()) * 0.5;
+            m_Items.push_back(item);
+        }
+        else
+        {
+            m_Unbounded.push_back(item);
+        }
+    }
+
+    if (!m_Items.empty())
+        BuildSubtree(0, (int) m_Items.size(), 0);
+
+    m_BuildCost = GetCost();
+    ++m_NumBuilds;
+}
+
+int SceneBVH::BuildSubtree(int first, int count, int depth)
+{
+    const int index = (int) m_Tree.size();
+    m_Tree.emplace_back();
+
+    BBox bbox, centroidBBox;
+    bbox.MakeEmpty();
+    centroidBBox.MakeEmpty();
+    for (int i = first; i < first + count; ++i)
+    {
+        bbox.Add(m_Items[i].node->worldBBox);
+        centroidBBox.Add(m_Items[i].centroid);
+    }
+    m_Tree[index].bbox = bbox;
+
+    // split along the axis where the centroids spread the most
+    const Vector extent = centroidBBox.GetMax() - centroidBBox.GetMin();
+    int axis = 0;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH || extent[axis] <= 0)
+    {
+        m_Tree[index].first = first;
+        m_Tree[index].count = count;
+        return index;
+    }
+
+    // binned SAH: sort the centroids into bins, and find the bin boundary, where
+    // (left area * left count + right area * right count) is the smallest
+    const double binStart = centroidBBox.GetMin()[axis];
+    const double binScale = NUM_BINS / extent[axis];
+    auto binOf = [&](const Item& item)
+    {
+        return std::min(int((item.centroid[axis] - binStart) * binScale), NUM_BINS - 1);
+    };
+
+    BBox binBBoxes[NUM_BINS];
+    int binCounts[NUM_BINS] = {};
+    for (BBox& binBBox: binBBoxes)
+        binBBox.MakeEmpty();
+    for (int i = first; i < first + count; ++i)
+    {
+        const int bin = binOf(m_Items[i]);
+        binBBoxes[bin].Add(m_Items[i].node->worldBBox);
+        ++binCounts[bin];
+    }
+
+    // rightCost[b]: the area * count of the bins from b to the end
+    double rightCost[NUM_BINS] = {};
+    BBox accumulated;
+    accumulated.MakeEmpty();
+    int accumulatedCount = 0;
+    for (int bin = NUM_BINS - 1; bin > 0; --bin)
+    {
+        if (binCounts[bin])
+            accumulated.Add(binBBoxes[bin]);
+        accumulatedCount += binCounts[bin];
+        rightCost[bin] = accumulatedCount ? accumulated.GetSurfaceArea() * accumulatedCount : 0;
+    }
+
+    // (the lowest and the highest centroid are in the first and the last bin, so there's always a split with
+    // items on both sides)
+    int bestSplit = 1;
+    double bestCost = INF;
+    accumulated.MakeEmpty();
+    accumulatedCount = 0;
+    for (int split = 1; split < NUM_BINS; ++split)
+    {
+        if (binCounts[split - 1])
+            accumulated.Add(binBBoxes[split - 1]);
+        accumulatedCount += binCounts[split - 1];
+        if (accumulatedCount == 0 || accumulatedCount == count)
+            continue;
+
+        const double cost = accumulated.GetSurfaceArea() * accumulatedCount + rightCost[split];
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestSplit = split;
+        }
+    }
+
+    const auto middle = std::partition(m_Items.begin() + first, m_Items.begin() + first + count,
+                                       [&](const Item& item) { return binOf(item) < bestSplit; });
+    const int leftCount = int(middle - m_Items.begin()) - first;
+
+    BuildSubtree(first, leftCount, depth + 1); // at index + 1
+    const int right = BuildSubtree(first + leftCount, count - leftCount, depth + 1);
+    m_Tree[index].right = right;
+    return index;
+}
+
+void SceneBVH::UpdateLeafBBox(TreeNode& leaf) const
+{
+    leaf.bbox.MakeEmpty();
+    for (int i = leaf.first; i < leaf.first + leaf.count; ++i)
+        leaf.bbox.Add(m_Items[i].node->worldBBox);
+}
+
+void SceneBVH::Refit()
+{
+    // children are always after their parent, so going backwards visits them first
+    for (int index = (int) m_Tree.size() - 1; index >= 0; --index)
+    {
+        TreeNode& treeNode = m_Tree[index];
+        if (treeNode.count)
+        {
+            UpdateLeafBBox(treeNode);
+        }
+        else
+        {
+            treeNode.bbox = m_Tree[index + 1].bbox;
+            treeNode.bbox.Add(m_Tree[treeNode.right].bbox);
+        }
+    }
+    ++m_NumRefits;
+}
+
+void SceneBVH::Update(const std::vector<Node*>& nodes)
+{
+    if (nodes != m_Nodes)
+    {
+        Build(nodes);
+        return;
+    }
+
+    if (!m_HasAnimatedNodes)
+        return;
+
+    Refit();
+    if (GetCost() > m_BuildCost * REBUILD_COST_RATIO)
+        Build(nodes);
+}
+
+BBox SceneBVH::GetBounds() const
+{
+    BBox bounds;
+    bounds.MakeEmpty();
+    if (!m_Tree.empty())
+        bounds = m_Tree[0].bbox;
+    return bounds;
+}
+
+double SceneBVH::GetCost() const
+{
+    double cost = (double) m_Unbounded.size();
+    if (m_Tree.empty())
+        return cost;
+
+    // the chance that a ray hitting the root also hits a box is proportional to the box' surface area
+    const double rootArea = m_Tree[0].bbox.GetSurfaceArea();
+    if (rootArea <= 0)
+        return cost + m_Items.size();
+
+    cost += 1; // the root box
+    for (const TreeNode& treeNode: m_Tree)
+    {
+        const double probability = treeNode.bbox.GetSurfaceArea() / rootArea;
+        cost += probability * (treeNode.count ? treeNode.count : 2); // the items, or the two child boxes
+    }
+    return cost;
+}
+
+const Node* SceneBVH::Intersect(const Ray& ray, IntersectionInfo& outInfo) const
+{
+    const Node* closestNode = nullptr;
+    int closestOrder = INT_MAX;
+    double closestDist = INF;
+    auto testItem = [&](const Item& item)
+    {
+        IntersectionInfo info;
+        if (!item.node->Intersect(ray, info))
+            return;
+
+        if (info.distance > closestDist || (info.distance == closestDist && item.order > closestOrder))
+            return;
+
+        closestNode = item.node;
+        closestOrder = item.order;
+        closestDist = info.distance;
+        outInfo = info;
+    };
+
+    for (const Item& item: m_Unbounded)
+        testItem(item);
+
+    if (m_Tree.empty())
+        return closestNode;
+
+    // the boxes are visited nearest first; any box farther than the closest hit so far is skipped
+    // (ClosestIntersection() gives INF if the ray misses the box)
+    auto mayHoldCloser = [&](double boxDist) { return boxDist < INF && boxDist <= closestDist; };
+    struct StackEntry
+    {
+        int index;
+        double dist;
+    };
+    StackEntry stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+
+    const double rootDist = m_Tree[0].bbox.ClosestIntersection(ray);
+    if (mayHoldCloser(rootDist))
+        stack[stackSize++] = {0, rootDist};
+
+    while (stackSize)
+    {
+        const StackEntry entry = stack[--stackSize];
+        if (!mayHoldCloser(entry.dist))
+            continue;
+
+        const TreeNode& treeNode = m_Tree[entry.index];
+        if (treeNode.count)
+        {
+            for (int i = treeNode.first; i < treeNode.first + treeNode.count; ++i)
+                if (mayHoldCloser(m_Items[i].node->worldBBox.ClosestIntersection(ray)))
+                    testItem(m_Items[i]);
+            continue;
+        }
+
+        StackEntry nearChild{entry.index + 1, m_Tree[entry.index + 1].bbox.ClosestIntersection(ray)};
+        StackEntry farChild{treeNode.right, m_Tree[treeNode.right].bbox.ClosestIntersection(ray)};
+        if (farChild.dist < nearChild.dist)
+            std::swap(nearChild, farChild);
+
+        if (mayHoldCloser(farChild.dist))
+            stack[stackSize++] = farChild;
+        if (mayHoldCloser(nearChild.dist))
+            stack[stackSize++] = nearChild;
+    }
+
+    return closestNode;
+}
+
+float SceneBVH::GetTransparency(const Ray& ray, double maxDistSqr, const Node*& outOccluder, int& outPrimitive) const
+{
+    float result = 1.f;
+
+    // false if the node stops the ray
+    auto testNode = [&](const Node* node)
+    {
+        IntersectionInfo info;
+        if (!node->Intersect(ray, info) || Sqr(info.distance) >= maxDistSqr)
+            return true;
+
+        if (node->shadowTransparency == 0.f)
+        {
+            outOccluder = node;
+            outPrimitive = info.primitive;
+            return false;
+        }
+
+        result *= node->shadowTransparency;
+        return true;
+    };
+
+    for (const Item& item: m_Unbounded)
+        if (!testNode(item.node))
+            return 0.f;
+
+    if (m_Tree.empty() || !m_Tree[0].bbox.TestIntersect(ray))
+        return result;
+
+    int stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize)
+    {
+        const int index = stack[--stackSize];
+        const TreeNode& treeNode = m_Tree[index];
+        if (treeNode.count)
+        {
+            for (int i = treeNode.first; i < treeNode.first + treeNode.count; ++i)
+                if (m_Items[i].node->MayIntersect(ray) && !testNode(m_Items[i].node))
+                    return 0.f;
+            continue;
+        }
+
+        if (m_Tree[treeNode.right].bbox.TestIntersect(ray))
+            stack[stackSize++] = treeNode.right;
+        if (m_Tree[index + 1].bbox.TestIntersect(ray))
+            stack[stackSize++] = index + 1;
+    }
+    return result;
+}
+
+void SceneBVH::IntersectPacket(const RayPacket& packet, const Node** outNodes, IntersectionInfo* outInfos) const
+{
+    int closestOrder[RayPacket::MAX_RAYS];
+    double closestDist[RayPacket::MAX_RAYS];
+    for (int i = 0; i < packet.GetCount(); ++i)
+    {
+        outNodes[i] = nullptr;
+        closestOrder[i] = INT_MAX;
+        closestDist[i] = INF;
+    }
+
+    IntersectionInfo infos[RayPacket::MAX_RAYS];
+    auto testItem = [&](const Item& item, uint64_t mask)
+    {
+        const uint64_t hits = item.node->IntersectPacket(packet, mask, infos);
+        ForEachRay(hits, [&](int i)
+        {
+            if (infos[i].distance > closestDist[i] || (infos[i].distance == closestDist[i] && item.order > closestOrder[i]))
+                return;
+
+            outNodes[i] = item.node;
+            closestOrder[i] = item.order;
+            closestDist[i] = infos[i].distance;
+            outInfos[i] = infos[i];
+        });
+    };
+
+    for (const Item& item: m_Unbounded)
+        testItem(item, packet.GetMask());
+
+    if (m_Tree.empty())
+        return;
+
+    // As in Intersect(), each ray skips the boxes farther than its closest hit so far. The closest hit doesn't depend
+    // on the order the boxes are visited in, so the packet goes nearest first by its first ray.
+    auto mayHoldCloser = [&](int i, double boxDist) { return boxDist < INF && boxDist <= closestDist[i]; };
+    struct StackEntry
+    {
+        int index;
+        uint64_t mask; //!< the rays which may hit the box
+        double dist[RayPacket::MAX_RAYS];
+    };
+    StackEntry stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+
+    auto testBox = [&](int index, uint64_t mask, StackEntry& outEntry)
+    {
+        const BBox& bbox = m_Tree[index].bbox;
+        outEntry.index = index;
+        outEntry.mask = 0;
+        if (!bbox.TestIntersect(packet))
+            return;
+
+        ForEachRay(mask, [&](int i)
+        {
+            outEntry.dist[i] = bbox.ClosestIntersection(packet[i]);
+            if (mayHoldCloser(i, outEntry.dist[i]))
+                outEntry.mask |= RayBit(i);
+        });
+    };
+
+    testBox(0, packet.GetMask(), stack[0]);
+    if (stack[0].mask)
+        stackSize = 1;
+
+    while (stackSize)
+    {
+        const StackEntry& entry = stack[--stackSize];
+        const int index = entry.index;
+        uint64_t mask = 0;
+        ForEachRay(entry.mask, [&](int i)
+        {
+            if (mayHoldCloser(i, entry.dist[i]))
+                mask |= RayBit(i);
+        });
+        if (!mask)
+            continue;
+
+        const TreeNode& treeNode = m_Tree[index];
+        if (treeNode.count)
+        {
+            for (int i = treeNode.first; i < treeNode.first + treeNode.count; ++i)
+            {
+                const BBox& bbox = m_Items[i].node->worldBBox;
+                if (!bbox.TestIntersect(packet))
+                    continue;
+
+                uint64_t itemMask = 0;
+                ForEachRay(mask, [&](int r)
+                {
+                    if (mayHoldCloser(r, bbox.ClosestIntersection(packet[r])))
+                        itemMask |= RayBit(r);
+                });
+                if (itemMask)
+                    testItem(m_Items[i], itemMask);
+            }
+            continue;
+        }
+
+        // (the entry's slot is reused from here on)
+        StackEntry& farChild = stack[stackSize];
+        StackEntry& nearChild = stack[stackSize + 1];
+        testBox(index + 1, mask, nearChild);
+        testBox(treeNode.right, mask, farChild);
+
+        int first = 0;
+        while (!(mask & RayBit(first)))
+            ++first;
+        const double nearDist = (nearChild.mask & RayBit(first)) ? nearChild.dist[first] : INF;
+        const double farDist = (farChild.mask & RayBit(first)) ? farChild.dist[first] : INF;
+        if (farDist < nearDist)
+            std::swap(nearChild, farChild);
+
+        if (farChild.mask)
+            ++stackSize;
+        if (nearChild.mask)
+        {
+            if (!farChild.mask)
+                std::swap(farChild, nearChild); // keep the stack contiguous
+            ++stackSize;
+        }
+    }
+}
+
+void SceneBVH::GetTransparency(const RayPacket& packet, uint64_t mask, const double* maxDistSqr,
+                               float* outTransparency) const
+{
+    ForEachRay(mask, [&](int i) { outTransparency[i] = 1.f; });
+
+    // the rays which an opaque node stops leave the packet
+    auto visitNode = [&](const Node* node, uint64_t rays)
+    {
+        IntersectionInfo infos[RayPacket::MAX_RAYS];
+        ForEachRay(node->IntersectPacket(packet, rays, infos), [&](int i)
+        {
+            if (Sqr(infos[i].distance) >= maxDistSqr[i])
+                return;
+
+            if (node->shadowTransparency == 0.f)
+            {
+                outTransparency[i] = 0.f;
+                mask &= ~RayBit(i);
+            }
+            else
+            {
+                outTransparency[i] *= node->shadowTransparency;
+            }
+        });
+    };
+
+    for (const Item& item: m_Unbounded)
+        if (mask)
+            visitNode(item.node, mask);
+
+    if (m_Tree.empty())
+        return;
+
+    // the boxes which the rays in mask may hit
+    auto testBox = [&](const BBox& bbox, uint64_t rays)
+    {
+        uint64_t result = 0;
+        if (bbox.TestIntersect(packet))
+            ForEachRay(rays, [&](int i)
+            {
+                if (bbox.TestIntersect(packet[i]))
+                    result |= RayBit(i);
+            });
+        return result;
+    };
+
+    struct StackEntry
+    {
+        int index;
+        uint64_t mask;
+    };
+    StackEntry stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+    const uint64_t rootMask = testBox(m_Tree[0].bbox, mask);
+    if (rootMask)
+        stack[stackSize++] = {0, rootMask};
+
+    // depth-first, left child first, like GetTransparency(ray)
+    while (stackSize)
+    {
+        const StackEntry entry = stack[--stackSize];
+        const uint64_t rays = entry.mask & mask;
+        if (!rays)
+            continue;
+
+        const TreeNode& treeNode = m_Tree[entry.index];
+        if (treeNode.count)
+        {
+            for (int i = treeNode.first; i < treeNode.first + treeNode.count; ++i)
+            {
+                const uint64_t itemRays = testBox(m_Items[i].node->worldBBox, rays & mask);
+                if (itemRays)
+                    visitNode(m_Items[i].node, itemRays);
+            }
+            continue;
+        }
+
+        const uint64_t rightRays = testBox(m_Tree[treeNode.right].bbox, rays);
+        const uint64_t leftRays = testBox(m_Tree[entry.index + 1].bbox, rays);
+        if (rightRays)
+            stack[stackSize++] = {treeNode.right, rightRays};
+        if (leftRays)
+            stack[stackSize++] = {entry.index + 1, leftRays};
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef RAYTRACING_SCENEBVH_H
+#define RAYTRACING_SCENEBVH_H
+
+#include "bbox.h"
+#include "raypacket.h"
+
+#include <vector>
+
+struct IntersectionInfo;
+struct Node;
+
+/**
+ * @class SceneBVH
+ * @brief a bounding volume hierarchy over the scene's nodes (their world-space boxes)
+ *
+ * This is the top level only: the geometries keep their own structures (e.g. the mesh K-d trees), which are built
+ * once, in object space, and aren't touched when the nodes move. When they do, the tree isn't rebuilt, but refitted:
+ * the leaves take the nodes' new boxes and every inner box is recomputed from its children. A refitted tree only
+ * gets looser, so its SAH cost is compared to the one it had when built, and once it has degraded enough, the tree
+ * is built anew.
+ */
+class SceneBVH
+{
+public:
+    static constexpr double REBUILD_COST_RATIO = 1.3; //!< rebuild when the refitted tree costs this much more than when built
+
+    void Build(const std::vector<Node*>& nodes); //!< builds the tree from the nodes' current worldBBox
+    void Refit();                                //!< updates all the boxes, bottom-up, keeping the tree's topology
+
+    /// brings the tree up to date with the nodes' current boxes: refits it (if any node is animated), or rebuilds
+    /// it, if it's not built for these nodes or the refit made it too slow
+    void Update(const std::vector<Node*>& nodes);
+
+    /// finds the closest intersection along the ray. Returns the node hit, or nullptr if there's none.
+    /// Among equally distant hits, the node given first wins (same as testing them in order).
+    const Node* Intersect(const Ray& ray, IntersectionInfo& outInfo) const;
+
+    /// Intersect() for each ray of the packet (outNodes[i] and outInfos[i] being the result of the i-th). The packet
+    /// goes through the tree together, so a box which none of its rays can hit is rejected with a single test.
+    void IntersectPacket(const RayPacket& packet, const Node** outNodes, IntersectionInfo* outInfos) const;
+
+    /// the light a shadow ray lets through, on its way to maxDistSqr (squared): the product of the shadowTransparency
+    /// of the nodes it hits before that. An opaque one ends the search: 0 is returned, and the node (with the
+    /// primitive hit) is given in outOccluder and outPrimitive, which are left alone otherwise.
+    float GetTransparency(const Ray& ray, double maxDistSqr, const Node*& outOccluder, int& outPrimitive) const;
+
+    /// GetTransparency() for the rays of the packet in mask, together (outTransparency[i] being the i-th's). Each ray
+    /// sees the nodes in the same order as on its own, so the results are the same.
+    void GetTransparency(const RayPacket& packet, uint64_t mask, const double* maxDistSqr, float* outTransparency) const;
+
+    /// the box around all the bounded nodes (empty, if there are none)
+    BBox GetBounds() const;
+
+    /// the expected cost of tracing a ray through the tree (by the surface area heuristic), in units of box tests
+    double GetCost() const;
+
+    int GetNumBuilds() const { return m_NumBuilds; }
+    int GetNumRefits() const { return m_NumRefits; }
+
+private:
+    struct Item
+    {
+        Node* node;
+        int order;       //!< the node's index in the list given to Build(); breaks distance ties
+        Vector centroid; //!< of the node's box, when the tree was built
+    };
+
+    /// the nodes of the tree are stored in depth-first order: the left child follows its parent, so any node's
+    /// children are after it, and the boxes can be refitted in a single backward pass
+    struct TreeNode
+    {
+        BBox bbox;
+        int first = 0;  //!< leaves: the first item
+        int count = 0;  //!< leaves: the number of items; 0 for inner nodes
+        int right = 0;  //!< inner nodes: the right child (the left one is the next node)
+    };
+
+    std::vector<Item> m_Items;      //!< the bounded nodes, in the tree's leaf order
+    std::vector<Item> m_Unbounded;  //!< nodes without a box (e.g. infinite planes) - tested by every ray
+    std::vector<TreeNode> m_Tree;
+    std::vector<Node*> m_Nodes;     //!< what the tree was built for
+    bool m_HasAnimatedNodes = false;
+    double m_BuildCost = 0;
+    int m_NumBuilds = 0;
+    int m_NumRefits = 0;
+
+    int BuildSubtree(int first, int count, int depth);
+    void UpdateLeafBBox(TreeNode& leaf) const;
+};
+
+#endif //RAYTRACING_SCENEBVH_H
@@ -1,8 +1,15 @@
 #include "sdl.h"
 #include "camera.h"
 #include "bitmap.h"
+#include "scene.h"
+#include "utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <SDL.h>
 
 SDL_Surface* screen = nullptr;
@@ -11,6 +18,29 @@ SDL_mutex* renderLock;
 volatile bool rendering = false;
 bool renderAsync;
 bool wantToQuit = false;
+const Framebuffer* displayedVFB = nullptr; // the last one displayed; used for screenshots
+
+/// a rectangle of a framebuffer, waiting to be shown
+struct DisplayItem
+{
+    Rect r;
+    const Framebuffer* vfb;
+    bool useSRGB;
+    DisplayItem* next;
+};
+
+// The render threads don't draw on the screen themselves: DisplayVFBRect() pushes the rectangle on displayQueue,
+// and the display thread takes all that's there at once, and draws them, holding renderLock (which the main thread
+// holds while it handles the SDL events). Pushing is a compare-and-swap of the list's head, and taking is an exchange,
+// so the render threads never wait for the display, nor for each other.
+std::atomic<DisplayItem*> displayQueue{nullptr};
+std::atomic<int> displayPending{0}; // pushed, but not drawn yet
+std::atomic<bool> displayRunning{false};
+SDL_Thread* displayThread = nullptr;
+const Uint32 DISPLAY_POLL_MS = 5;
+
+static void StartDisplayThread();
+static void StopDisplayThread();
 
 bool InitGraphics(int frameWidth, int frameHeight)
 {
@@ -27,23 +57,49 @@ bool InitGraphics(int frameWidth, int frameHeight)
         return false;
     }
 
+    renderLock = SDL_CreateMutex();
+    StartDisplayThread();
+
+    return true;
+}
+
+bool InitHeadless()
+{
+    if ( SDL_Init(SDL_INIT_TIMER) < 0 )
+    {
+        printf("Cannot initialize SDL: %s\n", SDL_GetError());
+        return false;
+    }
+
+    renderLock = SDL_CreateMutex();
     return true;
 }
 
 void CloseGraphics()
 {
+    StopDisplayThread();
+    SDL_DestroyMutex(renderLock);
+    renderLock = nullptr;
     SDL_Quit();
 }
 
-void DisplayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE], bool useSRGB)
+void DisplayVFB(const Framebuffer& vfb, bool useSRGB)
 {
+    MutexRAII raii(renderLock);
+
+    displayedVFB = &vfb;
+    if (!screen)
+        return;
+
     int redShift = screen->format->Rshift;
     int greenShift = screen->format->Gshift;
     int blueShift = screen->format->Bshift;
-    for ( int y = 0; y < screen->h; ++y )
+    const int width = std::min(screen->w, vfb.GetWidth());
+    const int height = std::min(screen->h, vfb.GetHeight());
+    for ( int y = 0; y < height; ++y )
     {
         Uint32* row = (Uint32*)((Uint8*) screen->pixels + y*screen->pitch);
-        for ( int x = 0; x < screen->w; ++x )
+        for ( int x = 0; x < width; ++x )
             row[x] = useSRGB ? vfb[y][x].toSRGB32(redShift, greenShift, blueShift)
                              : vfb[y][x].toRGB32(redShift, greenShift, blueShift);
     }
@@ -75,13 +131,11 @@ void FindUnusedFilename(char filename[], const char* suffix)
     sprintf(filename, "quad_damage_%04d.%s", index, suffix);
 }
 
-bool TakeScreenshot(const char* filename)
+bool TakeScreenshot(const Framebuffer& vfb, const char* filename)
 {
-    extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
-
     Bitmap bmp;
-    const unsigned width = static_cast<unsigned>(GetFrameWidth());
-    const unsigned height = static_cast<unsigned>(GetFrameHeight());
+    const unsigned width = static_cast<unsigned>(vfb.GetWidth());
+    const unsigned height = static_cast<unsigned>(vfb.GetHeight());
     bmp.GenerateEmptyImage(width, height);
     for (unsigned y = 0; y < height; ++y)
         for (unsigned x = 0; x < width; ++x)
@@ -95,9 +149,12 @@ bool TakeScreenshot(const char* filename)
 
 bool TakeScreenshotAuto(Bitmap::OutputFormat format)
 {
+    if (!displayedVFB)
+        return false;
+
     char filename[256];
     FindUnusedFilename(filename, format == Bitmap::OutputFormat::BMP ? "bmp" : "exr");
-    return TakeScreenshot(filename);
+    return TakeScreenshot(*displayedVFB, filename);
 }
 
 static void HandleEvent(SDL_Event& event)
@@ -161,6 +218,9 @@ int GetFrameHeight()
 
 void SetWindowCaption(const char* msg, float renderTime)
 {
+    if (!screen)
+        return;
+
     if (renderTime >= 0.f)
     {
         char message[128];
@@ -173,23 +233,16 @@ void SetWindowCaption(const char* msg, float renderTime)
     }
 }
 
-class MutexRAII
+MutexRAII::MutexRAII(SDL_mutex* mutex)
+: m_Mutex(mutex)
 {
-public:
-    MutexRAII(SDL_mutex* mutex)
-    : m_Mutex(mutex)
-    {
-        SDL_mutexP(m_Mutex);
-    }
-
-    ~MutexRAII()
-    {
-        SDL_mutexV(m_Mutex);
-    }
+    SDL_mutexP(m_Mutex);
+}
 
-private:
-    SDL_mutex* m_Mutex;
-};
+MutexRAII::~MutexRAII()
+{
+    SDL_mutexV(m_Mutex);
+}
 
 bool RenderScene_Threaded()
 {
@@ -228,53 +281,14 @@ bool RenderScene_Threaded()
     SDL_WaitThread(renderThread, nullptr);
     renderThread = nullptr;
 
+    // the window is up to date, when the render is done
+    while (displayPending > 0 && displayRunning)
+        SDL_Delay(1);
+
     renderAsync = false;
     return true;
 }
 
-Rect::Rect(int _x0, int _y0, int _x1, int _y1)
-: x0{_x0}
-, y0{_y0}
-, x1{_x1}
-, y1{_y1}
-{
-    w = x1 - x0;
-    h = y1 - y0;
-}
-
-void Rect::Clip(int maxX, int maxY)
-{
-    x1 = std::min(x1, maxX);
-    y1 = std::min(y1, maxY);
-    w = std::max(0, x1 - x0);
-    h = std::max(0, y1 - y0);
-}
-
-std::vector<Rect> GetBucketList()
-{
-    std::vector<Rect> result;
-
-    const int bucket_size = 48;
-    int w = GetFrameWidth();
-    int h = GetFrameHeight();
-    int bw = (w - 1) / bucket_size + 1;
-    int bh = (h - 1) / bucket_size + 1;
-    for (int y = 0; y < bh; ++y)
-    {
-        if (y % 2 == 0)
-            for (int x = 0; x < bw; ++x)
-                result.push_back(Rect(x*bucket_size, y*bucket_size, (x + 1)*bucket_size, (y + 1)*bucket_size));
-        else
-            for (int x = bw - 1; x >= 0; --x)
-                result.push_back(Rect(x*bucket_size, y*bucket_size, (x + 1)*bucket_size, (y + 1)*bucket_size));
-    }
-
-    for (unsigned i = 0; i < result.size(); ++i)
-        result[i].Clip(w, h);
-
-    return result;
-}
-
 bool DrawRect(Rect r, const Color& c, bool useSRGB/* = false*/)
 {
     MutexRAII raii(renderLock);
@@ -282,6 +296,9 @@ bool DrawRect(Rect r, const Color& c, bool useSRGB/* = false*/)
     if (renderAsync && !rendering)
         return false;
 
+    if (!screen)
+        return true;
+
     r.Clip(GetFrameWidth(), GetFrameHeight());
 
     int rs = screen->format->Rshift;
@@ -299,14 +316,11 @@ bool DrawRect(Rect r, const Color& c, bool useSRGB/* = false*/)
     return true;
 }
 
-bool DisplayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE], bool useSRGB/* = false*/)
+/// draws the rectangle r of vfb on the screen; renderLock must be held
+static void BlitVFBRect(Rect r, const Framebuffer& vfb, bool useSRGB)
 {
-    MutexRAII raii(renderLock);
-
-    if (renderAsync && !rendering)
-        return false;
-
-    r.Clip(GetFrameWidth(), GetFrameHeight());
+    displayedVFB = &vfb;
+    r.Clip(std::min(GetFrameWidth(), vfb.GetWidth()), std::min(GetFrameHeight(), vfb.GetHeight()));
 
     int rs = screen->format->Rshift;
     int gs = screen->format->Gshift;
@@ -320,6 +334,85 @@ bool DisplayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE], bool useSRGB/
     }
 
     SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
+}
+
+/// draws the queued rectangles (in the order they were pushed)
+static void DrawDisplayQueue()
+{
+    DisplayItem* items = displayQueue.exchange(nullptr, std::memory_order_acquire);
+    if (!items)
+        return;
+
+    DisplayItem* ordered = nullptr;
+    while (items)
+    {
+        DisplayItem* next = items->next;
+        items->next = ordered;
+        ordered = items;
+        items = next;
+    }
+
+    MutexRAII raii(renderLock);
+    while (ordered)
+    {
+        DisplayItem* next = ordered->next;
+        BlitVFBRect(ordered->r, *ordered->vfb, ordered->useSRGB);
+        delete ordered;
+        ordered = next;
+        --displayPending;
+    }
+}
+
+static int DisplayThreadFunc(void*)
+{
+    while (displayRunning)
+    {
+        if (displayQueue.load(std::memory_order_relaxed))
+            DrawDisplayQueue();
+        else
+            SDL_Delay(DISPLAY_POLL_MS);
+    }
+    return 0;
+}
+
+static void StartDisplayThread()
+{
+    displayRunning = true;
+    displayThread = SDL_CreateThread(DisplayThreadFunc, nullptr);
+    if (displayThread == nullptr)
+        displayRunning = false; // DisplayVFBRect() draws by itself then
+}
+
+static void StopDisplayThread()
+{
+    if (!displayThread)
+        return;
+
+    displayRunning = false;
+    SDL_WaitThread(displayThread, nullptr);
+    displayThread = nullptr;
+    DrawDisplayQueue(); // whatever was left
+}
+
+bool DisplayVFBRect(Rect r, const Framebuffer& vfb, bool useSRGB/* = false*/)
+{
+    if (renderAsync && !rendering)
+        return false;
+
+    if (!screen)
+        return true;
+
+    if (!displayRunning)
+    {
+        MutexRAII raii(renderLock);
+        BlitVFBRect(r, vfb, useSRGB);
+        return true;
+    }
+
+    DisplayItem* item = new DisplayItem{r, &vfb, useSRGB, displayQueue.load(std::memory_order_relaxed)};
+    ++displayPending;
+    while (!displayQueue.compare_exchange_weak(item->next, item, std::memory_order_release, std::memory_order_relaxed))
+        ;
     return true;
 }
 
@@ -330,6 +423,9 @@ bool MarkRegion(Rect r, const Color& bracketColor/* = Colors::NAVY*/, bool useSR
     if (renderAsync && !rendering)
         return false;
 
+    if (!screen)
+        return true;
+
     r.Clip(GetFrameWidth(), GetFrameHeight());
 
     const int L = 8;
@@ -1,37 +1,47 @@
 #ifndef RAYTRACING_SDL_H
 #define RAYTRACING_SDL_H
 
+#include "buckets.h"
 #include "color.h"
 #include "colors.h"
 #include "constants.h"
+#include "framebuffer.h"
 
 #include <vector>
 
 extern volatile bool rendering; // used in main/worker thread synchronization
+extern bool wantToQuit; // the user closed the window (or pressed Esc)
 
 bool InitGraphics(int frameWidth, int frameHeight);
+bool InitHeadless(); //!< for rendering without a window; the display functions do nothing
 void CloseGraphics();
-void DisplayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE], bool useSRGB = false);
+void DisplayVFB(const Framebuffer& vfb, bool useSRGB = false);
 void WaitForUserExit();
+bool TakeScreenshot(const Framebuffer& vfb, const char* filename);
 int GetFrameWidth();
 int GetFrameHeight();
 void SetWindowCaption(const char* msg, float renderTime = -1.f);
 
 bool RenderScene_Threaded();
 
-struct Rect
+struct SDL_mutex;
+
+/// locks an SDL mutex for the lifetime of the object
+class MutexRAII
 {
-    int x0, y0, x1, y1, w, h;
+public:
+    MutexRAII(SDL_mutex* mutex);
+    ~MutexRAII();
 
-    Rect() {}
-    Rect(int _x0, int _y0, int _x1, int _y1);
+    MutexRAII(const MutexRAII&) = delete;
+    MutexRAII& operator = (const MutexRAII&) = delete;
 
-    void Clip(int maxX, int maxY); // clips the rectangle against image size
+private:
+    SDL_mutex* m_Mutex;
 };
 
-std::vector<Rect> GetBucketList();
 bool DrawRect(Rect r, const Color& c, bool useSRGB = false);
-bool DisplayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE], bool useSRGB = false);
+bool DisplayVFBRect(Rect r, const Framebuffer& vfb, bool useSRGB = false);
 bool MarkRegion(Rect r, const Color& bracketColor = Colors::NAVY, bool useSRGB = false);
 
 #endif //RAYTRACING_SDL_H
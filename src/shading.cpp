@@ -1,24 +1,129 @@
 #include "shading.h"
 
 #include "colors.h"
+#include "irradiancecache.h"
 #include "light.h"
+#include "random_generator.h"
+#include "sampler.h"
 #include "shadinghelper.h"
 #include "texture.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cstring>
 
-Color Lambert::Shade(const Ray& ray, const IntersectionInfo& info) const
+static const int GLOSSY_MIN_SAMPLES = 4; //!< an adaptive glossy reflection takes these, before it judges its noise
+
+static std::atomic<unsigned long long> g_SecondaryRays{0};
+static std::atomic<unsigned long long> g_CutOffRays{0};
+static std::atomic<unsigned long long> g_RouletteKilledRays{0};
+static std::atomic<unsigned long long> g_OverBudgetRays{0};
+
+/// the counts of this thread's secondary rays (added to the totals when it ends)
+struct PathStatistics
+{
+    unsigned long long rays = 0;
+    unsigned long long cutOff = 0;
+    unsigned long long killed = 0;
+    unsigned long long overBudget = 0;
+
+    ~PathStatistics()
+    {
+        g_SecondaryRays += rays;
+        g_CutOffRays += cutOff;
+        g_RouletteKilledRays += killed;
+        g_OverBudgetRays += overBudget;
+    }
+};
+
+static thread_local PathStatistics pathStatistics;
+
+Color SecondaryRays::Trace(const Ray& ray, const Color& factor, double share)
+{
+    // (the branch is taken even for a ray which isn't traced, so the shader's next numbers don't depend on it)
+    Sampler& sampler = GetSampler();
+    const Sampler::State branch = sampler.Branch();
+
+    Ray traced = ray;
+    traced.throughput = m_Weight*factor;
+    traced.share = ray.share * share;
+    const GlobalSettings& settings = scene.settings;
+    const double contribution = std::max({traced.throughput.r, traced.throughput.g, traced.throughput.b}) / traced.share;
+    ++pathStatistics.rays;
+    if (ray.depth > settings.maxTraceDepth || contribution <= 0)
+        return Color(0, 0, 0);
+
+    if (contribution < settings.minThroughput)
+    {
+        ++pathStatistics.cutOff;
+        return Color(0, 0, 0);
+    }
+
+    if (m_Budget < 1)
+    {
+        ++pathStatistics.overBudget;
+        return Color(0, 0, 0);
+    }
+    traced.budget = m_Budget - 1;
+
+    const Sampler::State parent = sampler.GetState();
+    sampler.SetState(branch);
+
+    Color scale = factor;
+    if (ray.depth >= settings.rouletteDepth && contribution < settings.rouletteThreshold)
+    {
+        const float survival = float(contribution / settings.rouletteThreshold);
+        if (sampler.Get1D() >= survival)
+        {
+            ++pathStatistics.killed;
+            sampler.SetState(parent);
+            return Color(0, 0, 0);
+        }
+        traced.throughput /= survival;
+        scale /= survival;
+    }
+
+    m_Budget = 0; // (the ray took all of it)
+    const Color result = TraceRay(traced, scale);
+    sampler.SetState(parent);
+    return result;
+}
+
+unsigned long long SecondaryRays::GetNumRays()
+{
+    return g_SecondaryRays + pathStatistics.rays;
+}
+
+void SecondaryRays::PrintStatistics()
+{
+    const unsigned long long rays = g_SecondaryRays + pathStatistics.rays;
+    const unsigned long long cutOff = g_CutOffRays + pathStatistics.cutOff;
+    const unsigned long long killed = g_RouletteKilledRays + pathStatistics.killed;
+    const unsigned long long overBudget = g_OverBudgetRays + pathStatistics.overBudget;
+    if (cutOff + killed + overBudget)
+        printf("Secondary rays: %llu, %llu cut off, %llu ended by Russian roulette, %llu over the ray budget (%.2lf%%)\n",
+               rays, cutOff, killed, overBudget, 100. * (cutOff + killed + overBudget) / rays);
+}
+
+Color Lambert::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
 {
     const Color diffuse = m_Texture ? m_Texture->Sample(info) : m_Color;
-    Color result = diffuse*scene.settings.ambientLight;
+
+    Color result = ShadingHelper::GetDiffuseIndirectLight(ray, info, diffuse, rays);
 
     for (const Light* light : scene.lights)
     {
-        const Vector lightDir = Normalize(info.ip - light->pos); // from light towards the intersection point
-        const Vector normal = Faceforward(lightDir, info.normal); // orient so that surface points to the light
-        const double lambertCoeff = Dot(normal, -lightDir);
-        const double lightContribution = ShadingHelper::GetLightContribution(info, *light);
-        result += diffuse*lambertCoeff*lightContribution;
+        const LightSample* samples;
+        const int numSamples = ShadingHelper::SampleLight(info, *light, samples);
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const Vector lightDir = Normalize(info.ip - samples[i].pos); // from light towards the intersection point
+            const Vector normal = Faceforward(lightDir, info.normal); // orient so that surface points to the light
+            const double lambertCoeff = Dot(normal, -lightDir);
+            const double weight = ShadingHelper::GetLightSampleWeight(ray, info, samples[i]);
+            result += diffuse*lambertCoeff*samples[i].contribution*weight;
+        }
     }
 
     return result;
@@ -39,9 +144,9 @@ void Lambert::FillProperties(ParsedBlock& pb)
     pb.GetTextureProp("texture", &m_Texture);
 }
 
-double Phong::GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Light& light) const
+double Phong::GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Vector& lightPos) const
 {
-    const Vector lightDir = Normalize(info.ip - light.pos); // from light towards the intersection point
+    const Vector lightDir = Normalize(info.ip - lightPos); // from light towards the intersection point
     const Vector normal = Faceforward(lightDir, info.normal); // orient so that the surface points to the light
     const Vector reflection = Reflect(lightDir, normal);
     const double cosGamma = Dot(-ray.dir, reflection);
@@ -49,20 +154,28 @@ double Phong::GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, con
     return result;
 }
 
-Color Phong::Shade(const Ray& ray, const IntersectionInfo& info) const
+Color Phong::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
 {
     const Color diffuse = m_Texture ? m_Texture->Sample(info) : m_Color;
-    Color result = diffuse*scene.settings.ambientLight;
+
+    // in GI, only the diffuse part gets the indirect light
+    Color result = ShadingHelper::GetDiffuseIndirectLight(ray, info, diffuse, rays);
 
     for (const Light* light : scene.lights)
     {
-        const Vector lightDir = Normalize(info.ip - light->pos); // from light towards the intersection point
-        const Vector normal = Faceforward(lightDir, info.normal); // orient so that the surface points to the light
-        const double lambertCoeff = Dot(normal, -lightDir);
-        const double lightContribution = ShadingHelper::GetLightContribution(info, *light);
-        const double specularCoeff = GetSpecularCoeff(ray, info, *light);
-        result += diffuse*lambertCoeff*lightContribution
-                  + Color{1.f, 1.f, 1.f}*specularCoeff*m_SpecularMultiplier*lightContribution;
+        const LightSample* samples;
+        const int numSamples = ShadingHelper::SampleLight(info, *light, samples);
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const Vector lightDir = Normalize(info.ip - samples[i].pos); // from light towards the intersection point
+            const Vector normal = Faceforward(lightDir, info.normal); // orient so that the surface points to the light
+            const double lambertCoeff = Dot(normal, -lightDir);
+            const double lightContribution = samples[i].contribution;
+            const double specularCoeff = GetSpecularCoeff(ray, info, samples[i].pos);
+            const double diffuseWeight = ShadingHelper::GetLightSampleWeight(ray, info, samples[i]);
+            result += diffuse*lambertCoeff*lightContribution*diffuseWeight
+                      + Color{1.f, 1.f, 1.f}*specularCoeff*m_SpecularMultiplier*lightContribution;
+        }
     }
 
     return result;
@@ -90,36 +203,59 @@ void Phong::FillProperties(ParsedBlock& pb)
     pb.GetDoubleProp("specularExponent", &m_SpecularExponent);
 }
 
-double BlinnPhong::GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Light& light) const
+double BlinnPhong::GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Vector& lightPos) const
 {
-    Vector lightDir = Normalize(light.pos - info.ip);
+    Vector lightDir = Normalize(lightPos - info.ip);
     Vector halfwayDir = Normalize(lightDir - ray.dir);
     double dot = Dot(info.normal, halfwayDir);
     double result = pow(std::max(dot, 0.), m_SpecularExponent);
     return result;
 }
 
-Color OrenNayar::Shade(const Ray& ray, const IntersectionInfo& info) const
+Color OrenNayar::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
 {
     // http://mimosa-pudica.net/improved-oren-nayar.html
     const Color diffuse = m_Texture ? m_Texture->Sample(info) : m_Color;
-    Color result = diffuse*scene.settings.ambientLight;
-
     const double sigma2 = Sqr(m_Sigma);
-    const double VdotN = Dot(-ray.dir, info.normal);
-    for (const Light* light : scene.lights)
+    const double a = 1 - 0.5 * sigma2 / (sigma2 + 0.33);
+    const double b = 0.45 * sigma2 / (sigma2 + 0.09);
+
+    Color result;
+    if (scene.settings.gi && !IrradianceCache::IsUsedFor(ray))
     {
-        const Vector lightDir = Normalize(light->pos - info.ip);
-        const double LdotV = Dot(lightDir, -ray.dir);
-        const double LdotN = Dot(lightDir, info.normal);
+        // the ray is cosine-distributed, like for a Lambert surface, so it's weighted by what's left of the coefficient
+        const Ray diffuseRay = ShadingHelper::GenerateDiffuseRay(ray, info);
+        const Vector normal = Faceforward(ray.dir, info.normal);
+        const double LdotV = Dot(diffuseRay.dir, -ray.dir);
+        const double LdotN = Dot(diffuseRay.dir, normal);
+        const double VdotN = Dot(-ray.dir, normal);
         const double s = LdotV - LdotN*VdotN;
         const double t = (s <= 0. ? 1. : std::max(LdotN, VdotN));
-        const double a = 1 - 0.5 * sigma2 / (sigma2 + 0.33);
-        const double b = 0.45 * sigma2 / (sigma2 + 0.09);
+        result = rays.Trace(diffuseRay, diffuse*float(a + b*s/t)) + ShadingHelper::GetCaustics(ray, info, diffuse);
+    }
+    else
+    {
+        // (the irradiance cache has the light of a Lambert surface)
+        result = ShadingHelper::GetDiffuseIndirectLight(ray, info, diffuse, rays);
+    }
 
-        const double orenNayarCoeff = LdotN*(a + b*s/t);
-        const double lightContribution = ShadingHelper::GetLightContribution(info, *light);
-        result += diffuse*orenNayarCoeff*lightContribution;
+    const double VdotN = Dot(-ray.dir, info.normal);
+    for (const Light* light : scene.lights)
+    {
+        const LightSample* samples;
+        const int numSamples = ShadingHelper::SampleLight(info, *light, samples);
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const Vector lightDir = Normalize(samples[i].pos - info.ip);
+            const double LdotV = Dot(lightDir, -ray.dir);
+            const double LdotN = Dot(lightDir, info.normal);
+            const double s = LdotV - LdotN*VdotN;
+            const double t = (s <= 0. ? 1. : std::max(LdotN, VdotN));
+
+            const double orenNayarCoeff = LdotN*(a + b*s/t);
+            const double weight = ShadingHelper::GetLightSampleWeight(ray, info, samples[i]);
+            result += diffuse*orenNayarCoeff*samples[i].contribution*weight;
+        }
     }
 
     return result;
@@ -151,52 +287,121 @@ Reflection::Reflection(double multiplier, double glossiness, int samples)
 {
 }
 
-extern Color Raytrace(const Ray& ray);
-Color Reflection::Shade(const Ray& ray, const IntersectionInfo& info) const
+Color Reflection::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
 {
     Vector n = Faceforward(ray.dir, info.normal);
 
     Color result(0, 0, 0);
-    if (m_Glossiness == 1)
+    if (IsMirror())
     {
         Ray newRay = ray;
         newRay.start = info.ip + n * 0.000001;
         newRay.dir = Reflect(ray.dir, n);
         newRay.depth++;
+        newRay.pdf = 0; // (a specular ray, which doesn't see the lights)
 
-        result = Raytrace(newRay) * m_Multiplier;
+        result = rays.Trace(newRay, Color(1, 1, 1) * m_Multiplier);
     }
     else
     {
+        // Adaptively (glossyNoiseThreshold), the samples are as many as the weight of the path warrants (a reflection
+        // seen at half the brightness needs a quarter of them, for the same noise in the pixel); where the light comes
+        // back right away, they stop early, once their error in the pixel is low enough, and leave the budget of the
+        // samples they didn't take to the rest of the tree
+        const GlobalSettings& settings = scene.settings;
+        const bool adaptive = settings.glossyNoiseThreshold > 0;
+        const double pathWeight = rays.GetWeight().Intensity();
         int count = ray.depth > 0 ? 2 : m_Samples;
-        for (int i = 0; i < count; ++i)
+        if (adaptive)
+            count = Clamp(int(ceil(m_Samples * Sqr(pathWeight))), 1, m_Samples);
+
+        // the samples share the budget; if it's short, there are fewer of them
+        const double budget = rays.GetBudget();
+        count = int(std::min(double(count), std::max(1., floor(budget))));
+
+        const int minCount = adaptive && rays.ReturnsLight() ? std::min(count, GLOSSY_MIN_SAMPLES) : count;
+        double intensityMean = 0;
+        double intensityM2 = 0; // (Welford's: the sum of squared differences from the mean)
+        // the samples are a prefix of the (0, 2)-sequence, so they are stratified against each other (as are the
+        // first ones, if they stop early); a random scramble per hit decorrelates the neighbouring pixels
+        Sampler& sampler = GetSampler();
+        const unsigned scrambleU = sampler.Get32Bits();
+        const unsigned scrambleV = sampler.Get32Bits();
+        int taken = 0;
+        while (taken < count)
         {
-            Vector a, b;
-            OrthonormalSystem(n, a, b);
-
             double x, y;
-            GenerateDiscPoint(x, y);
-
-            const double k = tan((1 - m_Glossiness) * PI / 2);
-            x *= k;
-            y *= k;
-
-            Vector modifiedNormal = n + a*x + b*y;
+            ConcentricDiscSample(VanDerCorput(taken, scrambleU), Sobol2(taken, scrambleV), x, y);
 
             Ray newRay = ray;
-            newRay.start = info.ip + n * 0.000001;
-            newRay.dir = Reflect(ray.dir, modifiedNormal);
-            newRay.depth++;
+            double weight;
+            Color sample(0, 0, 0);
+            rays.SetBudget(budget / count);
+            if (GetGlossyDir(ray.dir, n, x, y, newRay.dir, weight))
+            {
+                newRay.start = info.ip + n * 0.000001;
+                newRay.depth++;
+                newRay.pdf = 0;
 
-            result += Raytrace(newRay) * m_Multiplier;
+                sample = rays.Trace(newRay, Color(1, 1, 1) * (m_Multiplier * weight / count), 1. / count);
+            }
+            result += sample;
+            ++taken;
+
+            // the standard error of the samples' mean, as it shows in the pixel
+            const double intensity = sample.Intensity() * count * pathWeight;
+            const double delta = intensity - intensityMean;
+            intensityMean += delta / taken;
+            intensityM2 += delta * (intensity - intensityMean);
+            if (taken >= minCount && taken < count && taken > 1 &&
+                sqrt(intensityM2 / ((taken - 1) * double(taken))) <= settings.glossyNoiseThreshold)
+                break;
         }
+        rays.SetBudget(taken < count ? budget / count * (count - taken) : 0);
 
-        result /= count;
+        // (each sample was weighted for all `count' of them)
+        result = result * (float(count) / taken);
     }
 
     return result;
 }
 
+bool Reflection::ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const
+{
+    const Vector n = Faceforward(photon.dir, info.normal);
+    outPhoton = photon;
+    double weight = 1;
+    if (IsMirror())
+        outPhoton.dir = Reflect(photon.dir, n);
+    else
+    {
+        // (one of the directions Shade() spreads its rays over)
+        double x, y;
+        rng.UnitDiscSample(x, y);
+        if (!GetGlossyDir(photon.dir, n, x, y, outPhoton.dir, weight))
+            return false;
+    }
+
+    outPhoton.start = info.ip + n * 0.000001;
+    outPhoton.depth++;
+    outFilter = Color(1, 1, 1) * float(m_Multiplier * weight);
+    return Dot(outPhoton.dir, n) > 0;
+}
+
+bool Reflection::GetGlossyDir(const Vector& dir, const Vector& n, double x, double y, Vector& outDir,
+                              double& outWeight) const
+{
+    // the normal, tilted by the disc point, scaled to the glossiness
+    Vector a, b;
+    OrthonormalSystem(n, a, b);
+
+    const double k = tan((1 - m_Glossiness) * PI / 2);
+    outDir = Reflect(dir, n + a*(x*k) + b*(y*k));
+    outWeight = 1;
+    return true;
+}
+
 void Reflection::FillProperties(ParsedBlock& pb)
 {
     pb.GetDoubleProp("multiplier", &m_Multiplier);
@@ -204,27 +409,90 @@ void Reflection::FillProperties(ParsedBlock& pb)
     pb.GetIntProp("numSamples", &m_Samples, 1);
 }
 
+GGXReflection::GGXReflection(double multiplier, double roughness, int samples)
+: Reflection(multiplier, 1., samples)
+, m_Roughness(roughness)
+{
+}
+
+/// Smith's Lambda of GGX, for a direction at the given (squared) tangent of the angle to the normal
+static double GGXLambda(double alpha, double tanSqr)
+{
+    return (sqrt(1 + Sqr(alpha) * tanSqr) - 1) / 2;
+}
+
+bool GGXReflection::GetGlossyDir(const Vector& dir, const Vector& n, double x, double y, Vector& outDir,
+                                 double& outWeight) const
+{
+    // the viewer, in the surface's frame
+    Vector a, b;
+    OrthonormalSystem(n, a, b);
+    const Vector view(-Dot(dir, a), -Dot(dir, b), -Dot(dir, n));
+    if (view.z <= 0)
+        return false;
+
+    // stretch the view to where the microfacets are a hemisphere; those it sees project to a disc (the half of it
+    // farther from the view, squeezed to the hemisphere's silhouette), which (x, y) picks a point of
+    const Vector stretched = Normalize(Vector(m_Roughness * view.x, m_Roughness * view.y, view.z));
+    const double lengthSqr = Sqr(stretched.x) + Sqr(stretched.y);
+    const Vector t1 = lengthSqr > 0 ? Vector(-stretched.y, stretched.x, 0) / sqrt(lengthSqr) : Vector(1, 0, 0);
+    const Vector t2 = stretched ^ t1;
+    const double s = 0.5 * (1 + stretched.z);
+    y = (1 - s) * sqrt(1 - x*x) + s * y;
+    const Vector hemisphereNormal = t1*x + t2*y + stretched * sqrt(std::max(0., 1 - x*x - y*y));
+
+    // and back to the microfacet normal
+    const Vector normal = Normalize(Vector(m_Roughness * hemisphereNormal.x, m_Roughness * hemisphereNormal.y,
+                                           std::max(0., hemisphereNormal.z)));
+    const Vector reflected = normal * (2 * Dot(view, normal)) - view;
+    if (reflected.z <= 0)
+        return false;
+
+    // its light is masked by G2 / G1, the rest of the BRDF cancels out with the density it was picked with
+    const double viewLambda = GGXLambda(m_Roughness, (Sqr(view.x) + Sqr(view.y)) / Sqr(view.z));
+    const double reflectedLambda = GGXLambda(m_Roughness, (Sqr(reflected.x) + Sqr(reflected.y)) / Sqr(reflected.z));
+    outWeight = (1 + viewLambda) / (1 + viewLambda + reflectedLambda);
+    outDir = a*reflected.x + b*reflected.y + n*reflected.z;
+    return true;
+}
+
+void GGXReflection::FillProperties(ParsedBlock& pb)
+{
+    pb.GetDoubleProp("multiplier", &m_Multiplier);
+    pb.GetIntProp("numSamples", &m_Samples, 1);
+
+    // the disc of a Reflection's glossiness reaches the slope k, with its median at k/sqrt(2); GGX's is at alpha
+    double glossiness;
+    if (pb.GetDoubleProp("glossiness", &glossiness, 0., 1.))
+        m_Roughness = std::min(1., tan((1 - glossiness) * PI / 2) / sqrt(2.));
+    pb.GetDoubleProp("roughness", &m_Roughness, 0., 1.);
+}
+
 Refraction::Refraction(double inOutRatio, double multiplier)
 : m_InOutRatio(inOutRatio)
 , m_Multiplier(multiplier)
 {
 }
 
-Color Refraction::Shade(const Ray& ray, const IntersectionInfo& info) const
+/// the direction of the ray, refracted through the surface with the given ior (0, if it's reflected totally)
+static Vector GetRefractedDir(const Vector& dir, const Vector& normal, double ior)
 {
     // ior = eta2 / eta1
-    Vector refraction;
-    if (Dot(ray.dir, info.normal) < 0.)
+    if (Dot(dir, normal) < 0.)
     {
         // entering the geometry
-        refraction = Refract(ray.dir, info.normal, 1 / m_InOutRatio);
+        return Refract(dir, normal, 1 / ior);
     }
     else
     {
         // leaving the geometry
-        refraction = Refract(ray.dir, -info.normal, m_InOutRatio);
+        return Refract(dir, -normal, ior);
     }
+}
 
+Color Refraction::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
+{
+    const Vector refraction = GetRefractedDir(ray.dir, info.normal, m_InOutRatio);
     if (refraction.LengthSqr() == 0)
         return Colors::RED; // to debug easy
 
@@ -232,9 +500,25 @@ Color Refraction::Shade(const Ray& ray, const IntersectionInfo& info) const
     newRay.start = info.ip - Faceforward(ray.dir, info.normal) * 0.000001;
     newRay.dir = refraction;
     newRay.depth++;
+    newRay.pdf = 0;
 
-    const Color& color = Raytrace(newRay) * m_Multiplier;
-    return color;
+    return rays.Trace(newRay, Color(1, 1, 1) * m_Multiplier);
+}
+
+bool Refraction::ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const
+{
+    // (a totally reflected photon ends, like the camera rays, which Shade() doesn't follow either)
+    const Vector refraction = GetRefractedDir(photon.dir, info.normal, m_InOutRatio);
+    if (refraction.LengthSqr() == 0)
+        return false;
+
+    outPhoton = photon;
+    outPhoton.start = info.ip - Faceforward(photon.dir, info.normal) * 0.000001;
+    outPhoton.dir = refraction;
+    outPhoton.depth++;
+    outFilter = Color(1, 1, 1) * m_Multiplier;
+    return true;
 }
 
 void Refraction::FillProperties(ParsedBlock& pb)
@@ -257,25 +541,129 @@ void Layered::AddLayer(Shader* shader, Color blend, Texture* texture)
     ++m_NumLayers;
 }
 
-Color Layered::Shade(const Ray& ray, const IntersectionInfo& info) const
+void Layered::GetLayerWeights(const IntersectionInfo& info, Color* outBlendAmounts, Color* outWeights) const
 {
-    Color result(0, 0, 0);
     for (unsigned i = 0; i < m_NumLayers; ++i)
     {
-        const Layer& layer = m_Layers[i];
-        Color fromLayer = layer.m_Shader->Shade(ray, info);
-        Color blendAmount = layer.m_Blend;
-        if (layer.m_Texture)
-            blendAmount *= layer.m_Texture->Sample(info);
+        outBlendAmounts[i] = m_Layers[i].m_Blend;
+        if (m_Layers[i].m_Texture)
+            outBlendAmounts[i] *= m_Layers[i].m_Texture->Sample(info);
+    }
+
+    // each layer ends up multiplied by its blend amount, and by (1 - blend amount) of all the layers above it
+    Color above = Colors::WHITE;
+    for (unsigned i = m_NumLayers; i-- > 0;)
+    {
+        outWeights[i] = outBlendAmounts[i]*above;
+        above = (Colors::WHITE - outBlendAmounts[i])*above;
+    }
+}
+
+int Layered::PickLayer(const Color* weights, double u, double& outProbability) const
+{
+    double total = 0;
+    for (unsigned i = 0; i < m_NumLayers; ++i)
+        total += std::max(0.f, weights[i].Intensity());
+    if (total <= 0)
+        return -1;
+
+    double pick = u * total;
+    int picked = -1;
+    for (unsigned i = 0; i < m_NumLayers; ++i)
+    {
+        const double weight = weights[i].Intensity();
+        if (weight <= 0)
+            continue;
+
+        picked = int(i);
+        if (pick < weight)
+            break;
+        pick -= weight;
+    }
+
+    outProbability = weights[picked].Intensity() / total;
+    return picked;
+}
+
+Color Layered::Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const
+{
+    Color blendAmounts[MAX_LAYERS];
+    Color layerWeights[MAX_LAYERS];
+    GetLayerWeights(info, blendAmounts, layerWeights);
+
+    const Color weight = rays.GetWeight();
+    if (m_Stochastic)
+    {
+        // one layer stands for all of them, scaled by the inverse of its probability, so each hit spawns the rays of
+        // a single layer (and a tree of layered materials grows linearly with the depth, instead of exponentially)
+        double probability;
+        const int picked = PickLayer(layerWeights, GetSampler().Get1D(), probability);
+        if (picked < 0)
+            return Color(0, 0, 0);
+
+        const Color scale = layerWeights[picked] / float(probability);
+        rays.SetWeight(weight*scale);
+        const Color result = scale*m_Layers[picked].m_Shader->Shade(ray, info, rays);
+        rays.SetWeight(weight);
+        return result;
+    }
 
-        result = blendAmount*fromLayer + (Colors::WHITE - blendAmount)*result;
+    // the layers which show share the budget, and what one of them doesn't use goes to the ones after it (the
+    // others' rays have no weight, and aren't traced anyway)
+    double budget = rays.GetBudget();
+    unsigned numLeft = 0;
+    for (unsigned i = 0; i < m_NumLayers; ++i)
+        numLeft += std::max({layerWeights[i].r, layerWeights[i].g, layerWeights[i].b}) > 0;
+
+    Color result(0, 0, 0);
+    for (unsigned i = 0; i < m_NumLayers; ++i)
+    {
+        const double layerBudget = budget / std::max(numLeft, 1u);
+        rays.SetWeight(weight*layerWeights[i]);
+        rays.SetBudget(layerBudget);
+        Color fromLayer = m_Layers[i].m_Shader->Shade(ray, info, rays);
+        result = blendAmounts[i]*fromLayer + (Colors::WHITE - blendAmounts[i])*result;
+        if (std::max({layerWeights[i].r, layerWeights[i].g, layerWeights[i].b}) > 0)
+        {
+            --numLeft;
+            budget = (numLeft > 0 ? layerBudget * numLeft : 0) + rays.GetBudget();
+        }
     }
+    rays.SetWeight(weight);
+    rays.SetBudget(budget);
 
     return result;
 }
 
+bool Layered::ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                            Color& outFilter) const
+{
+    Color blendAmounts[MAX_LAYERS];
+    Color layerWeights[MAX_LAYERS];
+    GetLayerWeights(info, blendAmounts, layerWeights);
+
+    // the photon goes through one layer, picked by its weight, and is scaled back by the probability of that
+    double probability;
+    const int picked = PickLayer(layerWeights, rng.RandDouble(), probability);
+    if (picked < 0 || !m_Layers[picked].m_Shader->ScatterPhoton(photon, info, rng, outPhoton, outFilter))
+        return false;
+
+    outFilter *= layerWeights[picked] / float(probability);
+    return true;
+}
+
+bool Layered::SamplesLights() const
+{
+    for (unsigned i = 0; i < m_NumLayers; ++i)
+        if (m_Layers[i].m_Shader->SamplesLights())
+            return true;
+    return false;
+}
+
 void Layered::FillProperties(ParsedBlock& pb)
 {
+    pb.GetBoolProp("stochastic", &m_Stochastic);
+
     char name[128];
     char value[256];
     int srcLine;
@@ -8,15 +8,81 @@
 #include "vector.h"
 
 class IntersectionInfo;
+class Random;
 class Ray;
 class Texture;
 
+/**
+ * @class SecondaryRays
+ * @brief where the shaders send the rays they spawn (reflections, refractions)
+ *
+ * The recursive engine traces each ray right away, and returns the light it brings; the wavefront engine (see
+ * wavefront.h) queues it, to be traced with the rest of its generation, and returns black: the light is added to the
+ * pixel later, multiplied by the ray's throughput (the weight of the shader's result, times the factor).
+ *
+ * Rays which would bring little to the pixel are ended here, the same way for both engines: below
+ * minThroughput they aren't traced at all; below rouletteThreshold (from rouletteDepth on) they play Russian
+ * roulette, surviving with probability throughput / rouletteThreshold, and the survivors are scaled up by its
+ * inverse, so the expected result stays the same. The throughput they are judged by is the path's attenuation, without
+ * the shares of the samples it went through (see Trace()): one of a glossy reflection's 32 rays doesn't bring less
+ * light than a mirror's ray, it's only averaged with the others.
+ *
+ * The ray tree of a camera sample may also have a budget (rayBudget): each ray carries the number of rays the tree
+ * below it may still trace, and the shaders split that among the rays they send, so the whole tree stays within it.
+ */
+class SecondaryRays
+{
+public:
+    virtual ~SecondaryRays() = default;
+
+    /// returns factor times the light coming along ray (or black, if the ray is queued or ended), for the shader to
+    /// add to its result. A shader which averages several rays gives each its share (e.g. 1/count), which is already
+    /// in the factor.
+    Color Trace(const Ray& ray, const Color& factor, double share = 1);
+
+    /// the weight of the current shader's result in the pixel (the throughput of the ray it shades). A shader which
+    /// scales the results of other shaders (e.g. Layered) sets it for them, and restores it after.
+    const Color& GetWeight() const { return m_Weight; }
+    void SetWeight(const Color& weight) { m_Weight = weight; }
+
+    /// the budget of the shaded ray: how many rays may still be traced below it. Trace() gives the ray all of it (less
+    /// the ray itself; and doesn't trace it, if nothing is left), so a shader which sends several rays sets each one's
+    /// share before it. What's left after Shade() is what the shader didn't use (Layered gives it to the next layers).
+    double GetBudget() const { return m_Budget; }
+    void SetBudget(double budget) { m_Budget = budget; }
+
+    /// whether Trace() returns the light the rays bring (the recursive engine), so a shader can look at it before
+    /// sending more
+    virtual bool ReturnsLight() const { return false; }
+
+    static void PrintStatistics(); //!< prints how many secondary rays were ended early
+    static unsigned long long GetNumRays(); //!< the secondary rays so far (of the finished render threads, and this one)
+
+protected:
+    /// traces (or queues) a ray which wasn't ended, with its throughput set and the sampler at the ray's own branch
+    /// of the sample's numbers; returns as Trace()
+    virtual Color TraceRay(const Ray& ray, const Color& factor) =0;
+
+    Color m_Weight{1, 1, 1};
+    double m_Budget = INF;
+};
+
 class Shader : public SceneElement
 {
 public:
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const =0;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const =0;
     virtual ~Shader() =default;
 
+    /// whether Shade() samples the lights (the wavefront engine traces the shadow rays of such hits in packets).
+    /// Such shaders also get the caustics, so the photon map keeps the caustic photons which hit them.
+    virtual bool SamplesLights() const { return false; }
+
+    /// For the photon tracing (see PhotonMap): whether the surface scatters a photon, coming along `photon',
+    /// specularly (like a mirror or glass). If so, the photon goes on as outPhoton, its power multiplied by outFilter;
+    /// otherwise it ends there.
+    virtual bool ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const { return false; }
+
     virtual ElementType GetElementType() const override { return ElementType::SHADER; }
 };
 
@@ -25,7 +91,7 @@ class ConstColorShader : public Shader
 public:
     ConstColorShader (Color color = Colors::GRAY);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override { return m_Color; }
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override { return m_Color; }
     virtual void FillProperties(ParsedBlock& pb) override;
 
 private:
@@ -39,7 +105,8 @@ public:
     Lambert(const Color& color);
     Lambert(Texture* texture);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool SamplesLights() const override { return true; }
     virtual void FillProperties(ParsedBlock& pb) override;
 
 private:
@@ -54,11 +121,12 @@ public:
     Phong(const Color& color, double specularMultiplier = 1., double specularExponent = 1.);
     Phong(Texture* texture, double specularMultiplier = 1., double specularExponent = 1.);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool SamplesLights() const override { return true; }
     virtual void FillProperties(ParsedBlock& pb) override;
 
 protected:
-    virtual double GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Light& light) const;
+    virtual double GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Vector& lightPos) const;
 
     Color m_Color;
     Texture* m_Texture = nullptr;
@@ -72,7 +140,7 @@ public:
     using Phong::Phong;
 
 protected:
-    virtual double GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Light& light) const override;
+    virtual double GetSpecularCoeff(const Ray& ray, const IntersectionInfo& info, const Vector& lightPos) const override;
 };
 
 class OrenNayar : public Shader
@@ -82,7 +150,8 @@ public:
     OrenNayar(const Color& color, double sigma = 0.);
     OrenNayar(Texture* texture, double sigma = 0.);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool SamplesLights() const override { return true; }
     virtual void FillProperties(ParsedBlock& pb);
 
 private:
@@ -96,21 +165,59 @@ class Reflection : public Shader
 public:
     Reflection(double multiplier = 0.99, double glossiness = 1., int samples = 32);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const override;
     virtual void FillProperties(ParsedBlock& pb) override;
 
-private:
+protected:
+    virtual bool IsMirror() const { return m_Glossiness == 1; }
+
+    /// one of the directions a glossy reflection spreads its rays over, for the ray coming along dir to the surface
+    /// with normal n (turned to it), and a point (x, y) of the unit disc; outWeight is the factor of its light.
+    /// Returns false if there's no such ray.
+    virtual bool GetGlossyDir(const Vector& dir, const Vector& n, double x, double y, Vector& outDir,
+                              double& outWeight) const;
+
     double m_Multiplier = 0.99;
     double m_Glossiness = 1.;
     int m_Samples = 32;
 };
 
+/**
+ * @class GGXReflection
+ * @brief a glossy reflection with the GGX (Trowbridge-Reitz) microfacet distribution
+ *
+ * The rays go along the microfacet normals the viewer sees (Heitz, "Sampling the GGX Distribution of Visible
+ * Normals", 2018), so each brings its light with nearly the same weight: the Smith masking of the reflected direction
+ * (G2 / G1, height-correlated); the ones which the microfacets reflect under the surface are lost, as they should.
+ *
+ * The roughness is GGX's alpha; it may also be given as a Reflection's `glossiness', which maps to the roughness
+ * whose lobe has the same median spread (of the normals' slopes) as the Reflection's disc.
+ */
+class GGXReflection : public Reflection
+{
+public:
+    GGXReflection(double multiplier = 0.99, double roughness = 0.1, int samples = 8);
+
+    virtual void FillProperties(ParsedBlock& pb) override;
+
+protected:
+    virtual bool IsMirror() const override { return m_Roughness == 0; }
+    virtual bool GetGlossyDir(const Vector& dir, const Vector& n, double x, double y, Vector& outDir,
+                              double& outWeight) const override;
+
+    double m_Roughness = 0.1;
+};
+
 class Refraction : public Shader
 {
 public:
     Refraction(double inOutRatio = 1.33, double multiplier = 0.99);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const override;
     virtual void FillProperties(ParsedBlock& pb) override;
 
 private:
@@ -124,10 +231,22 @@ public:
     Layered();
     void AddLayer(Shader* shader, Color blend, Texture* texture = nullptr);
 
-    virtual Color Shade(const Ray& ray, const IntersectionInfo& info) const override;
+    virtual Color Shade(const Ray& ray, const IntersectionInfo& info, SecondaryRays& rays) const override;
+    virtual bool SamplesLights() const override;
+    virtual bool ScatterPhoton(const Ray& photon, const IntersectionInfo& info, Random& rng, Ray& outPhoton,
+                               Color& outFilter) const override;
     virtual void FillProperties(ParsedBlock& pb) override;
 
 private:
+    static const unsigned MAX_LAYERS = 32;
+
+    /// the blend amounts of the layers at the point, and the weights (of the layers' results) they add up to
+    void GetLayerWeights(const IntersectionInfo& info, Color* outBlendAmounts, Color* outWeights) const;
+
+    /// picks a layer (for u uniform in [0, 1)) with a probability proportional to its weight, given in outProbability.
+    /// Returns -1 if no layer has a positive weight.
+    int PickLayer(const Color* weights, double u, double& outProbability) const;
+
     struct Layer
     {
         Shader* m_Shader;
@@ -135,8 +254,9 @@ private:
         Texture* m_Texture;
     };
 
-    std::array<Layer, 32> m_Layers;
+    std::array<Layer, MAX_LAYERS> m_Layers;
     unsigned m_NumLayers = 0;
+    bool m_Stochastic = false; //!< shade one layer per hit, picked by its weight, instead of all of them
 };
 
 #endif //RAYTRACING_SHADING_H
@@ -1,23 +1,158 @@
 #include "shadinghelper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <vector>
 
 #include "geometry.h"
+#include "irradiancecache.h"
 #include "light.h"
+#include "photonmap.h"
+#include "sampler.h"
 #include "shading.h"
+#include "utils.h"
 
 extern std::vector<Node> g_Nodes;
 
-double ShadingHelper::GetLightContribution(const IntersectionInfo& info, const Light& light)
+static std::atomic<unsigned long long> g_OccluderCacheLookups{0};
+static std::atomic<unsigned long long> g_OccluderCacheHits{0};
+static std::atomic<unsigned long long> g_PacketShadowRays{0};
+static std::atomic<unsigned long long> g_ShadowPackets{0};
+
+/// Remembers, per light, the last opaque node (and its primitive) which blocked a shadow ray.
+/// Consecutive shading points usually get blocked by the same occluder, so testing it first
+/// often avoids the full traversal. It is kept per thread, so there's no locking.
+struct OccluderCache
+{
+    struct Entry
+    {
+        const Light* light;
+        const Node* node;
+        int primitive;
+    };
+
+    std::vector<Entry> entries;
+    unsigned long long lookups = 0;
+    unsigned long long hits = 0;
+
+    Entry& Get(const Light& light)
+    {
+        for (Entry& entry : entries)
+            if (entry.light == &light)
+                return entry;
+
+        entries.push_back({&light, nullptr, -1});
+        return entries.back();
+    }
+
+    ~OccluderCache()
+    {
+        // the thread is exiting, add its statistics to the totals
+        g_OccluderCacheLookups += lookups;
+        g_OccluderCacheHits += hits;
+    }
+};
+
+static thread_local OccluderCache occluderCache;
+
+/// the results of the last TraceShadowPackets() on this thread
+struct TracedShadows
 {
+    std::vector<const Light*> lights; //!< the single-sample ones
+    std::vector<Vector> starts;       //!< of the shadow rays, per point
+    std::vector<float> transparency;  //!< per point and light
+    int current = -1;                 //!< the point being shaded
+    unsigned long long rays = 0;
+    unsigned long long packets = 0;
+
+    /// the traced transparency of the light, if the shadow ray from start to it was traced in a packet
+    const float* Find(const Vector& start, const Light& light) const
+    {
+        if (current < 0)
+            return nullptr;
+
+        const Vector& traced = starts[current];
+        if (traced.x != start.x || traced.y != start.y || traced.z != start.z)
+            return nullptr;
+
+        for (size_t k = 0; k < lights.size(); ++k)
+            if (lights[k] == &light)
+                return &transparency[current*lights.size() + k];
+        return nullptr;
+    }
+
+    ~TracedShadows()
+    {
+        g_PacketShadowRays += rays;
+        g_ShadowPackets += packets;
+    }
+};
+
+static thread_local TracedShadows tracedShadows;
+
+int ShadingHelper::SampleLight(const IntersectionInfo& info, const Light& light, const LightSample*& outSamples)
+{
+    static thread_local LightSample samples[MAX_LIGHT_SAMPLES];
+    outSamples = samples;
+
     const Vector start = info.ip + info.normal*1e-6;
-    const float shadowTransparency = ShadingHelper::GetShadowTransparency(start, light.pos);
-    const double distanceToLightSqr = (info.ip - light.pos).LengthSqr();
-    const double lightContribution = shadowTransparency * light.intensity / distanceToLightSqr;
-    return lightContribution;
+    const int numSamples = light.GetNumSamples();
+    const int numProbes = std::min(light.GetNumProbeSamples(), numSamples);
+
+    // the samples are a prefix of the (0, 2)-sequence, so the probes are stratified on their own, as is the full set.
+    // A random scramble per shaded point decorrelates the neighbouring pixels.
+    unsigned scrambleU = 0;
+    unsigned scrambleV = 0;
+    if (numSamples > 1)
+    {
+        Sampler& sampler = GetSampler();
+        scrambleU = sampler.Get32Bits();
+        scrambleV = sampler.Get32Bits();
+    }
+
+    float transparency[MAX_LIGHT_SAMPLES];
+    double intensity[MAX_LIGHT_SAMPLES];
+    bool penumbra = false;
+    int taken = 0;
+    for (; taken < numSamples; ++taken)
+    {
+        if (taken == numProbes && !penumbra)
+            break; // all probes agree: fully lit or fully occluded
+
+        const int i = taken;
+        light.GetSample(VanDerCorput(i, scrambleU), Sobol2(i, scrambleV), info.ip, samples[i].pos, intensity[i]);
+        const float* traced = numSamples == 1 ? tracedShadows.Find(start, light) : nullptr;
+        if (intensity[i] <= 0)
+            transparency[i] = 0.f;
+        else
+            transparency[i] = traced ? *traced : ShadingHelper::GetShadowTransparency(start, samples[i].pos, light);
+        if (transparency[i] != transparency[0])
+            penumbra = true;
+    }
+
+    // (all samples are counted in the density, so the weights against the diffuse rays don't depend on the probing)
+    double pdf[MAX_LIGHT_SAMPLES];
+    for (int i = 0; i < taken; ++i)
+        pdf[i] = scene.settings.gi ? light.GetPdf(info.ip, samples[i].pos) * numSamples : 0.;
+
+    int visible = 0;
+    for (int i = 0; i < taken; ++i)
+    {
+        if (transparency[i] == 0.f)
+            continue;
+
+        const double distanceToLightSqr = (info.ip - samples[i].pos).LengthSqr();
+        samples[visible].pos = samples[i].pos;
+        samples[visible].contribution = transparency[i] * intensity[i] / (distanceToLightSqr * taken);
+        samples[visible].pdf = pdf[i];
+        ++visible;
+    }
+
+    return visible;
 }
 
-float ShadingHelper::GetShadowTransparency(const Vector& start, const Vector& end)
+float ShadingHelper::GetShadowTransparency(const Vector& start, const Vector& end, const Light& light)
 {
     Ray ray;
     ray.start = start;
@@ -25,16 +160,180 @@ float ShadingHelper::GetShadowTransparency(const Vector& start, const Vector& en
 
     const double targetDistSq = (end - start).LengthSqr();
 
-    float result = 1.f;
-    for (Node* node : scene.nodes)
+    OccluderCache::Entry& cached = occluderCache.Get(light);
+    ++occluderCache.lookups;
+    if (cached.node && cached.node->shadowTransparency == 0.f)
     {
         IntersectionInfo info;
-        if (!node->Intersect(ray, info))
-            continue;
-
-        if (Sqr(info.distance) < targetDistSq)
-            result *= node->shadowTransparency;
+        if (cached.node->IntersectPrimitive(ray, cached.primitive, info) && Sqr(info.distance) < targetDistSq)
+        {
+            ++occluderCache.hits;
+            return 0.f;
+        }
     }
 
+    // (only opaque occluders are cached; the semi-transparent ones don't end the search)
+    const Node* occluder = nullptr;
+    const float result = scene.bvh.GetTransparency(ray, targetDistSq, occluder, cached.primitive);
+    cached.node = occluder;
     return result;
 }
+
+/// the power heuristic, for one sample of each of the two strategies
+static double PowerHeuristic(double pdf, double otherPdf)
+{
+    return Sqr(pdf) / (Sqr(pdf) + Sqr(otherPdf));
+}
+
+Color ShadingHelper::GetDiffuseIndirectLight(const Ray& ray, const IntersectionInfo& info, const Color& diffuse,
+                                             SecondaryRays& rays)
+{
+    const Color caustics = GetCaustics(ray, info, diffuse);
+    if (!scene.settings.gi)
+        return diffuse*scene.settings.ambientLight + caustics;
+
+    if (IrradianceCache::IsUsedFor(ray))
+        return diffuse*irradianceCache.GetIrradiance(ray, info.ip, Faceforward(ray.dir, info.normal)) + caustics;
+
+    // (with the cosine-distributed ray, the cosine and the density cancel out, leaving the diffuse color)
+    return rays.Trace(GenerateDiffuseRay(ray, info), diffuse) + caustics;
+}
+
+Color ShadingHelper::GetCaustics(const Ray& ray, const IntersectionInfo& info, const Color& diffuse)
+{
+    if (photonMap.IsEmpty())
+        return Color(0, 0, 0);
+
+    return diffuse*photonMap.GetIrradiance(info.ip, Faceforward(ray.dir, info.normal));
+}
+
+Ray ShadingHelper::GenerateDiffuseRay(const Ray& ray, const IntersectionInfo& info)
+{
+    const Vector normal = Faceforward(ray.dir, info.normal);
+    double u, v;
+    GetSampler().Get2D(u, v);
+
+    Ray newRay = ray;
+    newRay.start = info.ip + normal*1e-6;
+    newRay.dir = CosineHemisphereSample(u, v, normal);
+    newRay.depth++;
+    newRay.pdf = std::max(Dot(newRay.dir, normal), 1e-9) / PI;
+    newRay.diffuse = true;
+    return newRay;
+}
+
+double ShadingHelper::GetLightSampleWeight(const Ray& ray, const IntersectionInfo& info, const LightSample& sample)
+{
+    if (sample.pdf <= 0 || IrradianceCache::IsUsedFor(ray))
+        return 1.;
+
+    // the density of GenerateDiffuseRay() picking the sample's direction
+    const Vector normal = Faceforward(ray.dir, info.normal);
+    const double bsdfPdf = std::max(Dot(Normalize(sample.pos - info.ip), normal), 0.) / PI;
+    return PowerHeuristic(sample.pdf, bsdfPdf);
+}
+
+bool ShadingHelper::HitLight(const Ray& ray, double maxDist, Color& outLight)
+{
+    if (ray.pdf <= 0)
+        return false;
+
+    const Light* hitLight = nullptr;
+    double radiance = 0;
+    for (const Light* light : scene.lights)
+    {
+        double distance, lightRadiance;
+        if (light->Intersect(ray, distance, lightRadiance) && distance < maxDist)
+        {
+            hitLight = light;
+            maxDist = distance;
+            radiance = lightRadiance;
+        }
+    }
+    if (!hitLight)
+        return false;
+
+    const double lightPdf = hitLight->GetPdf(ray.start, ray.start + ray.dir*maxDist) * hitLight->GetNumSamples();
+    outLight = Color(1, 1, 1) * float(radiance * PowerHeuristic(ray.pdf, lightPdf));
+    return true;
+}
+
+void ShadingHelper::TraceShadowPackets(const IntersectionInfo* const* points, int count, int packetSize)
+{
+    TracedShadows& traced = tracedShadows;
+    traced.current = -1;
+    traced.lights.clear();
+    for (const Light* light : scene.lights)
+        if (light->GetNumSamples() == 1)
+            traced.lights.push_back(light);
+
+    const size_t numLights = traced.lights.size();
+    traced.starts.resize(count);
+    traced.transparency.assign(count * numLights, 0.f);
+    for (int i = 0; i < count; ++i)
+        traced.starts[i] = points[i]->ip + points[i]->normal*1e-6; // as in SampleLight()
+
+    packetSize = std::max(1, std::min(packetSize, RayPacket::MAX_RAYS));
+    RayPacket packet;
+    double targetDistSq[RayPacket::MAX_RAYS];
+    for (size_t k = 0; k < numLights; ++k)
+    {
+        const Light& light = *traced.lights[k];
+        for (int first = 0; first < count; first += packetSize)
+        {
+            // the rays as GetShadowTransparency() would trace them (from SampleLight(), with its single sample)
+            const int n = std::min(packetSize, count - first);
+            uint64_t mask = 0;
+            packet.SetCount(n);
+            for (int j = 0; j < n; ++j)
+            {
+                const IntersectionInfo& info = *points[first + j];
+                Vector pos;
+                double intensity;
+                light.GetSample(VanDerCorput(0, 0), Sobol2(0, 0), info.ip, pos, intensity);
+                if (intensity <= 0)
+                    continue;
+
+                const Vector& start = traced.starts[first + j];
+                Ray ray;
+                ray.start = start;
+                ray.dir = Normalize(pos - start);
+                packet.SetRay(j, ray);
+                targetDistSq[j] = (pos - start).LengthSqr();
+                mask |= RayBit(j);
+            }
+            if (!mask)
+                continue;
+
+            float result[RayPacket::MAX_RAYS];
+            packet.ComputeBounds(mask);
+            scene.bvh.GetTransparency(packet, mask, targetDistSq, result);
+
+            ForEachRay(mask, [&](int j)
+            {
+                traced.transparency[(first + j)*numLights + k] = result[j];
+                ++traced.rays;
+            });
+            ++traced.packets;
+        }
+    }
+}
+
+void ShadingHelper::UseTracedShadows(int index)
+{
+    tracedShadows.current = index;
+}
+
+void ShadingHelper::PrintStatistics()
+{
+    // the current thread's statistics aren't flushed yet
+    const unsigned long long lookups = g_OccluderCacheLookups + occluderCache.lookups;
+    const unsigned long long hits = g_OccluderCacheHits + occluderCache.hits;
+    if (lookups)
+        printf("Shadow occluder cache: %.2lf%% hits (%llu of %llu shadow rays)\n", 100. * hits / lookups, hits, lookups);
+
+    const unsigned long long packetRays = g_PacketShadowRays + tracedShadows.rays;
+    const unsigned long long packets = g_ShadowPackets + tracedShadows.packets;
+    if (packets)
+        printf("Shadow ray packets: %llu rays in %llu packets (%.1lf rays per packet)\n", packetRays, packets, double(packetRays) / packets);
+}
@@ -1,17 +1,65 @@
 #ifndef RAYTRACING_SHADINGHELPER_H
 #define RAYTRACING_SHADINGHELPER_H
 
+#include "color.h"
+#include "constants.h"
+#include "ray.h"
+#include "vector.h"
+
 class IntersectionInfo;
-class Vector;
-class Light;
+class SecondaryRays;
+struct Light;
+
+struct LightSample
+{
+    Vector pos;          //!< a point on the light
+    double contribution; //!< light, reaching the shaded point (shadowing, distance falloff and sample weight included)
+    double pdf;          //!< (GI only) the density of the light's samples finding pos, per solid angle, all counted (0 - point light)
+};
 
 class ShadingHelper
 {
 public:
-    static double GetLightContribution(const IntersectionInfo& info, const Light& light);
+    /// Takes shadow samples of the light, as seen from the intersection point. Area lights take a few
+    /// probe samples first, and only take the full number of samples if the probes disagree (i.e. in the penumbra).
+    /// Only the samples which are (at least partially) visible are returned in outSamples; returns their count.
+    /// The samples live in a per-thread buffer, which is only valid until the next call.
+    static int SampleLight(const IntersectionInfo& info, const Light& light, const LightSample*& outSamples);
+
+    /// Traces the shadow rays from the given points (as they are shaded, i.e. bump mapped) to the lights which take a
+    /// single sample (e.g. point lights), packetSize points at a time, as ray packets (see RayPacket). The results
+    /// are kept (per thread), and SampleLight() uses those of the point selected with UseTracedShadows(), instead of
+    /// tracing the same rays one by one.
+    static void TraceShadowPackets(const IntersectionInfo* const* points, int count, int packetSize);
+
+    /// selects the point of the last TraceShadowPackets(), which is shaded next (-1: none)
+    static void UseTracedShadows(int index);
+
+    /// The indirect light a diffuse surface of the given color reflects: in GI, from the irradiance cache where it's
+    /// used (see IrradianceCache), or else from a diffuse ray (see GenerateDiffuseRay()); outside GI, the ambient light.
+    /// The caustics are added to either.
+    static Color GetDiffuseIndirectLight(const Ray& ray, const IntersectionInfo& info, const Color& diffuse, SecondaryRays& rays);
+
+    /// the caustics (from the photon map, if there is one) a diffuse surface of the given color reflects
+    static Color GetCaustics(const Ray& ray, const IntersectionInfo& info, const Color& diffuse);
+
+    /// GI: the ray a diffuse shader sends for the indirect light, in a cosine-distributed direction around the normal
+    /// (turned to the ray's side); its pdf is set, so the lights it hits are weighted against the light samples
+    static Ray GenerateDiffuseRay(const Ray& ray, const IntersectionInfo& info);
+
+    /// GI: the weight of the diffuse light from a light sample, against the diffuse rays finding the same light
+    /// (multiple importance sampling, by the power heuristic). 1 outside GI, for point lights, and where the irradiance
+    /// cache is used (its rays only bring the indirect light)
+    static double GetLightSampleWeight(const Ray& ray, const IntersectionInfo& info, const LightSample& sample);
+
+    /// GI: whether a diffuse ray (see GenerateDiffuseRay()) hits a light before maxDist; outLight is the light it
+    /// brings, weighted against the light samples of the shader which sent it
+    static bool HitLight(const Ray& ray, double maxDist, Color& outLight);
+
+    static void PrintStatistics(); //!< prints the shadow occluder cache hit rate, and how many shadow rays went in packets
 
 private:
-    static float GetShadowTransparency(const Vector& start, const Vector& end);
+    static float GetShadowTransparency(const Vector& start, const Vector& end, const Light& light);
 };
 
 #endif //RAYTRACING_SHADINGHELPER_H
@@ -0,0 +1,145 @@
+#include "tiledexroutput.h"
+
+#include <cstdio>
+#include <SDL.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfTiledOutputFile.h>
+#include <Iex.h>
+
+TiledEXROutput::TiledEXROutput()
+: m_Lock(SDL_CreateMutex())
+{
+}
+
+TiledEXROutput::~TiledEXROutput()
+{
+    Close();
+    SDL_DestroyMutex(m_Lock);
+}
+
+bool TiledEXROutput::Open(const char* filename, int frameWidth, int frameHeight, int tileSize)
+{
+    return Create(filename, frameWidth, frameHeight, tileSize, Rect(0, 0, frameWidth, frameHeight), false);
+}
+
+bool TiledEXROutput::OpenPartial(const char* filename, int frameWidth, int frameHeight, int tileSize, const Rect& dataWindow)
+{
+    return Create(filename, frameWidth, frameHeight, tileSize, dataWindow, true);
+}
+
+bool TiledEXROutput::Create(const char* filename, int frameWidth, int frameHeight, int tileSize, const Rect& dataWindow, bool hasAlpha)
+{
+    Close();
+
+    try
+    {
+        Imath::Box2i window;
+        window.min.x = dataWindow.x0;
+        window.min.y = dataWindow.y0;
+        window.max.x = dataWindow.x1 - 1;
+        window.max.y = dataWindow.y1 - 1;
+
+        Imf::Header header(frameWidth, frameHeight, window);
+        header.lineOrder() = Imf::RANDOM_Y;
+        header.setTileDescription(Imf::TileDescription(tileSize, tileSize, Imf::ONE_LEVEL));
+        header.channels().insert("R", Imf::Channel(Imf::FLOAT));
+        header.channels().insert("G", Imf::Channel(Imf::FLOAT));
+        header.channels().insert("B", Imf::Channel(Imf::FLOAT));
+        if (hasAlpha)
+            header.channels().insert("A", Imf::Channel(Imf::FLOAT));
+
+        m_File = new Imf::TiledOutputFile(filename, header);
+    }
+    catch (Iex::BaseExc& ex)
+    {
+        printf("Cannot create `%s': %s\n", filename, ex.what());
+        m_File = nullptr;
+        return false;
+    }
+
+    m_TileSize = tileSize;
+    m_DataWindow = dataWindow;
+    m_HasAlpha = hasAlpha;
+    m_NumTilesX = (dataWindow.w + tileSize - 1) / tileSize;
+    const int numTilesY = (dataWindow.h + tileSize - 1) / tileSize;
+    m_TileWritten.assign(static_cast<size_t>(m_NumTilesX) * numTilesY, false);
+    return true;
+}
+
+bool TiledEXROutput::WriteTile(const Rect& r, const Framebuffer& tile)
+{
+    MutexRAII raii(m_Lock);
+
+    if (!m_File)
+        return false;
+
+    const int tileX = (r.x0 - m_DataWindow.x0) / m_TileSize;
+    const int tileY = (r.y0 - m_DataWindow.y0) / m_TileSize;
+    return WriteTileLocked(tileX, tileY, r, &tile);
+}
+
+/// writes the pixels of r (from pixels, if given) to the tile (tileX, tileY); the rest of the tile is black
+bool TiledEXROutput::WriteTileLocked(int tileX, int tileY, const Rect& r, const Framebuffer* pixels)
+{
+    // the library reads the whole tile, with the slices in tile-relative coordinates
+    const int numChannels = m_HasAlpha ? 4 : 3;
+    const int tileOriginX = m_DataWindow.x0 + tileX * m_TileSize;
+    const int tileOriginY = m_DataWindow.y0 + tileY * m_TileSize;
+    std::vector<float> buffer(static_cast<size_t>(m_TileSize) * m_TileSize * numChannels, 0.f);
+    if (pixels)
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+            {
+                const Color& c = (*pixels)[y - r.y0][x - r.x0];
+                float* out = &buffer[((y - tileOriginY) * m_TileSize + (x - tileOriginX)) * numChannels];
+                out[0] = c.r;
+                out[1] = c.g;
+                out[2] = c.b;
+                if (m_HasAlpha)
+                    out[3] = 1.f;
+            }
+
+    char* base = reinterpret_cast<char*>(buffer.data());
+    const size_t xStride = sizeof(float) * numChannels;
+    const size_t yStride = xStride * m_TileSize;
+
+    Imf::FrameBuffer frameBuffer;
+    frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, base + 0*sizeof(float), xStride, yStride, 1, 1, 0.0, true, true));
+    frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, base + 1*sizeof(float), xStride, yStride, 1, 1, 0.0, true, true));
+    frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, base + 2*sizeof(float), xStride, yStride, 1, 1, 0.0, true, true));
+    if (m_HasAlpha)
+        frameBuffer.insert("A", Imf::Slice(Imf::FLOAT, base + 3*sizeof(float), xStride, yStride, 1, 1, 0.0, true, true));
+
+    try
+    {
+        m_File->setFrameBuffer(frameBuffer);
+        m_File->writeTile(tileX, tileY);
+    }
+    catch (Iex::BaseExc& ex)
+    {
+        printf("Cannot write a tile: %s\n", ex.what());
+        return false;
+    }
+
+    m_TileWritten[tileY * m_NumTilesX + tileX] = true;
+    return true;
+}
+
+void TiledEXROutput::Close()
+{
+    MutexRAII raii(m_Lock);
+
+    if (!m_File)
+        return;
+
+    // a file with missing tiles can't be read, so the unrendered ones are filled in
+    for (size_t i = 0; i < m_TileWritten.size(); ++i)
+        if (!m_TileWritten[i])
+            WriteTileLocked(int(i) % m_NumTilesX, int(i) / m_NumTilesX, Rect(0, 0, 0, 0), nullptr);
+
+    // the destructor completes the file (writes the tile offsets table)
+    delete m_File;
+    m_File = nullptr;
+}
@@ -0,0 +1,54 @@
+#ifndef RAYTRACING_TILEDEXROUTPUT_H
+#define RAYTRACING_TILEDEXROUTPUT_H
+
+#include "framebuffer.h"
+#include "sdl.h"
+
+#include <vector>
+
+namespace Imf { class TiledOutputFile; }
+
+/// Streams a render into a tiled OpenEXR file, one finished bucket at a time, so the whole frame never
+/// has to be in memory. The tiles are the buckets (the file's tile size is the bucket size), and they are
+/// written in whatever order they finish (the file uses RANDOM_Y line order, so the library doesn't
+/// have to hold any of them back).
+///
+/// A partial file (see OpenPartial()) only stores a part of the frame (its data window), and has an alpha
+/// channel, which is 1 for the rendered pixels and 0 for the rest; MergeEXRFiles() puts these together.
+class TiledEXROutput
+{
+public:
+    TiledEXROutput();
+    ~TiledEXROutput();
+
+    TiledEXROutput(const TiledEXROutput&) = delete;
+    TiledEXROutput& operator = (const TiledEXROutput&) = delete;
+
+    /// creates the file; the image has float R, G, B channels
+    bool Open(const char* filename, int frameWidth, int frameHeight, int tileSize);
+
+    /// creates a partial file, which stores the pixels in dataWindow (which has to be aligned to the tiles)
+    /// of a frameWidth x frameHeight frame. The image has float R, G, B and A channels.
+    bool OpenPartial(const char* filename, int frameWidth, int frameHeight, int tileSize, const Rect& dataWindow);
+
+    /// Writes the bucket r (which has to be within one tile; usually it's the whole tile), whose pixels are in
+    /// tile (tile[0][0] being the top-left pixel of r). Can be called from any thread.
+    bool WriteTile(const Rect& r, const Framebuffer& tile);
+
+    /// finishes the file; the tiles which were never written are written black (and with 0 alpha)
+    void Close();
+
+private:
+    Imf::TiledOutputFile* m_File = nullptr;
+    SDL_mutex* m_Lock = nullptr;
+    int m_TileSize = 0;
+    Rect m_DataWindow{0, 0, 0, 0};
+    bool m_HasAlpha = false;
+    int m_NumTilesX = 0;
+    std::vector<bool> m_TileWritten;
+
+    bool Create(const char* filename, int frameWidth, int frameHeight, int tileSize, const Rect& dataWindow, bool hasAlpha);
+    bool WriteTileLocked(int tileX, int tileY, const Rect& r, const Framebuffer* tile);
+};
+
+#endif //RAYTRACING_TILEDEXROUTPUT_H
@@ -16,6 +16,7 @@ public:
     void Scale(double x, double y, double z);
     void Rotate(double yaw, double pitch, double roll);
     void Translate(const Vector& v);
+    Vector GetTranslation() const { return m_Offset; }
 
     Vector Point(Vector p) const;
     Vector UndoPoint(Vector p) const;
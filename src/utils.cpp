@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <cctype>
@@ -34,6 +36,34 @@ std::string ExtensionUpper(const char* filename)
     return "";
 }
 
+std::string NumberedFilename(const std::string& filename, int number)
+{
+    char buffer[512];
+
+    // a printf-style counter is used only if it's the one conversion in the name (anything else in a format string,
+    // like `%s', would read arguments which aren't there)
+    const size_t percent = filename.find('%');
+    if (percent != std::string::npos && filename.find('%', percent + 1) == std::string::npos)
+    {
+        size_t end = percent + 1;
+        while (end < filename.length() && isdigit((unsigned char) filename[end]))
+            ++end;
+        if (end < filename.length() && filename[end] == 'd')
+        {
+            snprintf(buffer, sizeof(buffer), filename.c_str(), number);
+            return buffer;
+        }
+    }
+
+    size_t dot = filename.rfind('.');
+    const size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = filename.length();
+
+    snprintf(buffer, sizeof(buffer), "_%04d", number);
+    return filename.substr(0, dot) + buffer + filename.substr(dot);
+}
+
 bool FileExists(const char* filename)
 {
     char temp[512];
@@ -60,12 +90,73 @@ void OrthonormalSystem(const Vector& in, Vector& outRay1, Vector& outRay2)
     outRay2.Normalize();
 }
 
-void GenerateDiscPoint(double& outX, double& outY)
+void ConcentricDiscSample(double u, double v, double& outX, double& outY)
+{
+    // http://psgraphics.blogspot.com/2011/01/improved-code-for-concentric-map.html
+    const double a = 2*u - 1;
+    const double b = 2*v - 1;
+    if (a == 0 && b == 0)
+    {
+        outX = outY = 0;
+        return;
+    }
+
+    double radius, angle;
+    if (a*a > b*b)
+    {
+        radius = a;
+        angle = (PI/4) * (b/a);
+    }
+    else
+    {
+        radius = b;
+        angle = (PI/2) - (PI/4) * (a/b);
+    }
+
+    outX = radius * cos(angle);
+    outY = radius * sin(angle);
+}
+
+Vector CosineHemisphereSample(double u, double v, const Vector& normal)
+{
+    // Malley's method: the disc points, lifted up to the hemisphere
+    double x, y;
+    ConcentricDiscSample(u, v, x, y);
+    const double z = sqrt(std::max(0., 1 - x*x - y*y));
+
+    Vector a, b;
+    OrthonormalSystem(normal, a, b);
+    return a*x + b*y + normal*z;
+}
+
+Vector UniformSphereSample(double u, double v)
+{
+    // (Archimedes: z is uniform in [-1, 1])
+    const double z = 1 - 2*u;
+    const double r = sqrt(std::max(0., 1 - z*z));
+    const double phi = 2*PI*v;
+    return Vector(r*cos(phi), r*sin(phi), z);
+}
+
+double VanDerCorput(unsigned index, unsigned scramble)
 {
-    double angle = Random() * 2 * PI;
-    double radius = sqrt(Random());
-    outX = cos(angle) * radius;
-    outY = sin(angle) * radius;
+    // reverse the bits of the index
+    index = (index << 16) | (index >> 16);
+    index = ((index & 0x00ff00ff) << 8) | ((index & 0xff00ff00) >> 8);
+    index = ((index & 0x0f0f0f0f) << 4) | ((index & 0xf0f0f0f0) >> 4);
+    index = ((index & 0x33333333) << 2) | ((index & 0xcccccccc) >> 2);
+    index = ((index & 0x55555555) << 1) | ((index & 0xaaaaaaaa) >> 1);
+    index ^= scramble;
+    return (index >> 8) * (1. / (1u << 24));
+}
+
+double Sobol2(unsigned index, unsigned scramble)
+{
+    for (unsigned v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            scramble ^= v;
+
+    return (scramble >> 8) * (1. / (1u << 24));
 }
 
 int ToInt(const std::string& s)
@@ -123,3 +214,73 @@ std::vector<std::string> Split(const std::string& s, char separator)
 
     return result;
 }
+
+namespace
+{
+
+/// The 8-bit sRGB value only changes at 255 thresholds (the smallest floats which convert to 1, 2, ... 255), so a
+/// float is converted by looking up the value at the start of its slice of [0, 1) (slices are indexed by the exponent
+/// and the top mantissa bits), and stepping over the thresholds which fall in the slice (at most one or two).
+/// Both the values and the thresholds are found with ConvertTo8Bit_sRGB() itself, so the results are the same.
+class SRGBTable
+{
+public:
+    SRGBTable()
+    {
+        for (int i = 0; i < NUM_SLICES; ++i)
+            m_SliceStart[i] = static_cast<uint8_t>(ConvertTo8Bit_sRGB(FromBits(uint32_t(FIRST_SLICE + i) << SLICE_SHIFT)));
+
+        // for positive floats, the bit patterns are ordered as the values, so they can be bisected
+        const uint32_t oneBits = ToBits(1.f);
+        for (unsigned value = 1; value < 256; ++value)
+        {
+            uint32_t lo = 0, hi = oneBits; // ConvertTo8Bit_sRGB(hi) >= value
+            while (lo < hi)
+            {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (ConvertTo8Bit_sRGB(FromBits(mid)) >= value)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            m_Thresholds[value] = FromBits(lo);
+        }
+        m_Thresholds[0] = 0.f;
+        m_Thresholds[256] = 2.f; // never reached: the values >= 1 don't get here
+    }
+
+    unsigned Convert(float x) const
+    {
+        if (!(x >= MIN_VALUE)) // (NaNs too)
+            return 0;
+        if (x >= 1.f)
+            return 255;
+
+        unsigned value = m_SliceStart[(ToBits(x) >> SLICE_SHIFT) - FIRST_SLICE];
+        while (x >= m_Thresholds[value + 1])
+            ++value;
+        return value;
+    }
+
+private:
+    static const int MANTISSA_BITS = 7;                  //!< 128 slices per octave
+    static const int SLICE_SHIFT = 23 - MANTISSA_BITS;
+    static const int FIRST_EXPONENT = 127 - 13;          //!< below 2^-13, everything is 0 (2^-13 * 12.92 * 255 < 0.5)
+    static const int FIRST_SLICE = FIRST_EXPONENT << MANTISSA_BITS;
+    static const int NUM_SLICES = 13 << MANTISSA_BITS;   //!< [2^-13, 1)
+    const float MIN_VALUE = 1.f / 8192;
+
+    uint8_t m_SliceStart[NUM_SLICES];
+    float m_Thresholds[257];
+
+    static uint32_t ToBits(float x) { uint32_t bits; memcpy(&bits, &x, sizeof(bits)); return bits; }
+    static float FromBits(uint32_t bits) { float x; memcpy(&x, &bits, sizeof(x)); return x; }
+};
+
+} // namespace
+
+unsigned ConvertTo8Bit_sRGB_LUT(float x)
+{
+    static const SRGBTable table;
+    return table.Convert(x);
+}
@@ -28,11 +28,10 @@ inline double Clamp(const double x, const double a, const double b) { return std
 inline int Clamp(const int x, const int a, const int b) { return std::min(std::max(x, a), b); }
 inline bool IsBetween(const double x, const double lhs, const double rhs, const double eps = 1e-6) { return (lhs - eps <= x && x <= rhs + eps); }
 
-inline double Random() { return rand() / (double) RAND_MAX; }
-inline double Random(double from, double to) { return (Random()*std::max(from, to) + std::min(from, to)); }
-
 inline unsigned ConvertTo8Bit(double x) { return NearestInt(Clamp(x, 0.f, 1.f) * 255.f); }
 inline unsigned ConvertTo8Bit_sRGB(double x) { return ConvertTo8Bit(x <= 0.0031308 ? x*12.92 : 1.055*pow(x, 1/2.4) - 0.055); }
+/// the same as ConvertTo8Bit_sRGB() (exactly), for floats, with a lookup table instead of pow()
+unsigned ConvertTo8Bit_sRGB_LUT(float x);
 
 inline bool IsZero(double a, double eps = 1e-6) { return (-eps <= a && a <= eps); }
 inline bool IsZero(const Vector& a, double eps = 1e-6) { return (IsZero(a.x, eps) && IsZero(a.y, eps) && IsZero(a.z, eps)); }
@@ -48,6 +47,9 @@ std::vector<std::string> Split(const std::string& s, char separator);
 
 std::string UpCaseString(std::string s);
 std::string ExtensionUpper(const char* filename);
+/// the filename for the given frame of an animation: a printf-style pattern ("frame%03d.bmp", with a single `%' which
+/// is a %d conversion) is filled in, otherwise the number is inserted before the extension ("out.bmp" -> "out_0007.bmp")
+std::string NumberedFilename(const std::string& filename, int number);
 bool FileExists(const char* filename);
 
 class FileRAII {
@@ -67,6 +69,20 @@ public:
 /// unit, and are mutually orthogonal)
 void OrthonormalSystem(const Vector& in, Vector& outRay1, Vector& outRay2);
 
-void GenerateDiscPoint(double& outX, double& outY);
+/// maps a point from the unit square to the unit disc, so that stratified points stay stratified
+void ConcentricDiscSample(double u, double v, double& outX, double& outY);
+
+/// maps a point from the unit square to a direction in the hemisphere around (the unit) normal, with a density
+/// of cos(theta)/PI per solid angle
+Vector CosineHemisphereSample(double u, double v, const Vector& normal);
+
+/// maps a point from the unit square to a direction, uniformly distributed over the unit sphere
+Vector UniformSphereSample(double u, double v);
+
+/// The first two dimensions of the Sobol' (0, 2)-sequence, in [0..1). Each power-of-two prefix of
+/// the sequence is stratified, so any first 4 points cover the 2x2 strata, any first 16 - the 4x4, etc.
+/// `scramble' randomizes the points (by XOR-ing their bits) without breaking the stratification.
+double VanDerCorput(unsigned index, unsigned scramble = 0);
+double Sobol2(unsigned index, unsigned scramble = 0);
 
 #endif //RAYTRACING_UTILS_H
@@ -0,0 +1,276 @@
+#include "wavefront.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "camera.h"
+#include "environment.h"
+#include "geometry.h"
+#include "raypacket.h"
+#include "sampler.h"
+#include "scene.h"
+#include "shading.h"
+#include "shadinghelper.h"
+#include "texture.h"
+
+namespace
+{
+
+/// the camera samples are traced this many at a time, and the later generations' rays are intersected and shaded
+/// in chunks of this many, which bounds the size of the queues
+const size_t WAVEFRONT_SIZE = 4096;
+
+/// a ray waiting to be traced, with what is needed to shade its hit and add the result to its sample
+struct QueuedRay
+{
+    Ray ray;                //!< (with its throughput: the weight of its light in the pixel)
+    Sampler::State sampler; //!< where its random numbers start
+    unsigned sample;        //!< the camera sample it belongs to
+};
+
+struct Hit
+{
+    const Node* node;
+    IntersectionInfo info;
+    unsigned ray; //!< in the current queue
+};
+
+/// puts the rays spawned by the shaders into the next generation's queue
+class QueuedRays : public SecondaryRays
+{
+public:
+    explicit QueuedRays(std::vector<QueuedRay>& queue)
+    : m_Queue(queue)
+    {
+    }
+
+    /// the rays spawned from now on belong to the given sample, and the shader's result has the given weight (and
+    /// the shaded ray, the given budget)
+    void Start(unsigned sample, const Color& weight, double budget)
+    {
+        m_Sample = sample;
+        m_Weight = weight;
+        m_Budget = budget;
+    }
+
+protected:
+    virtual Color TraceRay(const Ray& ray, const Color&) override
+    {
+        m_Queue.push_back({ray, GetSampler().GetState(), m_Sample});
+        return Color(0, 0, 0);
+    }
+
+private:
+    std::vector<QueuedRay>& m_Queue;
+    unsigned m_Sample = 0;
+};
+
+/// the buffers of a thread's wavefront, kept between the calls
+struct Wavefront
+{
+    std::vector<QueuedRay> queue;                //!< the chunk of rays being traced
+    std::vector<std::vector<QueuedRay>> waiting; //!< per generation, the rays spawned, but not traced yet
+    std::vector<Hit> hits;
+    std::vector<unsigned> order;    //!< of the hits, by shader
+    std::vector<unsigned> tiles;    //!< the camera samples, by packet tile
+    std::vector<unsigned> packets;  //!< where each packet of camera rays starts in the queue
+    std::vector<const IntersectionInfo*> lit; //!< the hits whose shaders sample the lights
+    std::vector<int> shadows;       //!< of each hit, its index in `lit' (-1 if not there)
+};
+
+thread_local Wavefront wavefront;
+
+/// generates the camera rays of the samples into the queue. With packets, they are ordered by tiles of
+/// packetSize x packetSize pixels, and `packets' gets where each packet (a tile, or up to MAX_RAYS rays of it) starts.
+void GenerateStage(const CameraSample* samples, size_t count, unsigned packetSize, std::vector<unsigned>& tiles,
+                   std::vector<QueuedRay>& queue, std::vector<unsigned>& packets)
+{
+    // (each ray carries its sample's index, so the order they are traced in doesn't change the results)
+    auto tileOf = [&](unsigned i) { return std::make_pair(samples[i].y / int(packetSize), samples[i].x / int(packetSize)); };
+    tiles.resize(count);
+    for (unsigned i = 0; i < count; ++i)
+        tiles[i] = i;
+    if (packetSize > 1)
+        std::stable_sort(tiles.begin(), tiles.end(), [&](unsigned a, unsigned b) { return tileOf(a) < tileOf(b); });
+
+    Sampler& sampler = GetSampler();
+    queue.clear();
+    packets.clear();
+    for (unsigned i : tiles)
+    {
+        const CameraSample& s = samples[i];
+        sampler.StartSample(s.x, s.y, s.sampleIndex);
+
+        double dx = 0, dy = 0;
+        if (s.jitter)
+            sampler.Get2D(dx, dy);
+
+        if (packetSize > 1 && (packets.empty() || queue.size() - packets.back() == RayPacket::MAX_RAYS ||
+                               tileOf(queue.back().sample) != tileOf(i)))
+            packets.push_back(unsigned(queue.size()));
+
+        const Ray ray = scene.camera->GetScreenRay(s.x + dx, s.y + dy);
+        queue.push_back({ray, sampler.GetState(), i});
+    }
+}
+
+/// intersects the whole queue with the scene (in the given packets, if any); the rays which miss get the environment
+void IntersectStage(const std::vector<QueuedRay>& queue, const std::vector<unsigned>& packets, std::vector<Hit>& hits,
+                    Color* results)
+{
+    hits.clear();
+    auto addResult = [&](unsigned i, const Node* node, const IntersectionInfo& info)
+    {
+        const QueuedRay& queued = queue[i];
+        Color light;
+        if (ShadingHelper::HitLight(queued.ray, node ? info.distance : INF, light))
+        {
+            results[queued.sample] += queued.ray.throughput*light;
+        }
+        else if (node)
+        {
+            hits.push_back({node, info, i});
+            hits.back().info.rayDir = queued.ray.dir;
+        }
+        else if (scene.environment)
+        {
+            results[queued.sample] += queued.ray.throughput*scene.environment->GetEnvironment(queued.ray.dir);
+        }
+    };
+
+    if (packets.empty())
+    {
+        for (unsigned i = 0; i < queue.size(); ++i)
+        {
+            IntersectionInfo info;
+            const Node* node = scene.bvh.Intersect(queue[i].ray, info);
+            addResult(i, node, info);
+        }
+        return;
+    }
+
+    RayPacket packet;
+    const Node* nodes[RayPacket::MAX_RAYS];
+    IntersectionInfo infos[RayPacket::MAX_RAYS];
+    for (size_t p = 0; p < packets.size(); ++p)
+    {
+        const unsigned first = packets[p];
+        const unsigned end = p + 1 < packets.size() ? packets[p + 1] : unsigned(queue.size());
+        packet.Clear();
+        for (unsigned i = first; i < end; ++i)
+            packet.Add(queue[i].ray);
+        packet.ComputeBounds(packet.GetMask());
+
+        scene.bvh.IntersectPacket(packet, nodes, infos);
+        for (unsigned i = first; i < end; ++i)
+            addResult(i, nodes[i - first], infos[i - first]);
+    }
+}
+
+/// traces the shadow rays of the hits which sample the lights in packets, in queue order (where the neighbouring
+/// hits are those of neighbouring rays)
+void ShadowStage(std::vector<Hit>& hits, unsigned packetSize, std::vector<const IntersectionInfo*>& lit,
+                 std::vector<int>& shadows)
+{
+    lit.clear();
+    shadows.assign(hits.size(), -1);
+    for (unsigned i = 0; i < hits.size(); ++i)
+    {
+        // (the shader sees the bump mapped normal, so the shadow rays start off it)
+        Hit& hit = hits[i];
+        if (hit.node->bump)
+            hit.node->bump->ModifyNormal(hit.info);
+
+        if (packetSize > 1 && hit.node->shader->SamplesLights())
+        {
+            shadows[i] = int(lit.size());
+            lit.push_back(&hit.info);
+        }
+    }
+    if (!lit.empty())
+        ShadingHelper::TraceShadowPackets(lit.data(), int(lit.size()), int(packetSize*packetSize));
+}
+
+/// shades the hits (already bump mapped), grouped by shader, adding their results to the samples; the spawned rays
+/// are added to `next'
+void ShadeStage(const std::vector<QueuedRay>& queue, std::vector<Hit>& hits, const std::vector<int>& shadows,
+                std::vector<unsigned>& order, std::vector<QueuedRay>& next, Color* results)
+{
+    order.resize(hits.size());
+    for (unsigned i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&hits](unsigned a, unsigned b)
+    {
+        return hits[a].node->shader < hits[b].node->shader;
+    });
+
+    Sampler& sampler = GetSampler();
+    QueuedRays spawned(next);
+    for (unsigned index : order)
+    {
+        Hit& hit = hits[index];
+        const QueuedRay& queued = queue[hit.ray];
+        sampler.SetState(queued.sampler);
+        ShadingHelper::UseTracedShadows(shadows[index]);
+
+        spawned.Start(queued.sample, queued.ray.throughput, queued.ray.budget);
+        results[queued.sample] += queued.ray.throughput*hit.node->shader->Shade(queued.ray, hit.info, spawned);
+    }
+    ShadingHelper::UseTracedShadows(-1);
+}
+
+} // namespace
+
+bool ParseRenderEngine(const char* name, RenderEngine& outEngine)
+{
+    if (!strcmp(name, "recursive")) outEngine = RenderEngine::Recursive;
+    else if (!strcmp(name, "wavefront")) outEngine = RenderEngine::Wavefront;
+    else return false;
+    return true;
+}
+
+void TraceWavefront(const CameraSample* samples, size_t count, Color* results)
+{
+    Wavefront& w = wavefront;
+    const unsigned packetSize = scene.settings.packetSize;
+    for (size_t first = 0; first < count; first += WAVEFRONT_SIZE)
+    {
+        const size_t n = std::min(WAVEFRONT_SIZE, count - first);
+        Color* sampleResults = results + first;
+        std::fill(sampleResults, sampleResults + n, Color(0, 0, 0));
+
+        // only the camera rays (and the shadow rays of their hits) go in packets: the secondary ones aren't coherent
+        // enough to make up for it
+        GenerateStage(samples + first, n, packetSize, w.tiles, w.queue, w.packets);
+
+        // A generation can be many times larger than the one before it (e.g. glossy rays off glossy surfaces), so
+        // after the camera rays, the chunks are taken from the deepest generation which has rays waiting. A chunk's
+        // children are all traced before the next chunk of its generation is taken, so each generation's queue holds
+        // at most WAVEFRONT_SIZE times the most rays a hit spawns (e.g. a glossy reflection's numSamples), and there
+        // are about maxTraceDepth of them (instead of the whole ray tree of the camera rays)
+        size_t generation = 0;
+        for (;;)
+        {
+            if (w.waiting.size() < generation + 2)
+                w.waiting.resize(generation + 2);
+
+            IntersectStage(w.queue, w.packets, w.hits, sampleResults);
+            ShadowStage(w.hits, w.packets.empty() ? 1 : packetSize, w.lit, w.shadows);
+            ShadeStage(w.queue, w.hits, w.shadows, w.order, w.waiting[generation + 1], sampleResults);
+            w.packets.clear();
+
+            generation = w.waiting.size();
+            while (generation > 0 && w.waiting[generation - 1].empty())
+                --generation;
+            if (generation == 0)
+                break;
+
+            std::vector<QueuedRay>& rays = w.waiting[--generation];
+            const size_t chunk = std::min(WAVEFRONT_SIZE, rays.size());
+            w.queue.assign(rays.end() - chunk, rays.end());
+            rays.resize(rays.size() - chunk);
+        }
+    }
+}
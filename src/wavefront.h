@@ -0,0 +1,40 @@
+#ifndef RAYTRACING_WAVEFRONT_H
+#define RAYTRACING_WAVEFRONT_H
+
+#include <cstddef>
+
+#include "color.h"
+
+/// how the rays are traced
+enum class RenderEngine
+{
+    Recursive, //!< depth-first: each ray is intersected and shaded, and its secondary rays traced, before the next one
+    Wavefront  //!< in stages, over whole queues of rays (see TraceWavefront())
+};
+
+bool ParseRenderEngine(const char* name, RenderEngine& outEngine);
+
+/// a camera ray to trace: the sampleIndex-th sample of pixel (x, y); unless jittered, it goes through the pixel's corner
+struct CameraSample
+{
+    int x, y;
+    unsigned sampleIndex;
+    bool jitter;
+};
+
+/**
+ * Traces the camera samples with the wavefront engine, writing the color of samples[i] to results[i].
+ *
+ * Instead of following each ray's tree depth-first, the rays are processed a generation at a time: the camera rays
+ * are generated into a queue; the whole queue is intersected with the scene; the hits are sorted by shader, and
+ * shaded in that order (so each shader, its textures and bitmaps are used for a run of hits), and the reflected and
+ * refracted rays they spawn go into the next generation's queue, carrying the weight of their light in the pixel.
+ * That goes on until no rays are left (or maxTraceDepth is reached). The later generations are traced in chunks, the
+ * deepest first, so a generation which branches out a lot doesn't take memory in proportion to all of its rays.
+ *
+ * Each ray takes its random numbers from its own branch of the sample's sequence (see Sampler::Branch()), like the
+ * recursive engine does, so both produce the same image (up to the rounding of the different summation order).
+ */
+void TraceWavefront(const CameraSample* samples, size_t count, Color* results);
+
+#endif //RAYTRACING_WAVEFRONT_H